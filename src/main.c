@@ -24,6 +24,7 @@
 #endif
 
 #include <string.h>
+#include <unistd.h>
 #include <ctk/ctk.h>
 #include <gio/gio.h>
 #include <glib/gi18n.h>
@@ -34,6 +35,10 @@
 #endif
 
 #include "polkitcafelistener.h"
+#include "polkitcafeactioncache.h"
+#include "polkitcafeavatarloader.h"
+#include "polkitcafeavatarcache.h"
+#include "polkitcafedialogpool.h"
 
 /* session management support for auto-restart */
 #define SM_DBUS_NAME      "org.gnome.SessionManager"
@@ -48,8 +53,45 @@ static PolkitAuthority *authority = NULL;
 /* the session we are servicing */
 static PolkitSubject *session = NULL;
 
-/* the current set of temporary authorizations */
-static GList *current_temporary_authorizations = NULL;
+static PolkitAgentListener *listener = NULL;
+
+/* Startup happens in the main loop: the authority and the session are
+ * looked up at the same time and the agent is registered as soon as
+ * both are known. Registering with the session manager is not needed
+ * for that and runs on the side.
+ */
+static gint64 startup_time;
+static guint startup_pending = 0;
+static gint exit_status = 0;
+
+/* with --lazy-toolkit the display is only opened once something needs
+ * to be shown; most sessions never see an authentication dialog */
+static gboolean toolkit_initialized = FALSE;
+
+/* the current set of temporary authorizations, id ->
+ * PolkitTemporaryAuthorization; the keys are owned by the values */
+static GHashTable *current_temporary_authorizations = NULL;
+
+/* "changed" tends to come in bursts, e.g. while packages are installed;
+ * they are folded into one enumeration after a short delay, and at most
+ * one enumeration is in flight */
+#define TMP_AUTHZ_REFRESH_DELAY_MSEC 250
+static guint tmp_authz_refresh_id = 0;
+static gboolean tmp_authz_enumerating = FALSE;
+static gboolean tmp_authz_refresh_pending = FALSE;
+
+/* binary min-heap of the current temporary authorizations ordered by
+ * expiry time, and the one timer for the earliest of them; nothing is
+ * armed while there are none */
+static GPtrArray *tmp_authz_expiry_heap = NULL;
+static guint tmp_authz_expiry_id = 0;
+
+/* the menu of the icon, built once there are temporary authorizations,
+ * with an item per action, action id -> CtkMenuItem, and the timer
+ * refreshing the time left they show */
+static CtkWidget *tmp_authz_menu = NULL;
+static GHashTable *tmp_authz_items = NULL;
+static guint tmp_authz_tick_id = 0;
 
 #ifdef HAVE_APPINDICATOR
 static AppIndicator *app_indicator = NULL;
@@ -62,6 +104,100 @@ static GDBusProxy      *client_proxy = NULL;
 
 static  GMainLoop *loop;
 
+/* command line options */
+static gint accounts_timeout = 0;
+static gboolean avatar_thumbnails = FALSE;
+static gint max_concurrent = 0;
+static gchar **action_priorities = NULL;
+static gint max_queued = 0;
+static gint request_timeout = 0;
+static gint caller_burst = 0;
+static gboolean lazy_toolkit = FALSE;
+
+static GOptionEntry option_entries[] =
+{
+  { "accounts-timeout", 0, 0, G_OPTION_ARG_INT, &accounts_timeout,
+    N_("Milliseconds to wait for accounts-daemon before using the default user icon"), N_("MSEC") },
+  { "avatar-thumbnails", 0, 0, G_OPTION_ARG_NONE, &avatar_thumbnails,
+    N_("Keep scaled user icons in the cache directory"), NULL },
+  { "max-concurrent", 0, 0, G_OPTION_ARG_INT, &max_concurrent,
+    N_("Number of authentication dialogs that may be shown at the same time"), N_("N") },
+  { "max-queued", 0, 0, G_OPTION_ARG_INT, &max_queued,
+    N_("Number of authentication requests that may wait for a dialog before further ones are rejected"), N_("N") },
+  { "request-timeout", 0, 0, G_OPTION_ARG_INT, &request_timeout,
+    N_("Seconds after which an unanswered authentication request is cancelled; by default it never is"), N_("SEC") },
+  { "caller-burst", 0, 0, G_OPTION_ARG_INT, &caller_burst,
+    N_("Number of authentication dialogs a single process may open at once before its further requests are rejected; by default there is no limit"), N_("N") },
+  { "action-priority", 0, 0, G_OPTION_ARG_STRING_ARRAY, &action_priorities,
+    N_("Serve queued requests for ACTION, which may end in .* to match a prefix, by PRIORITY"), N_("ACTION=PRIORITY") },
+  { "lazy-toolkit", 0, 0, G_OPTION_ARG_NONE, &lazy_toolkit,
+    N_("Don't open the display until a dialog or the status icon has to be shown"), NULL },
+  { NULL }
+};
+
+/* resident set size in kB, or -1 if unknown */
+static glong
+get_rss_kb (void)
+{
+  gchar *contents;
+  gchar **fields;
+  glong ret;
+
+  ret = -1;
+  if (!g_file_get_contents ("/proc/self/statm", &contents, NULL, NULL))
+    goto out;
+
+  /* size resident shared text lib data dt, in pages */
+  fields = g_strsplit (contents, " ", 3);
+  if (fields[0] != NULL && fields[1] != NULL)
+    ret = g_ascii_strtoll (fields[1], NULL, 10) * (sysconf (_SC_PAGESIZE) / 1024);
+  g_strfreev (fields);
+  g_free (contents);
+
+ out:
+  return ret;
+}
+
+static void
+log_startup_phase (const gchar *phase)
+{
+  g_debug ("Startup (%s toolkit): %s after %.1f ms, RSS %ld kB",
+           lazy_toolkit ? "lazy" : "eager",
+           phase,
+           (g_get_monotonic_time () - startup_time) / 1000.0,
+           get_rss_kb ());
+}
+
+/* sets up everything that needs the display, in either mode */
+static void
+toolkit_ready (void)
+{
+  toolkit_initialized = TRUE;
+
+  /* the avatar cache follows the icon theme of the default screen, so
+   * it must not be created any earlier */
+  polkit_cafe_avatar_cache_set_use_thumbnails (polkit_cafe_avatar_cache_get_default (), avatar_thumbnails);
+
+  log_startup_phase ("toolkit initialized");
+}
+
+static gboolean
+ensure_toolkit (void)
+{
+  if (toolkit_initialized)
+    return TRUE;
+
+  /* the command line has been parsed by ctk_get_option_group() */
+  if (!ctk_init_check (NULL, NULL))
+    {
+      g_warning ("Cannot open the display");
+      return FALSE;
+    }
+  toolkit_ready ();
+
+  return TRUE;
+}
+
 static void
 revoke_tmp_authz_cb (GObject      *source_object,
 		     GAsyncResult *res,
@@ -90,14 +226,314 @@ revoke_tmp_authz (void)
                                                     NULL);
 }
 
-#ifdef HAVE_APPINDICATOR
 static void
-on_menu_item_activate (CtkMenuItem *menu_item,
-                       gpointer     user_data)
+revoke_tmp_authz_by_id_cb (GObject      *source_object,
+                           GAsyncResult *res,
+                           gpointer      user_data G_GNUC_UNUSED)
+{
+  GError *error;
+
+  error = NULL;
+  polkit_authority_revoke_temporary_authorization_by_id_finish (POLKIT_AUTHORITY (source_object),
+                                                                res,
+                                                                &error);
+  if (error != NULL)
+    {
+      g_warning ("Error revoking temporary authorization: %s", error->message);
+      g_error_free (error);
+    }
+}
+
+static void
+on_revoke_all_activate (CtkMenuItem *menu_item G_GNUC_UNUSED,
+                        gpointer     user_data G_GNUC_UNUSED)
 {
   revoke_tmp_authz ();
 }
-#else
+
+/* what the item for one action in the temporary authorization menu
+ * shows and drops */
+typedef struct
+{
+  gchar *action_id;
+
+  /* the action description, or its id until that is known */
+  gchar *name;
+
+  /* the PolkitTemporaryAuthorizations of the action */
+  GPtrArray *authzs;
+} TmpAuthzItem;
+
+static void
+tmp_authz_item_free (TmpAuthzItem *data)
+{
+  g_free (data->action_id);
+  g_free (data->name);
+  g_ptr_array_unref (data->authzs);
+  g_free (data);
+}
+
+static void
+on_revoke_action_activate (CtkMenuItem *menu_item,
+                           gpointer     user_data G_GNUC_UNUSED)
+{
+  TmpAuthzItem *data;
+  guint n;
+
+  data = g_object_get_data (G_OBJECT (menu_item), "tmp-authz-item");
+  for (n = 0; n < data->authzs->len; n++)
+    polkit_authority_revoke_temporary_authorization_by_id (authority,
+                                                           polkit_temporary_authorization_get_id (g_ptr_array_index (data->authzs, n)),
+                                                           NULL,
+                                                           revoke_tmp_authz_by_id_cb,
+                                                           NULL);
+}
+
+/* returns FALSE once the privilege of @item has expired */
+static gboolean
+update_tmp_authz_item_label (CtkWidget *item)
+{
+  TmpAuthzItem *data;
+  guint64 expires_at;
+  guint64 now;
+  guint minutes;
+  gchar *time_left;
+  gchar *label;
+  guint n;
+
+  data = g_object_get_data (G_OBJECT (item), "tmp-authz-item");
+  now = g_get_real_time () / G_USEC_PER_SEC;
+
+  expires_at = 0;
+  for (n = 0; n < data->authzs->len; n++)
+    expires_at = MAX (expires_at, polkit_temporary_authorization_get_time_expires (g_ptr_array_index (data->authzs, n)));
+
+  /* rounded up, so an item never claims no time is left while the
+   * privilege is still there */
+  minutes = expires_at > now ? (expires_at - now + 59) / 60 : 0;
+
+  time_left = g_strdup_printf (ngettext ("%u minute left", "%u minutes left", minutes), minutes);
+
+  /* the item drops all of them, so it says so rather than showing the
+   * time left of just one */
+  if (data->authzs->len == 1)
+    /* Translators: the first %s is the description of an action like "Mount a filesystem",
+     * the second the time left, e.g. "5 minutes left" */
+    label = g_strdup_printf (_("Drop \"%s\" (%s)"), data->name, time_left);
+  else
+    /* Translators: %u is the number of temporary authorizations, the first %s the description
+     * of an action like "Mount a filesystem", the second the time left of the one lasting longest */
+    label = g_strdup_printf (ngettext ("Drop %u authorization for \"%s\" (%s)",
+                                       "Drop all %u authorizations for \"%s\" (%s)",
+                                       data->authzs->len),
+                             data->authzs->len,
+                             data->name,
+                             time_left);
+  ctk_menu_item_set_label (CTK_MENU_ITEM (item), label);
+  g_free (label);
+  g_free (time_left);
+
+  return minutes > 0;
+}
+
+/* returns FALSE once all privileges in the menu have expired */
+static gboolean
+update_tmp_authz_menu_labels (void)
+{
+  GHashTableIter iter;
+  CtkWidget *item;
+  gboolean ticking;
+
+  ticking = FALSE;
+  g_hash_table_iter_init (&iter, tmp_authz_items);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &item))
+    {
+      if (update_tmp_authz_item_label (item))
+        ticking = TRUE;
+    }
+
+  return ticking;
+}
+
+static gboolean
+tmp_authz_menu_tick_cb (gpointer user_data G_GNUC_UNUSED)
+{
+  if (update_tmp_authz_menu_labels ())
+    return G_SOURCE_CONTINUE;
+
+  tmp_authz_tick_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
+static void
+on_tmp_authz_menu_show (CtkWidget *menu G_GNUC_UNUSED,
+                        gpointer   user_data G_GNUC_UNUSED)
+{
+  update_tmp_authz_menu_labels ();
+}
+
+static void
+tmp_authz_item_lookup_cb (GObject      *source_object,
+                          GAsyncResult *res,
+                          gpointer      user_data)
+{
+  CtkWidget *item = CTK_WIDGET (user_data);
+  PolkitActionDescription *action_desc;
+  TmpAuthzItem *data;
+
+  /* an action that is not installed any more keeps showing its id */
+  action_desc = polkit_cafe_action_cache_lookup_finish (POLKIT_CAFE_ACTION_CACHE (source_object),
+                                                        res,
+                                                        NULL);
+  if (action_desc != NULL)
+    {
+      data = g_object_get_data (G_OBJECT (item), "tmp-authz-item");
+      g_free (data->name);
+      data->name = g_strdup (polkit_action_description_get_description (action_desc));
+      update_tmp_authz_item_label (item);
+      g_object_unref (action_desc);
+    }
+
+  g_object_unref (item);
+}
+
+static void
+tmp_authz_menu_add (PolkitTemporaryAuthorization *authz)
+{
+  const gchar *action_id = polkit_temporary_authorization_get_action_id (authz);
+  GHashTableIter iter;
+  TmpAuthzItem *data;
+  const gchar *other_id;
+  CtkWidget *item;
+  gint position;
+
+  item = g_hash_table_lookup (tmp_authz_items, action_id);
+  if (item == NULL)
+    {
+      data = g_new0 (TmpAuthzItem, 1);
+      data->action_id = g_strdup (action_id);
+      data->name = g_strdup (action_id);
+      data->authzs = g_ptr_array_new_with_free_func (g_object_unref);
+
+      item = ctk_menu_item_new_with_label ("");
+      g_object_set_data_full (G_OBJECT (item),
+                              "tmp-authz-item",
+                              data,
+                              (GDestroyNotify) tmp_authz_item_free);
+      g_signal_connect (item,
+                        "activate",
+                        G_CALLBACK (on_revoke_action_activate),
+                        NULL);
+
+      /* the items come first, sorted by action id */
+      position = 0;
+      g_hash_table_iter_init (&iter, tmp_authz_items);
+      while (g_hash_table_iter_next (&iter, (gpointer *) &other_id, NULL))
+        {
+          if (g_strcmp0 (other_id, action_id) < 0)
+            position++;
+        }
+      ctk_menu_shell_insert (CTK_MENU_SHELL (tmp_authz_menu), item, position);
+      ctk_widget_show (item);
+      g_hash_table_insert (tmp_authz_items, data->action_id, item);
+
+      /* the agent looked the action up when it was authorized, so this
+       * normally completes from the cache right away */
+      polkit_cafe_action_cache_lookup (polkit_cafe_action_cache_get_default (),
+                                       authority,
+                                       action_id,
+                                       NULL,
+                                       tmp_authz_item_lookup_cb,
+                                       g_object_ref (item));
+    }
+
+  data = g_object_get_data (G_OBJECT (item), "tmp-authz-item");
+  g_ptr_array_add (data->authzs, g_object_ref (authz));
+  update_tmp_authz_item_label (item);
+
+  if (tmp_authz_tick_id == 0)
+    tmp_authz_tick_id = g_timeout_add_seconds (60, tmp_authz_menu_tick_cb, NULL);
+}
+
+static void
+tmp_authz_menu_remove (PolkitTemporaryAuthorization *authz)
+{
+  const gchar *id = polkit_temporary_authorization_get_id (authz);
+  TmpAuthzItem *data;
+  CtkWidget *item;
+  guint n;
+
+  item = g_hash_table_lookup (tmp_authz_items, polkit_temporary_authorization_get_action_id (authz));
+  if (item == NULL)
+    return;
+
+  data = g_object_get_data (G_OBJECT (item), "tmp-authz-item");
+  for (n = 0; n < data->authzs->len; n++)
+    {
+      if (g_strcmp0 (polkit_temporary_authorization_get_id (g_ptr_array_index (data->authzs, n)), id) == 0)
+        {
+          g_ptr_array_remove_index (data->authzs, n);
+          break;
+        }
+    }
+
+  if (data->authzs->len > 0)
+    {
+      update_tmp_authz_item_label (item);
+      return;
+    }
+
+  g_hash_table_remove (tmp_authz_items, data->action_id);
+  ctk_widget_destroy (item);
+
+  if (g_hash_table_size (tmp_authz_items) == 0 && tmp_authz_tick_id != 0)
+    {
+      g_source_remove (tmp_authz_tick_id);
+      tmp_authz_tick_id = 0;
+    }
+}
+
+/* One item per action, so a single elevated privilege can be dropped
+ * without having to authenticate again for all the others. The menu is
+ * built once, from the current temporary authorizations, and then kept
+ * up to date item by item. Items show the action description and the
+ * time left, which is refreshed when the menu is shown and once a
+ * minute while any privilege is left, since the AppIndicator menu stays
+ * up without being shown again.
+ */
+static void
+build_tmp_authz_menu (void)
+{
+  GHashTableIter iter;
+  PolkitTemporaryAuthorization *authz;
+  CtkWidget *item;
+
+  tmp_authz_menu = ctk_menu_new ();
+  g_object_ref_sink (tmp_authz_menu);
+  g_signal_connect (tmp_authz_menu,
+                    "show",
+                    G_CALLBACK (on_tmp_authz_menu_show),
+                    NULL);
+
+  ctk_menu_shell_append (CTK_MENU_SHELL (tmp_authz_menu), ctk_separator_menu_item_new ());
+
+  item = ctk_menu_item_new_with_label (_("Drop all elevated privileges"));
+  g_signal_connect (item,
+                    "activate",
+                    G_CALLBACK (on_revoke_all_activate),
+                    NULL);
+  ctk_menu_shell_append (CTK_MENU_SHELL (tmp_authz_menu), item);
+
+  ctk_widget_show_all (tmp_authz_menu);
+
+  tmp_authz_items = g_hash_table_new (g_str_hash, g_str_equal);
+
+  g_hash_table_iter_init (&iter, current_temporary_authorizations);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &authz))
+    tmp_authz_menu_add (authz);
+}
+
+#ifndef HAVE_APPINDICATOR
 static void
 on_status_icon_activate (CtkStatusIcon *status_icon G_GNUC_UNUSED,
 			 gpointer       user_data G_GNUC_UNUSED)
@@ -106,34 +542,47 @@ on_status_icon_activate (CtkStatusIcon *status_icon G_GNUC_UNUSED,
 }
 
 static void
-on_status_icon_popup_menu (CtkStatusIcon *status_icon G_GNUC_UNUSED,
-			   guint          button G_GNUC_UNUSED,
-			   guint          activate_time G_GNUC_UNUSED,
+on_status_icon_popup_menu (CtkStatusIcon *status_icon,
+			   guint          button,
+			   guint          activate_time,
 			   gpointer       user_data G_GNUC_UNUSED)
 {
-  revoke_tmp_authz ();
+  ctk_menu_popup (CTK_MENU (tmp_authz_menu),
+                  NULL,
+                  NULL,
+                  ctk_status_icon_position_menu,
+                  status_icon,
+                  button,
+                  activate_time);
 }
 #endif
 
+/* @added and @removed are the temporary authorizations that came and
+ * went since the last update */
 static void
-update_temporary_authorization_icon_real (void)
+update_temporary_authorization_icon_real (GList *added,
+                                          GList *removed)
 {
-
-#if 0
   GList *l;
-  g_debug ("have %d tmp authorizations", g_list_length (current_temporary_authorizations));
-  for (l = current_temporary_authorizations; l != NULL; l = l->next)
+
+  for (l = added; l != NULL; l = l->next)
     {
       PolkitTemporaryAuthorization *authz = POLKIT_TEMPORARY_AUTHORIZATION (l->data);
 
-      g_debug ("have tmp authz for action %s (subject %s) with id %s (obtained %d, expires %d)",
+      g_debug ("added tmp authz for action %s with id %s (obtained %d, expires %d)",
                polkit_temporary_authorization_get_action_id (authz),
-               polkit_subject_to_string (polkit_temporary_authorization_get_subject (authz)),
                polkit_temporary_authorization_get_id (authz),
                (gint) polkit_temporary_authorization_get_time_obtained (authz),
                (gint) polkit_temporary_authorization_get_time_expires (authz));
     }
-#endif
+  for (l = removed; l != NULL; l = l->next)
+    {
+      PolkitTemporaryAuthorization *authz = POLKIT_TEMPORARY_AUTHORIZATION (l->data);
+
+      g_debug ("removed tmp authz for action %s with id %s",
+               polkit_temporary_authorization_get_action_id (authz),
+               polkit_temporary_authorization_get_id (authz));
+    }
 
   /* TODO:
    *
@@ -148,43 +597,49 @@ update_temporary_authorization_icon_real (void)
    *   it seems cleaner to do this server side.
    */
 
-  if (current_temporary_authorizations != NULL)
+  if (g_hash_table_size (current_temporary_authorizations) > 0 && !ensure_toolkit ())
+    return;
+
+  /* the menu is built once there is something to show, and from then
+   * on only the items of the actions that changed are touched */
+  if (tmp_authz_menu != NULL)
+    {
+      for (l = added; l != NULL; l = l->next)
+        tmp_authz_menu_add (POLKIT_TEMPORARY_AUTHORIZATION (l->data));
+      for (l = removed; l != NULL; l = l->next)
+        tmp_authz_menu_remove (POLKIT_TEMPORARY_AUTHORIZATION (l->data));
+    }
+  else if (g_hash_table_size (current_temporary_authorizations) > 0)
+    {
+      build_tmp_authz_menu ();
+    }
+
+  if (g_hash_table_size (current_temporary_authorizations) > 0)
     {
       /* show icon */
 #ifdef HAVE_APPINDICATOR
       if (app_indicator == NULL)
         {
-          CtkWidget *item, *menu;
-
           app_indicator = app_indicator_new ("cafe-polkit",
                                              "dialog-password",
                                              APP_INDICATOR_CATEGORY_SYSTEM_SERVICES);
+          app_indicator_set_menu (app_indicator, CTK_MENU (tmp_authz_menu));
+        }
 
-          item = ctk_menu_item_new_with_label (_("Drop all elevated privileges"));
-          g_signal_connect (item,
-                            "activate",
-                            G_CALLBACK (on_menu_item_activate),
-                            NULL);
-          menu = ctk_menu_new ();
-          ctk_menu_shell_append (CTK_MENU_SHELL (menu), item);
-          ctk_widget_show_all (menu);
+      /*Reshow icon from existing appindicator */
+      app_indicator_set_status (app_indicator,
+                                APP_INDICATOR_STATUS_ACTIVE);
 
-          app_indicator_set_menu (app_indicator,
-                                  CTK_MENU (menu));
-          app_indicator_set_status (app_indicator,
-                                    APP_INDICATOR_STATUS_ACTIVE);
+#else
+      if (status_icon != NULL)
+        {
+          ctk_status_icon_set_visible (status_icon, TRUE);
         }
       else
-        /*Reshow icon from existing appindicator */
-        app_indicator_set_status (app_indicator,
-				    APP_INDICATOR_STATUS_ACTIVE);
-
-#else
-      if (status_icon == NULL)
         {
           status_icon = ctk_status_icon_new_from_icon_name ("dialog-password");
           ctk_status_icon_set_tooltip_text (status_icon,
-                                            _("Click the icon to drop all elevated privileges"));
+                                            _("Click the icon to drop all elevated privileges, right-click it to drop single ones"));
           g_signal_connect (status_icon,
                             "activate",
                             G_CALLBACK (on_status_icon_activate),
@@ -207,16 +662,171 @@ update_temporary_authorization_icon_real (void)
 				    APP_INDICATOR_STATUS_PASSIVE);
         }
 #else
+      /* kept for the next time there are temporary authorizations */
       if (status_icon != NULL)
+        ctk_status_icon_set_visible (status_icon, FALSE);
+#endif
+    }
+}
+
+static guint64
+expires (gconstpointer authz)
+{
+  return polkit_temporary_authorization_get_time_expires (POLKIT_TEMPORARY_AUTHORIZATION (authz));
+}
+
+static void
+expiry_heap_sift_up (guint index)
+{
+  GPtrArray *heap = tmp_authz_expiry_heap;
+  gpointer authz = g_ptr_array_index (heap, index);
+
+  while (index > 0)
+    {
+      guint parent = (index - 1) / 2;
+
+      if (expires (g_ptr_array_index (heap, parent)) <= expires (authz))
+        break;
+
+      g_ptr_array_index (heap, index) = g_ptr_array_index (heap, parent);
+      index = parent;
+    }
+  g_ptr_array_index (heap, index) = authz;
+}
+
+static void
+expiry_heap_sift_down (guint index)
+{
+  GPtrArray *heap = tmp_authz_expiry_heap;
+  gpointer authz = g_ptr_array_index (heap, index);
+
+  for (;;)
+    {
+      guint child = 2 * index + 1;
+
+      if (child >= heap->len)
+        break;
+      if (child + 1 < heap->len &&
+          expires (g_ptr_array_index (heap, child + 1)) < expires (g_ptr_array_index (heap, child)))
+        child++;
+      if (expires (authz) <= expires (g_ptr_array_index (heap, child)))
+        break;
+
+      g_ptr_array_index (heap, index) = g_ptr_array_index (heap, child);
+      index = child;
+    }
+  g_ptr_array_index (heap, index) = authz;
+}
+
+static void
+expiry_heap_push (PolkitTemporaryAuthorization *authz)
+{
+  g_ptr_array_add (tmp_authz_expiry_heap, authz);
+  expiry_heap_sift_up (tmp_authz_expiry_heap->len - 1);
+}
+
+static void
+expiry_heap_remove_index (guint index)
+{
+  GPtrArray *heap = tmp_authz_expiry_heap;
+  gpointer last;
+
+  last = g_ptr_array_index (heap, heap->len - 1);
+  g_ptr_array_set_size (heap, heap->len - 1);
+  if (index == heap->len)
+    return;
+
+  g_ptr_array_index (heap, index) = last;
+  expiry_heap_sift_up (index);
+  if (g_ptr_array_index (heap, index) == last)
+    expiry_heap_sift_down (index);
+}
+
+static PolkitTemporaryAuthorization *
+expiry_heap_pop (void)
+{
+  PolkitTemporaryAuthorization *top;
+
+  top = g_ptr_array_index (tmp_authz_expiry_heap, 0);
+  expiry_heap_remove_index (0);
+
+  return top;
+}
+
+/* there are only ever a few temporary authorizations */
+static void
+expiry_heap_remove (PolkitTemporaryAuthorization *authz)
+{
+  guint index;
+
+  for (index = 0; index < tmp_authz_expiry_heap->len; index++)
+    {
+      if (g_ptr_array_index (tmp_authz_expiry_heap, index) == authz)
         {
-          ctk_status_icon_set_visible (status_icon, FALSE);
-          g_object_unref (status_icon);
-          status_icon = NULL;
+          expiry_heap_remove_index (index);
+          return;
         }
-#endif
     }
 }
 
+static gboolean expire_temporary_authorizations_cb (gpointer user_data);
+
+static void
+arm_expiry_timer (void)
+{
+  guint64 now;
+  guint64 next;
+
+  if (tmp_authz_expiry_id != 0)
+    {
+      g_source_remove (tmp_authz_expiry_id);
+      tmp_authz_expiry_id = 0;
+    }
+
+  if (tmp_authz_expiry_heap->len == 0)
+    return;
+
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  next = expires (g_ptr_array_index (tmp_authz_expiry_heap, 0));
+
+  tmp_authz_expiry_id = g_timeout_add_seconds (next > now ? next - now : 0,
+                                               expire_temporary_authorizations_cb,
+                                               NULL);
+}
+
+/* polkitd doesn't say when temporary authorizations run out, so drop
+ * them locally instead of asking it again */
+static gboolean
+expire_temporary_authorizations_cb (gpointer user_data G_GNUC_UNUSED)
+{
+  GList *removed;
+  guint64 now;
+
+  tmp_authz_expiry_id = 0;
+
+  removed = NULL;
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  while (tmp_authz_expiry_heap->len > 0 &&
+         expires (g_ptr_array_index (tmp_authz_expiry_heap, 0)) <= now)
+    {
+      PolkitTemporaryAuthorization *authz = expiry_heap_pop ();
+
+      removed = g_list_prepend (removed, g_object_ref (authz));
+      g_hash_table_remove (current_temporary_authorizations,
+                           polkit_temporary_authorization_get_id (authz));
+    }
+
+  if (removed != NULL)
+    update_temporary_authorization_icon_real (NULL, removed);
+  g_list_free_full (removed, g_object_unref);
+
+  arm_expiry_timer ();
+
+  return FALSE;
+}
+
+static void start_temporary_authorizations_enumeration (PolkitAuthority *authority);
+
 static void
 enumerate_temporary_authorizations_cb (GObject      *source_object,
 				       GAsyncResult *res,
@@ -224,9 +834,20 @@ enumerate_temporary_authorizations_cb (GObject      *source_object,
 {
   PolkitAuthority *authority = POLKIT_AUTHORITY (source_object);
   GList *temporary_authorizations;
+  GHashTable *latest;
+  GHashTableIter iter;
+  GList *added;
+  GList *removed;
+  GList *l;
+  PolkitTemporaryAuthorization *authz;
   GError *error;
 
+  tmp_authz_enumerating = FALSE;
+
   temporary_authorizations = NULL;
+  added = NULL;
+  removed = NULL;
+  latest = NULL;
 
   error = NULL;
   temporary_authorizations = polkit_authority_enumerate_temporary_authorizations_finish (authority,
@@ -239,20 +860,72 @@ enumerate_temporary_authorizations_cb (GObject      *source_object,
       goto out;
     }
 
-  g_list_foreach (current_temporary_authorizations, (GFunc) g_object_unref, NULL);
-  g_list_free (current_temporary_authorizations);
+  latest = g_hash_table_new (g_str_hash, g_str_equal);
+  for (l = temporary_authorizations; l != NULL; l = l->next)
+    g_hash_table_insert (latest,
+                         (gpointer) polkit_temporary_authorization_get_id (l->data),
+                         l->data);
+
+  /* authorizations that are still there keep their objects, so the
+   * expiry heap and the menu only hear about the ones that came and
+   * went */
+  g_hash_table_iter_init (&iter, current_temporary_authorizations);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &authz))
+    {
+      if (g_hash_table_contains (latest, polkit_temporary_authorization_get_id (authz)))
+        continue;
+
+      removed = g_list_prepend (removed, g_object_ref (authz));
+      expiry_heap_remove (authz);
+      g_hash_table_iter_remove (&iter);
+    }
+
+  for (l = temporary_authorizations; l != NULL; l = l->next)
+    {
+      authz = POLKIT_TEMPORARY_AUTHORIZATION (l->data);
+
+      if (g_hash_table_contains (current_temporary_authorizations, polkit_temporary_authorization_get_id (authz)))
+        continue;
 
-  current_temporary_authorizations = temporary_authorizations;
+      g_hash_table_insert (current_temporary_authorizations,
+                           (gpointer) polkit_temporary_authorization_get_id (authz),
+                           g_object_ref (authz));
+      expiry_heap_push (authz);
+      added = g_list_prepend (added, authz);
+    }
 
-  update_temporary_authorization_icon_real ();
+  /* most "changed" signals are about something else entirely */
+  if (added != NULL || removed != NULL)
+    {
+      arm_expiry_timer ();
+      update_temporary_authorization_icon_real (added, removed);
+    }
 
  out:
-  ;
+  g_list_free (added);
+  g_list_free_full (removed, g_object_unref);
+  g_list_free_full (temporary_authorizations, g_object_unref);
+  if (latest != NULL)
+    g_hash_table_unref (latest);
+
+  if (tmp_authz_refresh_pending)
+    {
+      tmp_authz_refresh_pending = FALSE;
+      start_temporary_authorizations_enumeration (authority);
+    }
 }
 
 static void
-update_temporary_authorization_icon (PolkitAuthority *authority)
+start_temporary_authorizations_enumeration (PolkitAuthority *authority)
 {
+  /* changes made meanwhile may not be reflected in the result */
+  if (tmp_authz_enumerating)
+    {
+      tmp_authz_refresh_pending = TRUE;
+      return;
+    }
+
+  tmp_authz_enumerating = TRUE;
   polkit_authority_enumerate_temporary_authorizations (authority,
                                                        session,
                                                        NULL,
@@ -260,10 +933,33 @@ update_temporary_authorization_icon (PolkitAuthority *authority)
                                                        NULL);
 }
 
+static gboolean
+refresh_temporary_authorizations_cb (gpointer user_data)
+{
+  PolkitAuthority *authority = POLKIT_AUTHORITY (user_data);
+
+  tmp_authz_refresh_id = 0;
+  start_temporary_authorizations_enumeration (authority);
+
+  return FALSE;
+}
+
+static void
+update_temporary_authorization_icon (PolkitAuthority *authority)
+{
+  if (tmp_authz_refresh_id != 0)
+    return;
+
+  tmp_authz_refresh_id = g_timeout_add (TMP_AUTHZ_REFRESH_DELAY_MSEC,
+                                        refresh_temporary_authorizations_cb,
+                                        authority);
+}
+
 static void
 on_authority_changed (PolkitAuthority *authority,
 		      gpointer         user_data G_GNUC_UNUSED)
 {
+  polkit_cafe_action_cache_invalidate (polkit_cafe_action_cache_get_default (), authority);
   update_temporary_authorization_icon (authority);
 }
 
@@ -327,144 +1023,321 @@ signal_cb (GDBusProxy *proxy G_GNUC_UNUSED,
         }
 }
 
-static gboolean
-register_client_to_gnome_session (void)
+static void
+client_proxy_cb (GObject      *source_object G_GNUC_UNUSED,
+                 GAsyncResult *res,
+                 gpointer      user_data G_GNUC_UNUSED)
 {
-        GError     *error = NULL;
-        GVariant   *res;
-        const char *startup_id;
-        const char *app_id;
-        char       *client_id;
-
-        startup_id = g_getenv ("DESKTOP_AUTOSTART_ID");
-        app_id = "polkit-cafe-authentication-agent-1.desktop";
+        GError *error = NULL;
 
-        sm_proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  NULL, /* GDBusInterfaceInfo */
-                                                  SM_DBUS_NAME,
-                                                  SM_DBUS_PATH,
-                                                  SM_DBUS_INTERFACE,
-                                                  NULL, /* GCancellable */
-                                                  &error);
-        if (sm_proxy == NULL) {
-                g_message("Failed to get session manager: %s", error->message);
+        client_proxy = g_dbus_proxy_new_for_bus_finish (res, &error);
+        if (client_proxy == NULL) {
+                g_message("Failed to get client proxy: %s", error->message);
                 g_error_free (error);
-                return FALSE;
+                return;
         }
 
-        res = g_dbus_proxy_call_sync (sm_proxy,
-                                      "RegisterClient",
-                                      g_variant_new ("(ss)",
-                                                     app_id,
-                                                     startup_id),
-                                      G_DBUS_CALL_FLAGS_NONE,
-                                      -1, /* timeout */
-                                      NULL, /* GCancellable */
-                                      &error);
-        if (! res) {
+        g_signal_connect (client_proxy, "g-signal", G_CALLBACK (signal_cb), NULL);
+
+        log_startup_phase ("registered with the session manager");
+}
+
+static void
+register_client_cb (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data G_GNUC_UNUSED)
+{
+        GError     *error = NULL;
+        GVariant   *ret;
+        const char *client_id;
+
+        ret = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
+        if (! ret) {
                 g_warning ("Failed to register client: %s", error->message);
                 g_error_free (error);
-                return FALSE;
+                return;
         }
 
-        if (! g_variant_is_of_type (res, G_VARIANT_TYPE ("(o)"))) {
+        if (! g_variant_is_of_type (ret, G_VARIANT_TYPE ("(o)"))) {
                 g_warning ("RegisterClient returned unexpected type %s",
-                           g_variant_get_type_string (res));
-                return FALSE;
+                           g_variant_get_type_string (ret));
+                g_variant_unref (ret);
+                return;
         }
 
-        g_variant_get (res, "(&o)", &client_id);
+        g_variant_get (ret, "(&o)", &client_id);
+
+        g_dbus_proxy_new_for_bus (G_BUS_TYPE_SESSION,
+                                  G_DBUS_PROXY_FLAGS_NONE,
+                                  NULL, /* GDBusInterfaceInfo */
+                                  SM_DBUS_NAME,
+                                  client_id,
+                                  SM_CLIENT_DBUS_INTERFACE,
+                                  NULL, /* GCancellable */
+                                  client_proxy_cb,
+                                  NULL);
+        g_variant_unref (ret);
+}
+
+static void
+sm_proxy_cb (GObject      *source_object G_GNUC_UNUSED,
+             GAsyncResult *res,
+             gpointer      user_data G_GNUC_UNUSED)
+{
+        GError     *error = NULL;
+        const char *startup_id;
+        const char *app_id;
 
-        client_proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-                                                      G_DBUS_PROXY_FLAGS_NONE,
-                                                      NULL, /* GDBusInterfaceInfo */
-                                                      SM_DBUS_NAME,
-                                                      client_id,
-                                                      SM_CLIENT_DBUS_INTERFACE,
-                                                      NULL, /* GCancellable */
-                                                      &error);
-        g_variant_unref (res);
-        if (client_proxy == NULL) {
-                g_message("Failed to get client proxy: %s", error->message);
+        sm_proxy = g_dbus_proxy_new_for_bus_finish (res, &error);
+        if (sm_proxy == NULL) {
+                g_message("Failed to get session manager: %s", error->message);
                 g_error_free (error);
-                return FALSE;
+                return;
         }
 
-        g_signal_connect (client_proxy, "g-signal", G_CALLBACK (signal_cb), NULL);
+        startup_id = g_getenv ("DESKTOP_AUTOSTART_ID");
+        app_id = "polkit-cafe-authentication-agent-1.desktop";
 
-        return TRUE;
+        g_dbus_proxy_call (sm_proxy,
+                           "RegisterClient",
+                           g_variant_new ("(ss)",
+                                          app_id,
+                                          startup_id),
+                           G_DBUS_CALL_FLAGS_NONE,
+                           -1, /* timeout */
+                           NULL, /* GCancellable */
+                           register_client_cb,
+                           NULL);
 }
 
-int
-main (int argc, char **argv)
+static void
+register_client_to_gnome_session (void)
+{
+        g_dbus_proxy_new_for_bus (G_BUS_TYPE_SESSION,
+                                  G_DBUS_PROXY_FLAGS_NONE,
+                                  NULL, /* GDBusInterfaceInfo */
+                                  SM_DBUS_NAME,
+                                  SM_DBUS_PATH,
+                                  SM_DBUS_INTERFACE,
+                                  NULL, /* GCancellable */
+                                  sm_proxy_cb,
+                                  NULL);
+}
+
+static void
+fail_startup (void)
+{
+  exit_status = 1;
+  g_main_loop_quit (loop);
+}
+
+static void
+register_agent (void)
 {
-  gint ret;
-  PolkitAgentListener *listener;
   GError *error;
 
-  ctk_init (&argc, &argv);
+  /* there is no asynchronous variant of this */
+  error = NULL;
+  if (!polkit_agent_listener_register (listener,
+				       POLKIT_AGENT_REGISTER_FLAGS_NONE,
+                                       session,
+                                       "/org/cafe/PolicyKit1/AuthenticationAgent",
+				       NULL,
+                                       &error))
+    {
+      g_printerr ("Cannot register authentication agent: %s\n", error->message);
+      g_error_free (error);
+      fail_startup ();
+      return;
+    }
 
-  loop = NULL;
-  authority = NULL;
-  listener = NULL;
-  session = NULL;
-  ret = 1;
+  log_startup_phase ("agent registered");
 
-  bindtextdomain (GETTEXT_PACKAGE, CAFELOCALEDIR);
-#if HAVE_BIND_TEXTDOMAIN_CODESET
-  bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
-#endif
-  textdomain (GETTEXT_PACKAGE);
+  current_temporary_authorizations = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_object_unref);
+  tmp_authz_expiry_heap = g_ptr_array_new ();
+  start_temporary_authorizations_enumeration (authority);
 
-  loop = g_main_loop_new (NULL, FALSE);
+  /* build the first dialog while nothing is waiting for it, unless
+   * that is exactly what should be avoided */
+  if (toolkit_initialized)
+    polkit_cafe_dialog_pool_prewarm (polkit_cafe_dialog_pool_get_default ());
+}
+
+static void
+startup_step_done (void)
+{
+  /* the other step failed */
+  if (exit_status != 0)
+    return;
+
+  startup_pending--;
+  if (startup_pending == 0)
+    register_agent ();
+}
+
+static void
+authority_cb (GObject      *source_object G_GNUC_UNUSED,
+              GAsyncResult *res,
+              gpointer      user_data G_GNUC_UNUSED)
+{
+  GError *error;
 
   error = NULL;
-  authority = polkit_authority_get_sync (NULL /* GCancellable* */, &error);
+  authority = polkit_authority_get_finish (res, &error);
   if (authority == NULL)
     {
       g_warning ("Error getting authority: %s", error->message);
       g_error_free (error);
-      goto out;
+      fail_startup ();
+      return;
     }
   g_signal_connect (authority,
                     "changed",
                     G_CALLBACK (on_authority_changed),
                     NULL);
 
-  listener = polkit_cafe_listener_new ();
+  log_startup_phase ("got the authority");
+  startup_step_done ();
+}
+
+static void
+session_cb (GObject      *source_object G_GNUC_UNUSED,
+            GAsyncResult *res,
+            gpointer      user_data G_GNUC_UNUSED)
+{
+  GError *error;
 
   error = NULL;
-  session = polkit_unix_session_new_for_process_sync (getpid (), NULL, &error);
-  if (error != NULL)
+  session = polkit_unix_session_new_for_process_finish (res, &error);
+  if (session == NULL)
     {
       g_warning ("Unable to determine the session we are in: %s", error->message);
       g_error_free (error);
-      goto out;
+      fail_startup ();
+      return;
     }
 
+  log_startup_phase ("got the session");
+  startup_step_done ();
+}
+
+static gboolean
+set_action_priorities (PolkitCafeListener *listener)
+{
+  guint n;
+
+  for (n = 0; action_priorities != NULL && action_priorities[n] != NULL; n++)
+    {
+      gchar *sep;
+      gchar *end;
+      gint64 priority;
+
+      sep = strrchr (action_priorities[n], '=');
+      if (sep == NULL || sep == action_priorities[n])
+        goto invalid;
+
+      priority = g_ascii_strtoll (sep + 1, &end, 10);
+      if (end == sep + 1 || *end != '\0' || priority < G_MININT || priority > G_MAXINT)
+        goto invalid;
+
+      *sep = '\0';
+      polkit_cafe_listener_set_action_priority (listener, action_priorities[n], priority);
+      continue;
+
+    invalid:
+      g_printerr (_("Invalid action priority '%s', expected ACTION=PRIORITY\n"), action_priorities[n]);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+  gint ret;
+  GOptionContext *context;
+  GError *error;
+
+  startup_time = g_get_monotonic_time ();
+
+  loop = NULL;
+  authority = NULL;
+  listener = NULL;
+  session = NULL;
+  ret = 1;
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, option_entries, GETTEXT_PACKAGE);
+  /* toolkit options like --display are parsed now even with
+   * --lazy-toolkit; only opening the display waits */
+  g_option_context_add_group (context, ctk_get_option_group (FALSE));
   error = NULL;
-  if (!polkit_agent_listener_register (listener,
-				       POLKIT_AGENT_REGISTER_FLAGS_NONE,
-                                       session,
-                                       "/org/cafe/PolicyKit1/AuthenticationAgent",
-				       NULL,
-                                       &error))
+  if (!g_option_context_parse (context, &argc, &argv, &error))
     {
-      g_printerr ("Cannot register authentication agent: %s\n", error->message);
+      g_printerr ("%s\n", error->message);
       g_error_free (error);
+      g_option_context_free (context);
       goto out;
     }
+  g_option_context_free (context);
 
-  update_temporary_authorization_icon (authority);
+  if (!lazy_toolkit)
+    {
+      if (!ctk_init_check (&argc, &argv))
+        {
+          g_printerr ("Cannot open the display\n");
+          goto out;
+        }
+      toolkit_ready ();
+    }
+
+  polkit_cafe_avatar_loader_set_timeout (polkit_cafe_avatar_loader_get_default (), accounts_timeout);
+  polkit_cafe_dialog_pool_set_init_func (polkit_cafe_dialog_pool_get_default (), ensure_toolkit);
+
+  bindtextdomain (GETTEXT_PACKAGE, CAFELOCALEDIR);
+#if HAVE_BIND_TEXTDOMAIN_CODESET
+  bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
+#endif
+  textdomain (GETTEXT_PACKAGE);
+
+  loop = g_main_loop_new (NULL, FALSE);
 
-  register_client_to_gnome_session();
+  listener = polkit_cafe_listener_new ();
+  polkit_cafe_listener_set_max_concurrent (POLKIT_CAFE_LISTENER (listener), MAX (max_concurrent, 0));
+  polkit_cafe_listener_set_max_queued (POLKIT_CAFE_LISTENER (listener), MAX (max_queued, 0));
+  polkit_cafe_listener_set_request_timeout (POLKIT_CAFE_LISTENER (listener), MAX (request_timeout, 0));
+  polkit_cafe_listener_set_caller_burst (POLKIT_CAFE_LISTENER (listener), MAX (caller_burst, 0));
+  if (!set_action_priorities (POLKIT_CAFE_LISTENER (listener)))
+    goto out;
+
+  startup_pending = 2;
+  polkit_authority_get_async (NULL /* GCancellable* */, authority_cb, NULL);
+  polkit_unix_session_new_for_process (getpid (), NULL /* GCancellable* */, session_cb, NULL);
+
+  register_client_to_gnome_session ();
 
   g_main_loop_run (loop);
 
-  ret = 0;
+  ret = exit_status;
 
  out:
+  if (tmp_authz_refresh_id != 0)
+    g_source_remove (tmp_authz_refresh_id);
+  if (tmp_authz_expiry_id != 0)
+    g_source_remove (tmp_authz_expiry_id);
+  if (tmp_authz_tick_id != 0)
+    g_source_remove (tmp_authz_tick_id);
+  if (tmp_authz_menu != NULL)
+    {
+      ctk_widget_destroy (tmp_authz_menu);
+      g_object_unref (tmp_authz_menu);
+      g_hash_table_unref (tmp_authz_items);
+    }
+  if (tmp_authz_expiry_heap != NULL)
+    g_ptr_array_unref (tmp_authz_expiry_heap);
+  if (current_temporary_authorizations != NULL)
+    g_hash_table_unref (current_temporary_authorizations);
   if (authority != NULL)
     g_object_unref (authority);
   if (session != NULL)
@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "config.h"
+
+#include <polkit/polkit.h>
+
+#include "polkitcafeactioncache.h"
+
+struct _PolkitCafeActionCache
+{
+  GObject parent_instance;
+
+  /* action id -> PolkitActionDescription; the keys are owned by the values */
+  GHashTable *descriptions;
+  gboolean populated;
+
+  /* action ids the last enumeration did not have; looking them up again
+   * fails right away until the authority changes */
+  GHashTable *unknown;
+
+  /* at most one enumeration is in flight; lookups that miss while it
+   * runs wait for it and invalidations are folded into a single
+   * follow-up refresh
+   */
+  gboolean enumerating;
+  gboolean refresh_pending;
+  GList *waiters;
+
+  guint hits;
+  guint misses;
+};
+
+struct _PolkitCafeActionCacheClass
+{
+  GObjectClass parent_class;
+};
+
+/* forget all unknown action ids rather than growing without bound if
+ * there are more than this many */
+#define MAX_UNKNOWN 256
+
+G_DEFINE_TYPE (PolkitCafeActionCache, polkit_cafe_action_cache, G_TYPE_OBJECT);
+
+static void start_enumeration (PolkitCafeActionCache *cache,
+                               PolkitAuthority       *authority);
+
+typedef struct
+{
+  gchar *action_id;
+  gulong cancel_id;
+} LookupData;
+
+static void
+lookup_data_free (LookupData *data)
+{
+  g_free (data->action_id);
+  g_free (data);
+}
+
+static void
+polkit_cafe_action_cache_init (PolkitCafeActionCache *cache)
+{
+  cache->descriptions = g_hash_table_new_full (g_str_hash,
+                                               g_str_equal,
+                                               NULL,
+                                               g_object_unref);
+  cache->unknown = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+static void
+polkit_cafe_action_cache_finalize (GObject *object)
+{
+  PolkitCafeActionCache *cache;
+
+  cache = POLKIT_CAFE_ACTION_CACHE (object);
+
+  g_hash_table_unref (cache->descriptions);
+  g_hash_table_unref (cache->unknown);
+
+  if (G_OBJECT_CLASS (polkit_cafe_action_cache_parent_class)->finalize != NULL)
+    G_OBJECT_CLASS (polkit_cafe_action_cache_parent_class)->finalize (object);
+}
+
+static void
+polkit_cafe_action_cache_class_init (PolkitCafeActionCacheClass *klass)
+{
+  GObjectClass *gobject_class;
+
+  gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = polkit_cafe_action_cache_finalize;
+}
+
+/**
+ * polkit_cafe_action_cache_get_default:
+ *
+ * Gets the process-wide action description cache.
+ *
+ * Returns: A #PolkitCafeActionCache. Do not unref.
+ **/
+PolkitCafeActionCache *
+polkit_cafe_action_cache_get_default (void)
+{
+  static PolkitCafeActionCache *default_cache = NULL;
+
+  if (default_cache == NULL)
+    default_cache = POLKIT_CAFE_ACTION_CACHE (g_object_new (POLKIT_CAFE_TYPE_ACTION_CACHE, NULL));
+
+  return default_cache;
+}
+
+/* takes ownership of @action_descs */
+static void
+cache_fill (PolkitCafeActionCache *cache,
+            GList                 *action_descs)
+{
+  GList *l;
+
+  g_hash_table_remove_all (cache->descriptions);
+  g_hash_table_remove_all (cache->unknown);
+
+  for (l = action_descs; l != NULL; l = l->next)
+    {
+      PolkitActionDescription *action_desc = POLKIT_ACTION_DESCRIPTION (l->data);
+
+      /* the list reference is handed over to the table */
+      g_hash_table_insert (cache->descriptions,
+                           (gpointer) polkit_action_description_get_action_id (action_desc),
+                           action_desc);
+    }
+  g_list_free (action_descs);
+
+  cache->populated = TRUE;
+}
+
+static void
+complete_lookup (PolkitCafeActionCache *cache,
+                 GTask                 *task)
+{
+  LookupData *data = g_task_get_task_data (task);
+  const gchar *action_id = data->action_id;
+  PolkitActionDescription *action_desc;
+
+  action_desc = g_hash_table_lookup (cache->descriptions, action_id);
+  if (action_desc == NULL)
+    {
+      if (g_hash_table_size (cache->unknown) >= MAX_UNKNOWN)
+        g_hash_table_remove_all (cache->unknown);
+      g_hash_table_add (cache->unknown, g_strdup (action_id));
+
+      g_task_return_new_error (task,
+                               POLKIT_ERROR,
+                               POLKIT_ERROR_FAILED,
+                               "No action description for %s",
+                               action_id);
+      return;
+    }
+
+  g_task_return_pointer (task, g_object_ref (action_desc), g_object_unref);
+}
+
+/* a waiter that is cancelled is completed right away instead of when
+ * the enumeration it waits for finishes */
+static void
+waiter_cancelled_cb (GCancellable *cancellable,
+                     gpointer      user_data)
+{
+  GTask *task = G_TASK (user_data);
+  PolkitCafeActionCache *cache = POLKIT_CAFE_ACTION_CACHE (g_task_get_source_object (task));
+  LookupData *data = g_task_get_task_data (task);
+
+  g_signal_handler_disconnect (cancellable, data->cancel_id);
+  data->cancel_id = 0;
+
+  cache->waiters = g_list_remove (cache->waiters, task);
+  g_task_return_error_if_cancelled (task);
+  g_object_unref (task);
+}
+
+static void
+disconnect_waiter (GTask *task)
+{
+  LookupData *data = g_task_get_task_data (task);
+
+  if (data->cancel_id == 0)
+    return;
+
+  g_signal_handler_disconnect (g_task_get_cancellable (task), data->cancel_id);
+  data->cancel_id = 0;
+}
+
+static void
+enumerate_cb (GObject      *source_object,
+              GAsyncResult *res,
+              gpointer      user_data)
+{
+  PolkitCafeActionCache *cache = POLKIT_CAFE_ACTION_CACHE (user_data);
+  PolkitAuthority *authority = POLKIT_AUTHORITY (source_object);
+  GList *action_descs;
+  GList *waiters;
+  GList *l;
+  GError *error;
+
+  cache->enumerating = FALSE;
+
+  waiters = cache->waiters;
+  cache->waiters = NULL;
+
+  /* before any callback runs and possibly cancels another waiter */
+  g_list_foreach (waiters, (GFunc) disconnect_waiter, NULL);
+
+  error = NULL;
+  action_descs = polkit_authority_enumerate_actions_finish (authority, res, &error);
+  if (error != NULL)
+    {
+      g_warning ("Error enumerating action descriptions: %s", error->message);
+
+      /* don't serve possibly stale entries; the next lookup re-enumerates */
+      g_hash_table_remove_all (cache->descriptions);
+      g_hash_table_remove_all (cache->unknown);
+      cache->populated = FALSE;
+
+      for (l = waiters; l != NULL; l = l->next)
+        g_task_return_error (G_TASK (l->data), g_error_copy (error));
+
+      g_error_free (error);
+    }
+  else
+    {
+      cache_fill (cache, action_descs);
+
+      for (l = waiters; l != NULL; l = l->next)
+        complete_lookup (cache, G_TASK (l->data));
+    }
+
+  g_list_free_full (waiters, g_object_unref);
+
+  if (cache->refresh_pending)
+    {
+      cache->refresh_pending = FALSE;
+      start_enumeration (cache, authority);
+    }
+
+  g_object_unref (cache);
+}
+
+static void
+start_enumeration (PolkitCafeActionCache *cache,
+                   PolkitAuthority       *authority)
+{
+  cache->enumerating = TRUE;
+  polkit_authority_enumerate_actions (authority,
+                                      NULL,
+                                      enumerate_cb,
+                                      g_object_ref (cache));
+}
+
+/**
+ * polkit_cafe_action_cache_lookup:
+ * @cache: A #PolkitCafeActionCache.
+ * @authority: The #PolkitAuthority to enumerate actions from on a cache miss.
+ * @action_id: The action to look up.
+ * @cancellable: A #GCancellable or %NULL.
+ * @callback: Function to call when the lookup is complete.
+ * @user_data: Data to pass to @callback.
+ *
+ * Looks up the description for @action_id. The authority is only asked
+ * to enumerate its actions if the cache is empty or does not know about
+ * @action_id yet, e.g. because the action was installed after the last
+ * enumeration. An action id the last enumeration did not have fails
+ * right away until polkit_cafe_action_cache_invalidate() is called.
+ * Lookups that miss while an enumeration is in flight
+ * share it; cancelling one of them completes it right away without
+ * disturbing the others.
+ **/
+void
+polkit_cafe_action_cache_lookup (PolkitCafeActionCache *cache,
+                                 PolkitAuthority       *authority,
+                                 const gchar           *action_id,
+                                 GCancellable          *cancellable,
+                                 GAsyncReadyCallback    callback,
+                                 gpointer               user_data)
+{
+  GTask *task;
+  LookupData *data;
+
+  task = g_task_new (G_OBJECT (cache), cancellable, callback, user_data);
+  g_task_set_source_tag (task, polkit_cafe_action_cache_lookup);
+  data = g_new0 (LookupData, 1);
+  data->action_id = g_strdup (action_id);
+  g_task_set_task_data (task, data, (GDestroyNotify) lookup_data_free);
+
+  /* an action the authority did not have when it last changed is not
+   * going to be there now either */
+  if (g_hash_table_contains (cache->descriptions, action_id) ||
+      g_hash_table_contains (cache->unknown, action_id))
+    {
+      cache->hits++;
+      complete_lookup (cache, task);
+      g_object_unref (task);
+      return;
+    }
+
+  cache->misses++;
+
+  g_debug ("Action cache miss for %s (hits=%u misses=%u)",
+           action_id, cache->hits, cache->misses);
+
+  if (g_task_return_error_if_cancelled (task))
+    {
+      g_object_unref (task);
+      return;
+    }
+
+  /* the reference is released once the enumeration completes or the
+   * lookup is cancelled */
+  cache->waiters = g_list_append (cache->waiters, task);
+  if (cancellable != NULL)
+    data->cancel_id = g_signal_connect (cancellable,
+                                        "cancelled",
+                                        G_CALLBACK (waiter_cancelled_cb),
+                                        task);
+
+  if (!cache->enumerating)
+    start_enumeration (cache, authority);
+}
+
+/**
+ * polkit_cafe_action_cache_lookup_finish:
+ * @cache: A #PolkitCafeActionCache.
+ * @res: A #GAsyncResult obtained from the #GAsyncReadyCallback passed to polkit_cafe_action_cache_lookup().
+ * @error: Return location for error or %NULL.
+ *
+ * Finishes looking up an action description.
+ *
+ * Returns: A #PolkitActionDescription (free with g_object_unref()) or %NULL if @error is set.
+ **/
+PolkitActionDescription *
+polkit_cafe_action_cache_lookup_finish (PolkitCafeActionCache  *cache G_GNUC_UNUSED,
+                                        GAsyncResult           *res,
+                                        GError                **error)
+{
+  GTask *task = G_TASK (res);
+
+  g_warn_if_fail (g_task_get_source_tag (task) == polkit_cafe_action_cache_lookup);
+
+  return g_task_propagate_pointer (task, error);
+}
+
+/**
+ * polkit_cafe_action_cache_invalidate:
+ * @cache: A #PolkitCafeActionCache.
+ * @authority: The #PolkitAuthority that changed.
+ *
+ * Refreshes @cache in the background. Lookups keep being served from
+ * the previous contents until the refresh completes. Call this whenever
+ * @authority emits the #PolkitAuthority::changed signal.
+ **/
+void
+polkit_cafe_action_cache_invalidate (PolkitCafeActionCache *cache,
+                                     PolkitAuthority       *authority)
+{
+  /* the action may have been installed */
+  g_hash_table_remove_all (cache->unknown);
+
+  /* nothing to refresh - the first lookup will fill the cache */
+  if (!cache->populated)
+    return;
+
+  if (cache->enumerating)
+    {
+      cache->refresh_pending = TRUE;
+      return;
+    }
+
+  start_enumeration (cache, authority);
+}
+
+/**
+ * polkit_cafe_action_cache_get_stats:
+ * @cache: A #PolkitCafeActionCache.
+ * @out_hits: Return location for the number of lookups served from the cache or %NULL.
+ * @out_misses: Return location for the number of lookups that had to enumerate actions or %NULL.
+ *
+ * Gets the hit and miss counters of @cache.
+ **/
+void
+polkit_cafe_action_cache_get_stats (PolkitCafeActionCache *cache,
+                                    guint                 *out_hits,
+                                    guint                 *out_misses)
+{
+  if (out_hits != NULL)
+    *out_hits = cache->hits;
+  if (out_misses != NULL)
+    *out_misses = cache->misses;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __POLKIT_CAFE_ACTION_CACHE_H
+#define __POLKIT_CAFE_ACTION_CACHE_H
+
+#include <polkit/polkit.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POLKIT_CAFE_TYPE_ACTION_CACHE          (polkit_cafe_action_cache_get_type())
+#define POLKIT_CAFE_ACTION_CACHE(o)            (G_TYPE_CHECK_INSTANCE_CAST ((o), POLKIT_CAFE_TYPE_ACTION_CACHE, PolkitCafeActionCache))
+#define POLKIT_CAFE_ACTION_CACHE_CLASS(k)      (G_TYPE_CHECK_CLASS_CAST((k), POLKIT_CAFE_TYPE_ACTION_CACHE, PolkitCafeActionCacheClass))
+#define POLKIT_CAFE_ACTION_CACHE_GET_CLASS(o)  (G_TYPE_INSTANCE_GET_CLASS ((o), POLKIT_CAFE_TYPE_ACTION_CACHE, PolkitCafeActionCacheClass))
+#define POLKIT_CAFE_IS_ACTION_CACHE(o)         (G_TYPE_CHECK_INSTANCE_TYPE ((o), POLKIT_CAFE_TYPE_ACTION_CACHE))
+#define POLKIT_CAFE_IS_ACTION_CACHE_CLASS(k)   (G_TYPE_CHECK_CLASS_TYPE ((k), POLKIT_CAFE_TYPE_ACTION_CACHE))
+
+typedef struct _PolkitCafeActionCache PolkitCafeActionCache;
+typedef struct _PolkitCafeActionCacheClass PolkitCafeActionCacheClass;
+
+GType                     polkit_cafe_action_cache_get_type      (void) G_GNUC_CONST;
+PolkitCafeActionCache    *polkit_cafe_action_cache_get_default   (void);
+void                      polkit_cafe_action_cache_lookup        (PolkitCafeActionCache  *cache,
+                                                                  PolkitAuthority        *authority,
+                                                                  const gchar            *action_id,
+                                                                  GCancellable           *cancellable,
+                                                                  GAsyncReadyCallback     callback,
+                                                                  gpointer                user_data);
+PolkitActionDescription  *polkit_cafe_action_cache_lookup_finish (PolkitCafeActionCache  *cache,
+                                                                  GAsyncResult           *res,
+                                                                  GError                **error);
+void                      polkit_cafe_action_cache_invalidate    (PolkitCafeActionCache  *cache,
+                                                                  PolkitAuthority        *authority);
+void                      polkit_cafe_action_cache_get_stats     (PolkitCafeActionCache  *cache,
+                                                                  guint                  *out_hits,
+                                                                  guint                  *out_misses);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __POLKIT_CAFE_ACTION_CACHE_H */
@@ -38,18 +38,52 @@
 #include <ctk/ctk.h>
 
 #include "polkitcafeauthenticationdialog.h"
+#include "polkitcafeidentityresolver.h"
+#include "polkitcafeavatarloader.h"
+#include "polkitcafeavatarcache.h"
+#include "polkitcafeuserchooser.h"
 
-#define RESPONSE_USER_SELECTED 1001
+/* with more users than this, real names and faces are filled in from an
+ * idle handler using at most INCREMENTAL_FILL_BUDGET_USEC per iteration
+ */
+#define INCREMENTAL_FILL_THRESHOLD 8
+#define INCREMENTAL_FILL_BUDGET_USEC 4000
+
+/* with more users than this, a PolkitCafeUserChooser is used instead of
+ * the combobox
+ */
+#define USER_CHOOSER_THRESHOLD 50
+
+/* the error shake alternates between two offsets (or two opacities when
+ * a compositing manager is running) SHAKE_STEPS times, driven by the
+ * frame clock
+ */
+#define SHAKE_STEPS 10
+#define SHAKE_STEP_USEC 40000
+#define SHAKE_OFFSET 15
+#define SHAKE_OPACITY 0.6
+
+/* PAM messages shown at most; older ones are dropped. Messages are
+ * added at most once per frame, however fast PAM sends them.
+ */
+#define MAX_MESSAGES 8
 
 struct _PolkitCafeAuthenticationDialogPrivate
 {
+  CtkWidget *image;
+  CtkWidget *message_label;
+  CtkWidget *secondary_label;
+  CtkWidget *user_box;
   CtkWidget *user_combobox;
+  CtkWidget *user_chooser;
   CtkWidget *prompt_label;
   CtkWidget *password_entry;
   CtkWidget *auth_button;
   CtkWidget *cancel_button;
-  CtkWidget *info_label;
+  CtkWidget *conversation_box;
   CtkWidget *grid_password;
+  CtkWidget *details_expander;
+  CtkWidget *details_grid;
 
   gchar *message;
   gchar *action_id;
@@ -61,9 +95,26 @@ struct _PolkitCafeAuthenticationDialogPrivate
   gchar **users;
   gchar *selected_user;
 
-  gboolean is_running;
+  gboolean is_prompting;
 
   CtkListStore *store;
+  CtkTreeIter fill_iter;
+  guint fill_idle_id;
+
+  /* cancelled when the dialog goes away */
+  GCancellable *cancellable;
+
+  guint shake_tick_id;
+  gint64 shake_start_time;
+  gboolean shake_composited;
+  gint shake_x;
+  gint shake_y;
+
+  /* messages waiting for the next frame */
+  GPtrArray *pending_messages;
+  guint messages_tick_id;
+  guint num_shown_messages;
+  guint num_merged_messages;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (PolkitCafeAuthenticationDialog, polkit_cafe_authentication_dialog, CTK_TYPE_DIALOG);
@@ -109,6 +160,22 @@ user_combobox_set_sensitive (CtkCellLayout   *cell_layout G_GNUC_UNUSED,
   g_object_set (cell, "sensitive", sensitive, NULL);
 }
 
+/* takes ownership of @user_name */
+static void
+user_selected (PolkitCafeAuthenticationDialog *dialog,
+               gchar                          *user_name)
+{
+  g_free (dialog->priv->selected_user);
+  dialog->priv->selected_user = user_name;
+
+  g_object_notify (G_OBJECT (dialog), "selected-user");
+
+  /* make the password entry and Authenticate button sensitive again */
+  ctk_widget_set_sensitive (dialog->priv->prompt_label, TRUE);
+  ctk_widget_set_sensitive (dialog->priv->password_entry, TRUE);
+  ctk_widget_set_sensitive (dialog->priv->auth_button, TRUE);
+}
+
 static void
 user_combobox_changed (CtkComboBox *widget,
                        gpointer     user_data)
@@ -120,153 +187,268 @@ user_combobox_changed (CtkComboBox *widget,
   if (ctk_combo_box_get_active_iter (CTK_COMBO_BOX (widget), &iter))
     {
       ctk_tree_model_get (CTK_TREE_MODEL (dialog->priv->store), &iter, USERNAME_COL, &user_name, -1);
-
-      g_free (dialog->priv->selected_user);
-      dialog->priv->selected_user = user_name;
-
-      g_object_notify (G_OBJECT (dialog), "selected-user");
-
-      ctk_dialog_response (CTK_DIALOG (dialog), RESPONSE_USER_SELECTED);
-
-      /* make the password entry and Authenticate button sensitive again */
-      ctk_widget_set_sensitive (dialog->priv->prompt_label, TRUE);
-      ctk_widget_set_sensitive (dialog->priv->password_entry, TRUE);
-      ctk_widget_set_sensitive (dialog->priv->auth_button, TRUE);
+      user_selected (dialog, user_name);
     }
 }
 
 #if HAVE_ACCOUNTSSERVICE
-static GdkPixbuf *
-get_user_icon (char *username)
+static void
+avatar_lookup_cb (GObject      *source_object,
+                  GAsyncResult *res,
+                  gpointer      user_data)
 {
+  CtkTreeRowReference *row = user_data;
+  CtkTreePath *path;
+  CtkTreeIter iter;
+  gchar *icon_filename;
+  GdkPixbuf *pixbuf;
   GError *error;
-  GDBusConnection *connection;
-  GVariant *find_user_result;
-  GVariant *get_icon_result;
-  GVariant *icon_result_variant;
-  const gchar *user_path;
-  const gchar *icon_filename;
-  GdkPixbuf *pixbuf = NULL;
 
   error = NULL;
-  connection = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
-
-  if (connection == NULL)
+  icon_filename = polkit_cafe_avatar_loader_lookup_finish (POLKIT_CAFE_AVATAR_LOADER (source_object),
+                                                           res,
+                                                           &error);
+  if (icon_filename == NULL)
     {
-      g_warning ("Unable to connect to system bus: %s", error->message);
+      /* keep the stock_person icon */
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_debug ("No user icon from Accounts: %s", error->message);
       g_error_free (error);
-      return NULL;
+      goto out;
     }
 
-  find_user_result = g_dbus_connection_call_sync (connection,
-                                          "org.freedesktop.Accounts",
-                                          "/org/freedesktop/Accounts",
-                                          "org.freedesktop.Accounts",
-                                          "FindUserByName",
-                                          g_variant_new ("(s)",
-                                          username),
-                                          G_VARIANT_TYPE ("(o)"),
-                                          G_DBUS_CALL_FLAGS_NONE,
-                                          -1,
-                                          NULL,
+  /* TODO: we probably shouldn't hard-code the size to 16x16 */
+  pixbuf = polkit_cafe_avatar_cache_load (polkit_cafe_avatar_cache_get_default (),
+                                          icon_filename,
+                                          16,
+                                          1,
                                           &error);
-
-  if (find_user_result == NULL)
+  if (pixbuf == NULL)
     {
-      g_warning ("Accounts couldn't find user: %s", error->message);
+      g_warning ("Couldn't open user icon: %s", error->message);
       g_error_free (error);
-      return NULL;
+      goto out;
     }
 
-  user_path = g_variant_get_string (g_variant_get_child_value (find_user_result, 0),
-                                    NULL);
-
-  get_icon_result = g_dbus_connection_call_sync (connection,
-                                                 "org.freedesktop.Accounts",
-                                                 user_path,
-                                                 "org.freedesktop.DBus.Properties",
-                                                 "Get",
-                                                 g_variant_new ("(ss)",
-                                                                "org.freedesktop.Accounts.User",
-                                                                "IconFile"),
-                                                 G_VARIANT_TYPE ("(v)"),
-                                                 G_DBUS_CALL_FLAGS_NONE,
-                                                 -1,
-                                                 NULL,
-                                                 &error);
-
-  g_variant_unref (find_user_result);
-
-  if (get_icon_result == NULL)
+  /* the row reference keeps the store alive even if the dialog is gone */
+  path = ctk_tree_row_reference_get_path (row);
+  if (path != NULL)
     {
-      g_warning ("Accounts couldn't find user icon: %s", error->message);
-      g_error_free (error);
-      return NULL;
+      CtkTreeModel *model = ctk_tree_row_reference_get_model (row);
+
+      if (ctk_tree_model_get_iter (model, &iter, path))
+        ctk_list_store_set (CTK_LIST_STORE (model), &iter, PIXBUF_COL, pixbuf, -1);
+      ctk_tree_path_free (path);
     }
+  g_object_unref (pixbuf);
 
-  g_variant_get_child (get_icon_result, 0, "v", &icon_result_variant);
-  icon_filename = g_variant_get_string (icon_result_variant, NULL);
+ out:
+  g_free (icon_filename);
+  ctk_tree_row_reference_free (row);
+}
 
-  if (icon_filename == NULL)
-    {
-      g_warning ("Accounts didn't return a valid filename for user icon");
-    }
-  else
-    {
-      /* TODO: we probably shouldn't hard-code the size to 16x16 */
-      pixbuf = gdk_pixbuf_new_from_file_at_size (icon_filename,
-                                                 16,
-                                                 16,
-                                                 &error);
-      if (pixbuf == NULL)
-        {
-          g_warning ("Couldn't open user icon: %s", error->message);
-          g_error_free (error);
-        }
-    }
+/* Asks accounts-daemon for the users face; the row is updated once it arrives */
+static void
+load_user_icon (PolkitCafeAuthenticationDialog *dialog,
+                CtkTreeIter                    *iter,
+                PolkitCafeUserRecord           *record)
+{
+  CtkTreePath *path;
+  CtkTreeRowReference *row;
 
-  g_variant_unref (icon_result_variant);
-  g_variant_unref (get_icon_result);
+  path = ctk_tree_model_get_path (CTK_TREE_MODEL (dialog->priv->store), iter);
+  row = ctk_tree_row_reference_new (CTK_TREE_MODEL (dialog->priv->store), path);
+  ctk_tree_path_free (path);
 
-  return pixbuf;
+  polkit_cafe_avatar_loader_lookup (polkit_cafe_avatar_loader_get_default (),
+                                    record->name,
+                                    dialog->priv->cancellable,
+                                    avatar_lookup_cb,
+                                    row);
 }
 #else
-static GdkPixbuf *
-get_user_icon (char *username)
+static void
+load_user_icon (PolkitCafeAuthenticationDialog *dialog,
+                CtkTreeIter                    *iter,
+                PolkitCafeUserRecord           *record)
 {
   GdkPixbuf *pixbuf = NULL;
-  struct passwd *passwd;
 
-  passwd = getpwnam (username);
-  if (passwd->pw_dir != NULL)
+  if (record->home_dir != NULL)
     {
       gchar *path;
-      path = g_strdup_printf ("%s/.face", passwd->pw_dir);
+      path = g_strdup_printf ("%s/.face", record->home_dir);
       /* TODO: we probably shouldn't hard-code the size to 16x16 */
-      pixbuf = gdk_pixbuf_new_from_file_at_scale (path, 16, 16, TRUE, NULL);
+      pixbuf = polkit_cafe_avatar_cache_load (polkit_cafe_avatar_cache_get_default (),
+                                              path, 16, 1, NULL);
       g_free (path);
     }
 
-  return pixbuf;
+  /* otherwise keep the stock_person icon */
+  if (pixbuf != NULL)
+    {
+      ctk_list_store_set (dialog->priv->store, iter,
+                          PIXBUF_COL, pixbuf,
+                          -1);
+      g_object_unref (pixbuf);
+    }
 }
 #endif /* HAVE_ACCOUNTSSERVICE */
 
 static void
-create_user_combobox (PolkitCafeAuthenticationDialog *dialog)
+set_user_details (PolkitCafeAuthenticationDialog *dialog,
+                  CtkTreeIter                    *iter,
+                  PolkitCafeUserRecord           *record)
 {
-  int n, i, selected_index = 0;
-  CtkComboBox *combo;
+  gchar *real_name;
+
+  if (record->real_name != NULL && strcmp (record->real_name, record->name) != 0)
+    real_name = g_strdup_printf (_("%s (%s)"), record->real_name, record->name);
+  else
+    real_name = g_strdup (record->name);
+
+  ctk_list_store_set (dialog->priv->store, iter,
+                      TEXT_COL, real_name,
+                      -1);
+  g_free (real_name);
+
+  /* Load users face */
+  load_user_icon (dialog, iter, record);
+}
+
+typedef struct
+{
+  PolkitCafeAuthenticationDialog *dialog;
+  CtkTreeRowReference *row;
+} ResolveData;
+
+static void
+resolve_name_cb (GObject      *source_object,
+                 GAsyncResult *res,
+                 gpointer      user_data)
+{
+  ResolveData *data = user_data;
+  PolkitCafeUserRecord *record;
+  CtkTreePath *path;
   CtkTreeIter iter;
-  CtkCellRenderer *renderer;
+  GError *error;
 
-  /* if we've already built the list of admin users once, then avoid
-   * doing it again.. (this is mainly used when the user entered the
-   * wrong password and the dialog is recycled)
+  error = NULL;
+  record = polkit_cafe_identity_resolver_resolve_name_finish (POLKIT_CAFE_IDENTITY_RESOLVER (source_object),
+                                                              res,
+                                                              &error);
+  if (record == NULL)
+    {
+      /* cancelled when the dialog is reset or destroyed, in which case
+       * it must not be touched; otherwise keep showing the login name */
+      g_error_free (error);
+      goto out;
+    }
+
+  path = ctk_tree_row_reference_get_path (data->row);
+  if (path != NULL)
+    {
+      if (ctk_tree_model_get_iter (CTK_TREE_MODEL (data->dialog->priv->store), &iter, path))
+        set_user_details (data->dialog, &iter, record);
+      ctk_tree_path_free (path);
+    }
+  polkit_cafe_user_record_unref (record);
+
+ out:
+  ctk_tree_row_reference_free (data->row);
+  g_free (data);
+}
+
+/* Fills in the real name and face of the user at @iter, right away if
+ * the user is cached and otherwise once NSS has been asked on a worker
+ * thread.
+ */
+static void
+fill_user_details (PolkitCafeAuthenticationDialog *dialog,
+                   CtkTreeIter                    *iter)
+{
+  CtkTreeModel *model = CTK_TREE_MODEL (dialog->priv->store);
+  PolkitCafeUserRecord *record;
+  ResolveData *data;
+  CtkTreePath *path;
+  gchar *user_name;
+
+  ctk_tree_model_get (model, iter, USERNAME_COL, &user_name, -1);
+
+  /* the authenticator resolved all users before building the dialog,
+   * so this is normally answered from the resolver's cache
    */
-  if (dialog->priv->store != NULL)
-    return;
+  record = polkit_cafe_identity_resolver_lookup_by_name (polkit_cafe_identity_resolver_get_default (),
+                                                         user_name);
+  if (record != NULL)
+    {
+      set_user_details (dialog, iter, record);
+      polkit_cafe_user_record_unref (record);
+      g_free (user_name);
+      return;
+    }
+
+  path = ctk_tree_model_get_path (model, iter);
+  data = g_new0 (ResolveData, 1);
+  data->dialog = dialog;
+  data->row = ctk_tree_row_reference_new (model, path);
+  ctk_tree_path_free (path);
+
+  polkit_cafe_identity_resolver_resolve_name (polkit_cafe_identity_resolver_get_default (),
+                                              user_name,
+                                              dialog->priv->cancellable,
+                                              resolve_name_cb,
+                                              data);
+  g_free (user_name);
+}
+
+/* Fills in the row at @iter and moves @iter to the next row. Returns
+ * %FALSE when there are no more rows.
+ */
+static gboolean
+fill_user_row (PolkitCafeAuthenticationDialog *dialog,
+               CtkTreeIter                    *iter)
+{
+  fill_user_details (dialog, iter);
+
+  return ctk_tree_model_iter_next (CTK_TREE_MODEL (dialog->priv->store), iter);
+}
+
+static gboolean
+fill_user_rows_idle (gpointer user_data)
+{
+  PolkitCafeAuthenticationDialog *dialog = POLKIT_CAFE_AUTHENTICATION_DIALOG (user_data);
+  gint64 deadline;
+
+  /* only do as much as fits into a fraction of a frame per iteration so
+   * the dialog stays responsive while a long list is being filled
+   */
+  deadline = g_get_monotonic_time () + INCREMENTAL_FILL_BUDGET_USEC;
+  do
+    {
+      if (!fill_user_row (dialog, &dialog->priv->fill_iter))
+        {
+          dialog->priv->fill_idle_id = 0;
+          return G_SOURCE_REMOVE;
+        }
+    }
+  while (g_get_monotonic_time () < deadline);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Creates the store with a row for each user and preselects the current
+ * user. Returns the row of the current user or 0 for the "Select user..."
+ * row. Looking up real names and faces is left to fill_user_details().
+ */
+static gint
+create_user_store (PolkitCafeAuthenticationDialog *dialog)
+{
+  int n, selected_index = 0;
+  CtkTreeIter iter;
+  GdkPixbuf *fallback;
+  const gchar *current_user;
 
-  combo = CTK_COMBO_BOX (dialog->priv->user_combobox);
   dialog->priv->store = ctk_list_store_new (3, GDK_TYPE_PIXBUF, G_TYPE_STRING, G_TYPE_STRING);
 
   ctk_list_store_append (dialog->priv->store, &iter);
@@ -276,72 +458,59 @@ create_user_combobox (PolkitCafeAuthenticationDialog *dialog)
                       USERNAME_COL, NULL,
                       -1);
 
+  fallback = polkit_cafe_avatar_cache_get_fallback (polkit_cafe_avatar_cache_get_default (), 16);
+  current_user = g_get_user_name ();
+  for (n = 0; dialog->priv->users[n] != NULL; n++)
+    {
+      ctk_list_store_insert_with_values (dialog->priv->store, &iter, -1,
+                                         PIXBUF_COL, fallback,
+                                         TEXT_COL, dialog->priv->users[n],
+                                         USERNAME_COL, dialog->priv->users[n],
+                                         -1);
 
-  /* For each user */
-  for (i = 0, n = 0; dialog->priv->users[n] != NULL; n++)
-  {
-      gchar *gecos;
-      gchar *real_name;
-      GdkPixbuf *pixbuf = NULL;
-      struct passwd *passwd;
-
-      /* we're single threaded so this is fine */
-      errno = 0;
-      passwd = getpwnam (dialog->priv->users[n]);
-      if (passwd == NULL)
+      if (strcmp (dialog->priv->users[n], current_user) == 0)
         {
-          g_warning ("Error doing getpwnam(\"%s\"): %s", dialog->priv->users[n], strerror (errno));
-          continue;
+          selected_index = n + 1;
+          g_free (dialog->priv->selected_user);
+          dialog->priv->selected_user = g_strdup (dialog->priv->users[n]);
         }
+    }
+  if (fallback != NULL)
+    g_object_unref (fallback);
 
-      if (passwd->pw_gecos != NULL)
-        gecos = g_locale_to_utf8 (passwd->pw_gecos, -1, NULL, NULL, NULL);
-      else
-        gecos = NULL;
+  return selected_index;
+}
 
-      if (gecos != NULL && strlen (gecos) > 0)
-        {
-          gchar *first_comma;
-          first_comma = strchr (gecos, ',');
-          if (first_comma != NULL)
-            *first_comma = '\0';
-        }
-      if (gecos != NULL && strlen (gecos) > 0 && strcmp (gecos, dialog->priv->users[n]) != 0)
-        real_name = g_strdup_printf (_("%s (%s)"), gecos, dialog->priv->users[n]);
-       else
-         real_name = g_strdup (dialog->priv->users[n]);
-      g_free (gecos);
+static void
+create_user_combobox (PolkitCafeAuthenticationDialog *dialog)
+{
+  int selected_index;
+  CtkComboBox *combo;
+  CtkCellRenderer *renderer;
+
+  /* if we've already built the list of admin users once, then avoid
+   * doing it again.. (this is mainly used when the user entered the
+   * wrong password and the dialog is recycled)
+   */
+  if (dialog->priv->store != NULL)
+    return;
 
-      /* Load users face */
-      pixbuf = get_user_icon (dialog->priv->users[n]);
+  combo = CTK_COMBO_BOX (dialog->priv->user_combobox);
+  selected_index = create_user_store (dialog);
 
-      /* fall back to stock_person icon */
-      if (pixbuf == NULL)
+  /* skip the "Select user..." row */
+  ctk_tree_model_get_iter_first (CTK_TREE_MODEL (dialog->priv->store), &dialog->priv->fill_iter);
+  if (ctk_tree_model_iter_next (CTK_TREE_MODEL (dialog->priv->store), &dialog->priv->fill_iter))
+    {
+      if (g_strv_length (dialog->priv->users) > INCREMENTAL_FILL_THRESHOLD)
         {
-          pixbuf = ctk_icon_theme_load_icon (ctk_icon_theme_get_default (),
-                                             "stock_person",
-                                             CTK_ICON_SIZE_MENU,
-                                             0,
-                                             NULL);
+          dialog->priv->fill_idle_id = g_idle_add (fill_user_rows_idle, dialog);
         }
-
-      ctk_list_store_append (dialog->priv->store, &iter);
-      ctk_list_store_set (dialog->priv->store, &iter,
-                          PIXBUF_COL, pixbuf,
-                          TEXT_COL, real_name,
-                          USERNAME_COL, dialog->priv->users[n],
-                          -1);
-
-      i++;
-      if (passwd->pw_uid == getuid ())
+      else
         {
-          selected_index = i;
-          g_free (dialog->priv->selected_user);
-          dialog->priv->selected_user = g_strdup (dialog->priv->users[n]);
+          while (fill_user_row (dialog, &dialog->priv->fill_iter))
+            ;
         }
-
-      g_free (real_name);
-      g_object_unref (pixbuf);
     }
 
   ctk_combo_box_set_model (combo, CTK_TREE_MODEL (dialog->priv->store));
@@ -378,22 +547,74 @@ create_user_combobox (PolkitCafeAuthenticationDialog *dialog)
                     dialog);
 }
 
-static CtkWidget *
-get_image (PolkitCafeAuthenticationDialog *dialog)
+static void
+user_chooser_fill_row (PolkitCafeUserChooser *chooser G_GNUC_UNUSED,
+                       CtkTreeIter           *iter,
+                       gpointer               user_data)
+{
+  PolkitCafeAuthenticationDialog *dialog = POLKIT_CAFE_AUTHENTICATION_DIALOG (user_data);
+
+  fill_user_details (dialog, iter);
+}
+
+static void
+user_chooser_selected_user_changed (GObject    *object,
+                                    GParamSpec *pspec G_GNUC_UNUSED,
+                                    gpointer    user_data)
+{
+  PolkitCafeAuthenticationDialog *dialog = POLKIT_CAFE_AUTHENTICATION_DIALOG (user_data);
+  gchar *user_name;
+
+  user_name = polkit_cafe_user_chooser_get_selected_user (POLKIT_CAFE_USER_CHOOSER (object));
+  if (user_name == NULL || g_strcmp0 (user_name, dialog->priv->selected_user) == 0)
+    {
+      g_free (user_name);
+      return;
+    }
+
+  user_selected (dialog, user_name);
+}
+
+static void
+create_user_chooser (PolkitCafeAuthenticationDialog *dialog)
+{
+  create_user_store (dialog);
+
+  /* rows are filled in by user_chooser_fill_row() when first shown */
+  dialog->priv->user_chooser = polkit_cafe_user_chooser_new (CTK_TREE_MODEL (dialog->priv->store),
+                                                             PIXBUF_COL,
+                                                             TEXT_COL,
+                                                             USERNAME_COL);
+  if (dialog->priv->selected_user != NULL)
+    polkit_cafe_user_chooser_set_selected_user (POLKIT_CAFE_USER_CHOOSER (dialog->priv->user_chooser),
+                                                dialog->priv->selected_user);
+
+  g_signal_connect (dialog->priv->user_chooser,
+                    "fill-row",
+                    G_CALLBACK (user_chooser_fill_row),
+                    dialog);
+  g_signal_connect (dialog->priv->user_chooser,
+                    "notify::selected-user",
+                    G_CALLBACK (user_chooser_selected_user_changed),
+                    dialog);
+}
+
+static void
+update_image (PolkitCafeAuthenticationDialog *dialog)
 {
   GdkPixbuf *pixbuf;
   GdkPixbuf *copy_pixbuf;
   GdkPixbuf *vendor_pixbuf;
-  CtkWidget *image;
+  CtkImage *image;
 
   pixbuf = NULL;
   copy_pixbuf = NULL;
   vendor_pixbuf = NULL;
-  image = NULL;
+  image = CTK_IMAGE (dialog->priv->image);
 
   if (dialog->priv->icon_name == NULL || strlen (dialog->priv->icon_name) == 0)
     {
-      image = ctk_image_new_from_icon_name ("dialog-password", CTK_ICON_SIZE_DIALOG);
+      ctk_image_set_from_icon_name (image, "dialog-password", CTK_ICON_SIZE_DIALOG);
       goto out;
     }
 
@@ -405,7 +626,7 @@ get_image (PolkitCafeAuthenticationDialog *dialog)
   if (vendor_pixbuf == NULL)
     {
       g_warning ("No icon for themed icon with name '%s'", dialog->priv->icon_name);
-      image = ctk_image_new_from_icon_name ("dialog-password", CTK_ICON_SIZE_DIALOG);
+      ctk_image_set_from_icon_name (image, "dialog-password", CTK_ICON_SIZE_DIALOG);
       goto out;
     }
 
@@ -431,7 +652,7 @@ get_image (PolkitCafeAuthenticationDialog *dialog)
                         GDK_INTERP_BILINEAR,
                         255);
 
-  image = ctk_image_new_from_pixbuf (copy_pixbuf);
+  ctk_image_set_from_pixbuf (image, copy_pixbuf);
 
 out:
   if (pixbuf != NULL)
@@ -442,8 +663,6 @@ out:
 
   if (vendor_pixbuf != NULL)
     g_object_unref (vendor_pixbuf);
-
-  return image;
 }
 
 static void
@@ -589,6 +808,8 @@ static void
 polkit_cafe_authentication_dialog_init (PolkitCafeAuthenticationDialog *dialog)
 {
   dialog->priv = polkit_cafe_authentication_dialog_get_instance_private (dialog);
+  dialog->priv->cancellable = g_cancellable_new ();
+  dialog->priv->pending_messages = g_ptr_array_new_with_free_func (g_free);
 }
 
 static void
@@ -598,6 +819,14 @@ polkit_cafe_authentication_dialog_finalize (GObject *object)
 
   dialog = POLKIT_CAFE_AUTHENTICATION_DIALOG (object);
 
+  g_cancellable_cancel (dialog->priv->cancellable);
+  g_object_unref (dialog->priv->cancellable);
+
+  if (dialog->priv->fill_idle_id != 0)
+    g_source_remove (dialog->priv->fill_idle_id);
+
+  g_ptr_array_unref (dialog->priv->pending_messages);
+
   g_free (dialog->priv->message);
   g_free (dialog->priv->action_id);
   g_free (dialog->priv->vendor);
@@ -637,74 +866,129 @@ polkit_cafe_dialog_add_button (CtkDialog   *dialog,
 }
 
 static void
-polkit_cafe_authentication_dialog_constructed (GObject *object)
+stop_shake (PolkitCafeAuthenticationDialog *dialog)
+{
+  if (dialog->priv->shake_tick_id == 0)
+    return;
+
+  ctk_widget_remove_tick_callback (CTK_WIDGET (dialog), dialog->priv->shake_tick_id);
+  dialog->priv->shake_tick_id = 0;
+
+  if (dialog->priv->shake_composited)
+    ctk_widget_set_opacity (CTK_WIDGET (dialog), 1.0);
+  else
+    ctk_window_move (CTK_WINDOW (dialog), dialog->priv->shake_x, dialog->priv->shake_y);
+}
+
+static gboolean
+shake_tick (CtkWidget     *widget,
+            CdkFrameClock *frame_clock,
+            gpointer       user_data G_GNUC_UNUSED)
+{
+  PolkitCafeAuthenticationDialog *dialog = POLKIT_CAFE_AUTHENTICATION_DIALOG (widget);
+  gint64 now;
+  gint64 step;
+
+  now = cdk_frame_clock_get_frame_time (frame_clock);
+  if (dialog->priv->shake_start_time == 0)
+    dialog->priv->shake_start_time = now;
+
+  step = (now - dialog->priv->shake_start_time) / SHAKE_STEP_USEC;
+  if (step >= SHAKE_STEPS)
+    {
+      /* the source is removed by returning FALSE */
+      dialog->priv->shake_tick_id = 0;
+
+      if (dialog->priv->shake_composited)
+        ctk_widget_set_opacity (widget, 1.0);
+      else
+        ctk_window_move (CTK_WINDOW (dialog), dialog->priv->shake_x, dialog->priv->shake_y);
+
+      return G_SOURCE_REMOVE;
+    }
+
+  if (dialog->priv->shake_composited)
+    {
+      /* let the compositor do the work instead of moving the window */
+      ctk_widget_set_opacity (widget, step % 2 == 0 ? SHAKE_OPACITY : 1.0);
+    }
+  else
+    {
+      ctk_window_move (CTK_WINDOW (dialog),
+                       dialog->priv->shake_x + (step % 2 == 0 ? -SHAKE_OFFSET : SHAKE_OFFSET),
+                       dialog->priv->shake_y);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Updates everything that depends on the request. The rest of the dialog
+ * is only built once in constructed() so that a dialog can be reused
+ * for another request, see polkit_cafe_authentication_dialog_reset().
+ */
+static void
+update_for_request (PolkitCafeAuthenticationDialog *dialog)
 {
-  PolkitCafeAuthenticationDialog *dialog;
-  CtkWidget *hbox;
-  CtkWidget *main_vbox;
-  CtkWidget *vbox;
-  CtkWidget *grid_password;
-  CtkWidget *details_expander;
-  CtkWidget *details_vbox;
-  CtkWidget *grid;
   CtkWidget *label;
-  CtkWidget *image;
-  CtkWidget *content_area;
   gboolean have_user_combobox;
+  gboolean have_user_chooser;
   gchar *s;
   guint rows;
 
-  dialog = POLKIT_CAFE_AUTHENTICATION_DIALOG (object);
+  /* drop what was shown for the previous request */
+  if (dialog->priv->user_combobox != NULL)
+    {
+      ctk_widget_destroy (dialog->priv->user_combobox);
+      dialog->priv->user_combobox = NULL;
+    }
+  if (dialog->priv->user_chooser != NULL)
+    {
+      ctk_widget_destroy (dialog->priv->user_chooser);
+      dialog->priv->user_chooser = NULL;
+    }
+  if (dialog->priv->fill_idle_id != 0)
+    {
+      g_source_remove (dialog->priv->fill_idle_id);
+      dialog->priv->fill_idle_id = 0;
+    }
+  if (dialog->priv->store != NULL)
+    {
+      g_object_unref (dialog->priv->store);
+      dialog->priv->store = NULL;
+    }
+  g_cancellable_cancel (dialog->priv->cancellable);
+  g_object_unref (dialog->priv->cancellable);
+  dialog->priv->cancellable = g_cancellable_new ();
 
-  if (G_OBJECT_CLASS (polkit_cafe_authentication_dialog_parent_class)->constructed != NULL)
-    G_OBJECT_CLASS (polkit_cafe_authentication_dialog_parent_class)->constructed (object);
+  stop_shake (dialog);
 
-  have_user_combobox = FALSE;
+  g_free (dialog->priv->selected_user);
+  dialog->priv->selected_user = NULL;
 
-  dialog->priv->cancel_button = polkit_cafe_dialog_add_button (CTK_DIALOG (dialog),
-                                                               _("_Cancel"),
-                                                               "process-stop",
-                                                               CTK_RESPONSE_CANCEL);
+  ctk_container_foreach (CTK_CONTAINER (dialog->priv->details_grid), (CtkCallback) ctk_widget_destroy, NULL);
+  ctk_expander_set_expanded (CTK_EXPANDER (dialog->priv->details_expander), FALSE);
 
-  dialog->priv->auth_button = ctk_dialog_add_button (CTK_DIALOG (dialog),
-                                                     _("_Authenticate"),
-                                                     CTK_RESPONSE_OK);
+  polkit_cafe_authentication_dialog_clear_messages (dialog);
+  ctk_entry_set_text (CTK_ENTRY (dialog->priv->password_entry), "");
+  ctk_widget_set_sensitive (dialog->priv->prompt_label, TRUE);
+  ctk_widget_set_sensitive (dialog->priv->password_entry, TRUE);
+  ctk_widget_set_sensitive (dialog->priv->auth_button, TRUE);
 
-  ctk_dialog_set_default_response (CTK_DIALOG (dialog), CTK_RESPONSE_OK);
+  if (dialog->priv->users == NULL)
+    return;
 
-  content_area = ctk_dialog_get_content_area (CTK_DIALOG (dialog));
+  have_user_combobox = FALSE;
+  have_user_chooser = FALSE;
 
-  ctk_container_set_border_width (CTK_CONTAINER (dialog), 5);
-  ctk_box_set_spacing (CTK_BOX (content_area), 2); /* 2 * 5 + 2 = 12 */
-  ctk_window_set_resizable (CTK_WINDOW (dialog), FALSE);
-  ctk_window_set_icon_name (CTK_WINDOW (dialog), "dialog-password");
-
-  hbox = ctk_box_new (CTK_ORIENTATION_HORIZONTAL, 12);
-  ctk_container_set_border_width (CTK_CONTAINER (hbox), 5);
-  ctk_box_pack_start (CTK_BOX (content_area), hbox, TRUE, TRUE, 0);
-
-  image = get_image (dialog);
-  ctk_widget_set_halign (image, CTK_ALIGN_CENTER);
-  ctk_widget_set_valign (image, CTK_ALIGN_START);
-  ctk_box_pack_start (CTK_BOX (hbox), image, FALSE, FALSE, 0);
-
-  main_vbox = ctk_box_new (CTK_ORIENTATION_VERTICAL, 10);
-  ctk_box_pack_start (CTK_BOX (hbox), main_vbox, TRUE, TRUE, 0);
+  update_image (dialog);
 
   /* main message */
-  label = ctk_label_new (NULL);
   s = g_strdup_printf ("<big><b>%s</b></big>", dialog->priv->message);
-  ctk_label_set_markup (CTK_LABEL (label), s);
+  ctk_label_set_markup (CTK_LABEL (dialog->priv->message_label), s);
   g_free (s);
 
-  ctk_label_set_xalign (CTK_LABEL (label), 0.0);
-  ctk_label_set_yalign (CTK_LABEL (label), 0.5);
-  ctk_label_set_line_wrap (CTK_LABEL (label), TRUE);
-  ctk_label_set_max_width_chars (CTK_LABEL (label), 50);
-  ctk_box_pack_start (CTK_BOX (main_vbox), label, FALSE, FALSE, 0);
-
   /* secondary message */
-  label = ctk_label_new (NULL);
+  label = dialog->priv->secondary_label;
   if (g_strv_length (dialog->priv->users) > 1)
     {
           ctk_label_set_markup (CTK_LABEL (label),
@@ -727,17 +1011,18 @@ polkit_cafe_authentication_dialog_constructed (GObject *object)
         }
     }
 
-  ctk_label_set_xalign (CTK_LABEL (label), 0.0);
-  ctk_label_set_yalign (CTK_LABEL (label), 0.5);
-  ctk_label_set_line_wrap (CTK_LABEL (label), TRUE);
-  ctk_label_set_max_width_chars (CTK_LABEL (label), 50);
-  ctk_box_pack_start (CTK_BOX (main_vbox), label, FALSE, FALSE, 0);
+  /* user combobox, or a searchable list if there are too many users for a popup */
+  if (g_strv_length (dialog->priv->users) > USER_CHOOSER_THRESHOLD)
+    {
+      create_user_chooser (dialog);
+      ctk_box_pack_start (CTK_BOX (dialog->priv->user_box), dialog->priv->user_chooser, TRUE, TRUE, 0);
 
-  /* user combobox */
-  if (g_strv_length (dialog->priv->users) > 1)
+      have_user_chooser = TRUE;
+    }
+  else if (g_strv_length (dialog->priv->users) > 1)
     {
       dialog->priv->user_combobox = ctk_combo_box_new ();
-      ctk_box_pack_start (CTK_BOX (main_vbox), CTK_WIDGET (dialog->priv->user_combobox), FALSE, FALSE, 0);
+      ctk_box_pack_start (CTK_BOX (dialog->priv->user_box), CTK_WIDGET (dialog->priv->user_combobox), FALSE, FALSE, 0);
 
       create_user_combobox (dialog);
 
@@ -748,47 +1033,6 @@ polkit_cafe_authentication_dialog_constructed (GObject *object)
       dialog->priv->selected_user = g_strdup (dialog->priv->users[0]);
     }
 
-  /* password entry */
-  vbox = ctk_box_new (CTK_ORIENTATION_VERTICAL, 0);
-  ctk_box_pack_start (CTK_BOX (main_vbox), vbox, FALSE, FALSE, 0);
-
-  grid_password = ctk_grid_new ();
-  ctk_grid_set_column_spacing (CTK_GRID (grid_password), 12);
-  ctk_grid_set_row_spacing (CTK_GRID (grid_password), 6);
-  ctk_box_pack_start (CTK_BOX (vbox), grid_password, FALSE, FALSE, 0);
-  dialog->priv->password_entry = ctk_entry_new ();
-  ctk_entry_set_visibility (CTK_ENTRY (dialog->priv->password_entry), FALSE);
-  dialog->priv->prompt_label = add_row (grid_password, 0, _("_Password:"), dialog->priv->password_entry);
-
-  g_signal_connect_swapped (dialog->priv->password_entry, "activate",
-                            G_CALLBACK (ctk_window_activate_default),
-                            dialog);
-
-  dialog->priv->grid_password = grid_password;
-  /* initially never show the password entry stuff; we'll toggle it on/off so it's
-   * only shown when prompting for a password */
-  ctk_widget_set_no_show_all (dialog->priv->grid_password, TRUE);
-
-  /* A label for showing PAM_TEXT_INFO and PAM_TEXT_ERROR messages */
-  label = ctk_label_new (NULL);
-  ctk_label_set_line_wrap (CTK_LABEL (label), TRUE);
-  ctk_box_pack_start (CTK_BOX (vbox), label, FALSE, FALSE, 0);
-  dialog->priv->info_label = label;
-
-  /* Details */
-  details_expander = ctk_expander_new_with_mnemonic (_("<small><b>_Details</b></small>"));
-  ctk_expander_set_use_markup (CTK_EXPANDER (details_expander), TRUE);
-  ctk_box_pack_start (CTK_BOX (content_area), details_expander, FALSE, FALSE, 0);
-
-  details_vbox = ctk_box_new (CTK_ORIENTATION_VERTICAL, 10);
-  ctk_container_add (CTK_CONTAINER (details_expander), details_vbox);
-
-  grid = ctk_grid_new ();
-  ctk_widget_set_margin_start (grid, 20);
-  ctk_grid_set_column_spacing (CTK_GRID (grid), 12);
-  ctk_grid_set_row_spacing (CTK_GRID (grid), 6);
-  ctk_box_pack_start (CTK_BOX (details_vbox), grid, FALSE, FALSE, 0);
-
   /* TODO: sort keys? */
   rows = 0;
   if (dialog->priv->details != NULL)
@@ -813,7 +1057,7 @@ polkit_cafe_authentication_dialog_constructed (GObject *object)
           ctk_label_set_yalign (CTK_LABEL (label), 1.0);
 
           s = g_strdup_printf ("<small><b>%s:</b></small>", key);
-          add_row (grid, rows, s, label);
+          add_row (dialog->priv->details_grid, rows, s, label);
           g_free (s);
 
           rows++;
@@ -834,7 +1078,7 @@ polkit_cafe_authentication_dialog_constructed (GObject *object)
   ctk_label_set_xalign (CTK_LABEL (label), 0.0);
   ctk_label_set_yalign (CTK_LABEL (label), 1.0);
 
-  add_row (grid, rows++, _("<small><b>Action:</b></small>"), label);
+  add_row (dialog->priv->details_grid, rows++, _("<small><b>Action:</b></small>"), label);
   g_signal_connect (label, "activate-link", G_CALLBACK (action_id_activated), NULL);
 
   s = g_strdup_printf (_("Click to edit %s"), dialog->priv->action_id);
@@ -854,19 +1098,136 @@ polkit_cafe_authentication_dialog_constructed (GObject *object)
   ctk_label_set_xalign (CTK_LABEL (label), 0.0);
   ctk_label_set_yalign (CTK_LABEL (label), 1.0);
 
-  add_row (grid, rows++, _("<small><b>Vendor:</b></small>"), label);
+  add_row (dialog->priv->details_grid, rows++, _("<small><b>Vendor:</b></small>"), label);
 
   s = g_strdup_printf (_("Click to open %s"), dialog->priv->vendor_url);
   ctk_widget_set_tooltip_markup (label, s);
   g_free (s);
 
   /* Disable password entry and authenticate until have a user selected */
-  if (have_user_combobox && ctk_combo_box_get_active (CTK_COMBO_BOX (dialog->priv->user_combobox)) == 0)
+  if ((have_user_combobox && ctk_combo_box_get_active (CTK_COMBO_BOX (dialog->priv->user_combobox)) == 0) ||
+      (have_user_chooser && dialog->priv->selected_user == NULL))
     {
       ctk_widget_set_sensitive (dialog->priv->prompt_label, FALSE);
       ctk_widget_set_sensitive (dialog->priv->password_entry, FALSE);
       ctk_widget_set_sensitive (dialog->priv->auth_button, FALSE);
     }
+}
+
+static void
+polkit_cafe_authentication_dialog_constructed (GObject *object)
+{
+  PolkitCafeAuthenticationDialog *dialog;
+  CtkWidget *hbox;
+  CtkWidget *main_vbox;
+  CtkWidget *vbox;
+  CtkWidget *grid_password;
+  CtkWidget *details_expander;
+  CtkWidget *details_vbox;
+  CtkWidget *grid;
+  CtkWidget *label;
+  CtkWidget *content_area;
+
+  dialog = POLKIT_CAFE_AUTHENTICATION_DIALOG (object);
+
+  if (G_OBJECT_CLASS (polkit_cafe_authentication_dialog_parent_class)->constructed != NULL)
+    G_OBJECT_CLASS (polkit_cafe_authentication_dialog_parent_class)->constructed (object);
+
+  dialog->priv->cancel_button = polkit_cafe_dialog_add_button (CTK_DIALOG (dialog),
+                                                               _("_Cancel"),
+                                                               "process-stop",
+                                                               CTK_RESPONSE_CANCEL);
+
+  dialog->priv->auth_button = ctk_dialog_add_button (CTK_DIALOG (dialog),
+                                                     _("_Authenticate"),
+                                                     CTK_RESPONSE_OK);
+
+  ctk_dialog_set_default_response (CTK_DIALOG (dialog), CTK_RESPONSE_OK);
+
+  content_area = ctk_dialog_get_content_area (CTK_DIALOG (dialog));
+
+  ctk_container_set_border_width (CTK_CONTAINER (dialog), 5);
+  ctk_box_set_spacing (CTK_BOX (content_area), 2); /* 2 * 5 + 2 = 12 */
+  ctk_window_set_resizable (CTK_WINDOW (dialog), FALSE);
+  ctk_window_set_icon_name (CTK_WINDOW (dialog), "dialog-password");
+
+  hbox = ctk_box_new (CTK_ORIENTATION_HORIZONTAL, 12);
+  ctk_container_set_border_width (CTK_CONTAINER (hbox), 5);
+  ctk_box_pack_start (CTK_BOX (content_area), hbox, TRUE, TRUE, 0);
+
+  dialog->priv->image = ctk_image_new ();
+  ctk_widget_set_halign (dialog->priv->image, CTK_ALIGN_CENTER);
+  ctk_widget_set_valign (dialog->priv->image, CTK_ALIGN_START);
+  ctk_box_pack_start (CTK_BOX (hbox), dialog->priv->image, FALSE, FALSE, 0);
+
+  main_vbox = ctk_box_new (CTK_ORIENTATION_VERTICAL, 10);
+  ctk_box_pack_start (CTK_BOX (hbox), main_vbox, TRUE, TRUE, 0);
+
+  /* main message */
+  label = ctk_label_new (NULL);
+  ctk_label_set_xalign (CTK_LABEL (label), 0.0);
+  ctk_label_set_yalign (CTK_LABEL (label), 0.5);
+  ctk_label_set_line_wrap (CTK_LABEL (label), TRUE);
+  ctk_label_set_max_width_chars (CTK_LABEL (label), 50);
+  ctk_box_pack_start (CTK_BOX (main_vbox), label, FALSE, FALSE, 0);
+  dialog->priv->message_label = label;
+
+  /* secondary message */
+  label = ctk_label_new (NULL);
+  ctk_label_set_xalign (CTK_LABEL (label), 0.0);
+  ctk_label_set_yalign (CTK_LABEL (label), 0.5);
+  ctk_label_set_line_wrap (CTK_LABEL (label), TRUE);
+  ctk_label_set_max_width_chars (CTK_LABEL (label), 50);
+  ctk_box_pack_start (CTK_BOX (main_vbox), label, FALSE, FALSE, 0);
+  dialog->priv->secondary_label = label;
+
+  /* holds the user combobox or chooser, if any */
+  dialog->priv->user_box = ctk_box_new (CTK_ORIENTATION_VERTICAL, 0);
+  ctk_box_pack_start (CTK_BOX (main_vbox), dialog->priv->user_box, FALSE, FALSE, 0);
+
+  /* password entry */
+  vbox = ctk_box_new (CTK_ORIENTATION_VERTICAL, 0);
+  ctk_box_pack_start (CTK_BOX (main_vbox), vbox, FALSE, FALSE, 0);
+
+  grid_password = ctk_grid_new ();
+  ctk_grid_set_column_spacing (CTK_GRID (grid_password), 12);
+  ctk_grid_set_row_spacing (CTK_GRID (grid_password), 6);
+  ctk_box_pack_start (CTK_BOX (vbox), grid_password, FALSE, FALSE, 0);
+  dialog->priv->password_entry = ctk_entry_new ();
+  ctk_entry_set_visibility (CTK_ENTRY (dialog->priv->password_entry), FALSE);
+  dialog->priv->prompt_label = add_row (grid_password, 0, _("_Password:"), dialog->priv->password_entry);
+
+  g_signal_connect_swapped (dialog->priv->password_entry, "activate",
+                            G_CALLBACK (ctk_window_activate_default),
+                            dialog);
+
+  dialog->priv->grid_password = grid_password;
+  /* initially never show the password entry stuff; we'll toggle it on/off so it's
+   * only shown when prompting for a password */
+  ctk_widget_set_no_show_all (dialog->priv->grid_password, TRUE);
+
+  /* PAM_TEXT_INFO and PAM_TEXT_ERROR messages pile up here while the
+   * conversation goes on, next to whatever prompt is showing */
+  dialog->priv->conversation_box = ctk_box_new (CTK_ORIENTATION_VERTICAL, 6);
+  ctk_box_pack_start (CTK_BOX (vbox), dialog->priv->conversation_box, FALSE, FALSE, 0);
+
+  /* Details */
+  details_expander = ctk_expander_new_with_mnemonic (_("<small><b>_Details</b></small>"));
+  ctk_expander_set_use_markup (CTK_EXPANDER (details_expander), TRUE);
+  ctk_box_pack_start (CTK_BOX (content_area), details_expander, FALSE, FALSE, 0);
+  dialog->priv->details_expander = details_expander;
+
+  details_vbox = ctk_box_new (CTK_ORIENTATION_VERTICAL, 10);
+  ctk_container_add (CTK_CONTAINER (details_expander), details_vbox);
+
+  grid = ctk_grid_new ();
+  ctk_widget_set_margin_start (grid, 20);
+  ctk_grid_set_column_spacing (CTK_GRID (grid), 12);
+  ctk_grid_set_row_spacing (CTK_GRID (grid), 6);
+  ctk_box_pack_start (CTK_BOX (details_vbox), grid, FALSE, FALSE, 0);
+  dialog->priv->details_grid = grid;
+
+  update_for_request (dialog);
 
   ctk_widget_realize (CTK_WIDGET (dialog));
 
@@ -997,6 +1358,7 @@ polkit_cafe_authentication_dialog_new (const gchar    *action_id,
 {
   PolkitCafeAuthenticationDialog *dialog;
   CtkWindow *window;
+  CtkWindowGroup *group;
 
   dialog = g_object_new (POLKIT_CAFE_TYPE_AUTHENTICATION_DIALOG,
                          "action-id", action_id,
@@ -1015,150 +1377,159 @@ polkit_cafe_authentication_dialog_new (const gchar    *action_id,
   ctk_window_set_resizable (window, FALSE);
   ctk_window_set_keep_above (window, TRUE);
   ctk_window_set_title (window, _("Authenticate"));
+
+  /* several dialogs may be up at once; a modal one only grabs input
+   * within its own group, so each gets a group of its own rather than
+   * the default one they would all share */
+  group = ctk_window_group_new ();
+  ctk_window_group_add_window (group, window);
+  g_object_unref (group);
   g_signal_connect (dialog, "close", G_CALLBACK (ctk_widget_hide), NULL);
 
   return CTK_WIDGET (dialog);
 }
 
 /**
- * polkit_cafe_authentication_dialog_indicate_error:
- * @dialog: the auth dialog
+ * polkit_cafe_authentication_dialog_reset:
+ * @dialog: A #PolkitCafeAuthenticationDialog.
+ * @action_id: The action the new request is for or %NULL.
+ * @vendor: The vendor of the action or %NULL.
+ * @vendor_url: The vendor URL of the action or %NULL.
+ * @icon_name: The icon name of the action or %NULL.
+ * @message_markup: The message to show or %NULL.
+ * @details: A #PolkitDetails or %NULL.
+ * @users: The users that can authenticate or %NULL.
  *
- * Call this function to indicate an authentication error; typically shakes the window
+ * Makes a hidden @dialog show a new request as if it had been created
+ * with polkit_cafe_authentication_dialog_new(), reusing the widgets that
+ * don't depend on the request. Passing %NULL for @users just drops the
+ * state of the previous request.
  **/
 void
-polkit_cafe_authentication_dialog_indicate_error (PolkitCafeAuthenticationDialog *dialog)
+polkit_cafe_authentication_dialog_reset (PolkitCafeAuthenticationDialog *dialog,
+                                          const gchar                     *action_id,
+                                          const gchar                     *vendor,
+                                          const gchar                     *vendor_url,
+                                          const gchar                     *icon_name,
+                                          const gchar                     *message_markup,
+                                          PolkitDetails                   *details,
+                                          gchar                          **users)
 {
-  int x, y;
-  int n;
-  int diff;
-
-  /* TODO: detect compositing manager and do fancy stuff here */
+  gchar *answer;
 
-  ctk_window_get_position (CTK_WINDOW (dialog), &x, &y);
+  g_return_if_fail (POLKIT_CAFE_IS_AUTHENTICATION_DIALOG (dialog));
 
-  for (n = 0; n < 10; n++)
+  /* a previous user may have left a password in the entry */
+  answer = polkit_cafe_authentication_dialog_finish_prompt (dialog);
+  if (answer != NULL)
     {
-      if (n % 2 == 0)
-        diff = -15;
-      else
-        diff = 15;
+      memset (answer, 0, strlen (answer));
+      g_free (answer);
+    }
 
-      ctk_window_move (CTK_WINDOW (dialog), x + diff, y);
+  g_free (dialog->priv->action_id);
+  dialog->priv->action_id = g_strdup (action_id);
+  g_free (dialog->priv->vendor);
+  dialog->priv->vendor = g_strdup (vendor);
+  g_free (dialog->priv->vendor_url);
+  dialog->priv->vendor_url = g_strdup (vendor_url);
+  g_free (dialog->priv->icon_name);
+  dialog->priv->icon_name = g_strdup (icon_name);
+  g_free (dialog->priv->message);
+  dialog->priv->message = g_strdup (message_markup);
 
-      while (ctk_events_pending ())
-        {
-          ctk_main_iteration ();
-        }
+  if (dialog->priv->details != NULL)
+    g_object_unref (dialog->priv->details);
+  dialog->priv->details = details != NULL ? g_object_ref (details) : NULL;
 
-      g_usleep (10000);
-    }
+  g_strfreev (dialog->priv->users);
+  dialog->priv->users = g_strdupv (users);
 
-  ctk_window_move (CTK_WINDOW (dialog), x, y);
+  update_for_request (dialog);
 }
 
 /**
- * polkit_cafe_authentication_dialog_run_until_user_is_selected:
- * @dialog: A #PolkitCafeAuthenticationDialog.
- *
- * Runs @dialog in a recursive main loop until a user have been selected.
- *
- * If there is only one element in the the users array (which is set upon construction) or
- * an user has already been selected, this function returns immediately with the return
- * value %TRUE.
+ * polkit_cafe_authentication_dialog_indicate_error:
+ * @dialog: the auth dialog
  *
- * Returns: %TRUE if a user is selected (use polkit_cafe_dialog_get_selected_user() to obtain the user) or
- *          %FALSE if the dialog was cancelled.
+ * Call this function to indicate an authentication error; typically shakes the window.
+ * The animation runs off the frame clock so this returns immediately.
  **/
-gboolean
-polkit_cafe_authentication_dialog_run_until_user_is_selected (PolkitCafeAuthenticationDialog *dialog)
+void
+polkit_cafe_authentication_dialog_indicate_error (PolkitCafeAuthenticationDialog *dialog)
 {
-  gboolean ret;
-  gint response;
+  g_return_if_fail (POLKIT_CAFE_IS_AUTHENTICATION_DIALOG (dialog));
 
-  ret = FALSE;
+  /* nothing to shake */
+  if (!ctk_widget_get_mapped (CTK_WIDGET (dialog)))
+    return;
 
-  if (dialog->priv->selected_user != NULL)
+  /* restart an ongoing shake from where the window was originally */
+  if (dialog->priv->shake_tick_id == 0)
     {
-      ret = TRUE;
-      goto out;
+      dialog->priv->shake_composited = cdk_screen_is_composited (ctk_widget_get_screen (CTK_WIDGET (dialog)));
+      if (!dialog->priv->shake_composited)
+        ctk_window_get_position (CTK_WINDOW (dialog), &dialog->priv->shake_x, &dialog->priv->shake_y);
+
+      dialog->priv->shake_tick_id = ctk_widget_add_tick_callback (CTK_WIDGET (dialog),
+                                                                  shake_tick,
+                                                                  NULL,
+                                                                  NULL);
     }
 
-  dialog->priv->is_running = TRUE;
-
-  response = ctk_dialog_run (CTK_DIALOG (dialog));
-
-  dialog->priv->is_running = FALSE;
-
-  if (response == RESPONSE_USER_SELECTED)
-    ret = TRUE;
-
- out:
-  return ret;
+  /* the start time is taken from the first frame */
+  dialog->priv->shake_start_time = 0;
 }
 
 /**
- * polkit_cafe_authentication_dialog_run_until_response_for_prompt:
+ * polkit_cafe_authentication_dialog_show_prompt:
  * @dialog: A #PolkitCafeAuthenticationDialog.
  * @prompt: The prompt to present the user with.
  * @echo_chars: Whether characters should be echoed in the password entry box.
- * @was_cancelled: Set to %TRUE if the dialog was cancelled.
- * @new_user_selected: Set to %TRUE if another user was selected.
- *
- * Runs @dialog in a recursive main loop until a response to @prompt have been obtained from the user.
  *
- * Returns: The response (free with g_free()) or %NULL if one of @was_cancelled or @new_user_selected
- *          has been set to %TRUE.
+ * Shows the password entry with @prompt. The dialog emits
+ * #CtkDialog::response with %CTK_RESPONSE_OK once the user has answered;
+ * use polkit_cafe_authentication_dialog_finish_prompt() to get the answer.
  **/
-gchar *
-polkit_cafe_authentication_dialog_run_until_response_for_prompt (PolkitCafeAuthenticationDialog *dialog,
-                                                                  const gchar           *prompt,
-                                                                  gboolean               echo_chars,
-                                                                  gboolean              *was_cancelled,
-                                                                  gboolean              *new_user_selected)
+void
+polkit_cafe_authentication_dialog_show_prompt (PolkitCafeAuthenticationDialog *dialog,
+                                                const gchar                     *prompt,
+                                                gboolean                         echo_chars)
 {
-  gint response;
-  gchar *ret;
-
   ctk_label_set_text_with_mnemonic (CTK_LABEL (dialog->priv->prompt_label), prompt);
   ctk_entry_set_visibility (CTK_ENTRY (dialog->priv->password_entry), echo_chars);
   ctk_entry_set_text (CTK_ENTRY (dialog->priv->password_entry), "");
   ctk_widget_grab_focus (dialog->priv->password_entry);
 
-  ret = NULL;
-
-  if (was_cancelled != NULL)
-    *was_cancelled = FALSE;
-
-  if (new_user_selected != NULL)
-    *new_user_selected = FALSE;
-
-  dialog->priv->is_running = TRUE;
+  dialog->priv->is_prompting = TRUE;
 
   ctk_widget_set_no_show_all (dialog->priv->grid_password, FALSE);
   ctk_widget_show_all (dialog->priv->grid_password);
+}
 
-  response = ctk_dialog_run (CTK_DIALOG (dialog));
+/**
+ * polkit_cafe_authentication_dialog_finish_prompt:
+ * @dialog: A #PolkitCafeAuthenticationDialog.
+ *
+ * Hides the password entry shown by polkit_cafe_authentication_dialog_show_prompt().
+ *
+ * Returns: What the user entered (free with g_free()) or %NULL if no prompt was shown.
+ **/
+gchar *
+polkit_cafe_authentication_dialog_finish_prompt (PolkitCafeAuthenticationDialog *dialog)
+{
+  gchar *ret;
+
+  if (!dialog->priv->is_prompting)
+    return NULL;
+
+  ret = g_strdup (ctk_entry_get_text (CTK_ENTRY (dialog->priv->password_entry)));
+  ctk_entry_set_text (CTK_ENTRY (dialog->priv->password_entry), "");
 
   ctk_widget_hide (dialog->priv->grid_password);
   ctk_widget_set_no_show_all (dialog->priv->grid_password, TRUE);
 
-  dialog->priv->is_running = FALSE;
-
-  if (response == CTK_RESPONSE_OK)
-    {
-      ret = g_strdup (ctk_entry_get_text (CTK_ENTRY (dialog->priv->password_entry)));
-    }
-  else if (response == RESPONSE_USER_SELECTED)
-    {
-      if (new_user_selected != NULL)
-        *new_user_selected = TRUE;
-    }
-  else
-    {
-      if (was_cancelled != NULL)
-        *was_cancelled = TRUE;
-    }
+  dialog->priv->is_prompting = FALSE;
 
   return ret;
 }
@@ -1177,11 +1548,103 @@ polkit_cafe_authentication_dialog_get_selected_user (PolkitCafeAuthenticationDia
   return g_strdup (dialog->priv->selected_user);
 }
 
+static gboolean
+flush_messages_tick (CtkWidget     *widget,
+                     CdkFrameClock *frame_clock G_GNUC_UNUSED,
+                     gpointer       user_data G_GNUC_UNUSED)
+{
+  PolkitCafeAuthenticationDialog *dialog = POLKIT_CAFE_AUTHENTICATION_DIALOG (widget);
+  GPtrArray *pending = dialog->priv->pending_messages;
+  GList *messages;
+  GList *l;
+  guint num_shown;
+  guint n;
+
+  /* the source is removed by returning FALSE */
+  dialog->priv->messages_tick_id = 0;
+
+  /* make room by dropping the oldest labels */
+  messages = ctk_container_get_children (CTK_CONTAINER (dialog->priv->conversation_box));
+  num_shown = g_list_length (messages);
+  for (l = messages; l != NULL && num_shown + pending->len > MAX_MESSAGES; l = l->next)
+    {
+      ctk_widget_destroy (CTK_WIDGET (l->data));
+      num_shown--;
+    }
+  g_list_free (messages);
+
+  for (n = 0; n < pending->len; n++)
+    {
+      CtkWidget *label;
+
+      label = ctk_label_new (NULL);
+      ctk_label_set_markup (CTK_LABEL (label), g_ptr_array_index (pending, n));
+      ctk_label_set_line_wrap (CTK_LABEL (label), TRUE);
+      ctk_box_pack_start (CTK_BOX (dialog->priv->conversation_box), label, FALSE, FALSE, 0);
+      ctk_widget_show (label);
+    }
+  dialog->priv->num_shown_messages += pending->len;
+  g_ptr_array_set_size (pending, 0);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * polkit_cafe_authentication_dialog_add_message:
+ * @dialog: A #PolkitCafeAuthenticationDialog.
+ * @markup: The message to show.
+ *
+ * Adds a message below the messages already shown. Any prompt being
+ * shown stays as it is. The message appears with the next frame,
+ * together with all other messages added until then; a message that
+ * repeats the one before it is merged into it.
+ **/
 void
-polkit_cafe_authentication_dialog_set_info_message (PolkitCafeAuthenticationDialog *dialog,
-                                                     const gchar                     *info_markup)
+polkit_cafe_authentication_dialog_add_message (PolkitCafeAuthenticationDialog *dialog,
+                                                const gchar                     *markup)
 {
-  ctk_label_set_markup (CTK_LABEL (dialog->priv->info_label), info_markup);
+  GPtrArray *pending = dialog->priv->pending_messages;
+
+  /* e.g. fprintd asking to swipe again and again */
+  if (pending->len > 0 && strcmp (g_ptr_array_index (pending, pending->len - 1), markup) == 0)
+    {
+      dialog->priv->num_merged_messages++;
+      return;
+    }
+
+  /* only the last MAX_MESSAGES would be shown anyway */
+  if (pending->len >= MAX_MESSAGES)
+    {
+      g_ptr_array_remove_index (pending, 0);
+      dialog->priv->num_merged_messages++;
+    }
+
+  g_ptr_array_add (pending, g_strdup (markup));
+
+  if (dialog->priv->messages_tick_id == 0)
+    dialog->priv->messages_tick_id = ctk_widget_add_tick_callback (CTK_WIDGET (dialog),
+                                                                   flush_messages_tick,
+                                                                   NULL,
+                                                                   NULL);
+}
+
+/**
+ * polkit_cafe_authentication_dialog_clear_messages:
+ * @dialog: A #PolkitCafeAuthenticationDialog.
+ *
+ * Removes the messages added with polkit_cafe_authentication_dialog_add_message().
+ **/
+void
+polkit_cafe_authentication_dialog_clear_messages (PolkitCafeAuthenticationDialog *dialog)
+{
+  if (dialog->priv->messages_tick_id != 0)
+    {
+      ctk_widget_remove_tick_callback (CTK_WIDGET (dialog), dialog->priv->messages_tick_id);
+      dialog->priv->messages_tick_id = 0;
+    }
+  g_ptr_array_set_size (dialog->priv->pending_messages, 0);
+
+  ctk_container_foreach (CTK_CONTAINER (dialog->priv->conversation_box), (CtkCallback) ctk_widget_destroy, NULL);
 }
 
 
@@ -1189,17 +1652,38 @@ polkit_cafe_authentication_dialog_set_info_message (PolkitCafeAuthenticationDial
  * polkit_cafe_authentication_dialog_cancel:
  * @dialog: A #PolkitCafeAuthenticationDialog.
  *
- * Cancels the dialog if it is currenlty running.
+ * Cancels the prompt shown by the dialog, if any, by emitting
+ * #CtkDialog::response with %CTK_RESPONSE_CANCEL.
  *
- * Returns: %TRUE if the dialog was running.
+ * Returns: %TRUE if the dialog was prompting.
  **/
 gboolean
 polkit_cafe_authentication_dialog_cancel (PolkitCafeAuthenticationDialog *dialog)
 {
-  if (!dialog->priv->is_running)
+  if (!dialog->priv->is_prompting)
     return FALSE;
 
   ctk_dialog_response (CTK_DIALOG (dialog), CTK_RESPONSE_CANCEL);
 
   return TRUE;
 }
+
+/**
+ * polkit_cafe_authentication_dialog_get_message_stats:
+ * @dialog: A #PolkitCafeAuthenticationDialog.
+ * @out_shown: Return location for the number of messages shown or %NULL.
+ * @out_merged: Return location for the number of messages merged into another one or dropped before they were shown or %NULL.
+ *
+ * Gets the message counters of @dialog. They count over every request
+ * @dialog was used for.
+ **/
+void
+polkit_cafe_authentication_dialog_get_message_stats (PolkitCafeAuthenticationDialog *dialog,
+                                                      guint                          *out_shown,
+                                                      guint                          *out_merged)
+{
+  if (out_shown != NULL)
+    *out_shown = dialog->priv->num_shown_messages;
+  if (out_merged != NULL)
+    *out_merged = dialog->priv->num_merged_messages;
+}
@@ -58,17 +58,27 @@ CtkWidget *polkit_cafe_authentication_dialog_new                           (cons
                                                                              const gchar    *message_markup,
                                                                              PolkitDetails  *details,
                                                                              gchar         **users);
+void       polkit_cafe_authentication_dialog_reset                         (PolkitCafeAuthenticationDialog *dialog,
+                                                                             const gchar                     *action_id,
+                                                                             const gchar                     *vendor,
+                                                                             const gchar                     *vendor_url,
+                                                                             const gchar                     *icon_name,
+                                                                             const gchar                     *message_markup,
+                                                                             PolkitDetails                   *details,
+                                                                             gchar                          **users);
 gchar     *polkit_cafe_authentication_dialog_get_selected_user             (PolkitCafeAuthenticationDialog *dialog);
-gboolean   polkit_cafe_authentication_dialog_run_until_user_is_selected    (PolkitCafeAuthenticationDialog *dialog);
-gchar     *polkit_cafe_authentication_dialog_run_until_response_for_prompt (PolkitCafeAuthenticationDialog *dialog,
+void       polkit_cafe_authentication_dialog_show_prompt                   (PolkitCafeAuthenticationDialog *dialog,
                                                                              const gchar                     *prompt,
-                                                                             gboolean                         echo_chars,
-                                                                             gboolean                        *was_cancelled,
-                                                                             gboolean                        *new_user_selected);
+                                                                             gboolean                         echo_chars);
+gchar     *polkit_cafe_authentication_dialog_finish_prompt                 (PolkitCafeAuthenticationDialog *dialog);
 gboolean   polkit_cafe_authentication_dialog_cancel                        (PolkitCafeAuthenticationDialog *dialog);
 void       polkit_cafe_authentication_dialog_indicate_error                (PolkitCafeAuthenticationDialog *dialog);
-void       polkit_cafe_authentication_dialog_set_info_message              (PolkitCafeAuthenticationDialog *dialog,
-                                                                             const gchar                     *info_markup);
+void       polkit_cafe_authentication_dialog_add_message                   (PolkitCafeAuthenticationDialog *dialog,
+                                                                             const gchar                     *markup);
+void       polkit_cafe_authentication_dialog_clear_messages                (PolkitCafeAuthenticationDialog *dialog);
+void       polkit_cafe_authentication_dialog_get_message_stats             (PolkitCafeAuthenticationDialog *dialog,
+                                                                             guint                           *out_shown,
+                                                                             guint                           *out_merged);
 
 #ifdef __cplusplus
 }
@@ -23,8 +23,6 @@
 #include "config.h"
 
 #include <string.h>
-#include <sys/types.h>
-#include <pwd.h>
 #include <glib/gi18n.h>
 #include <cdk/cdkx.h>
 
@@ -32,7 +30,41 @@
 #include <polkitagent/polkitagent.h>
 
 #include "polkitcafeauthenticator.h"
+#include "polkitcafeactioncache.h"
+#include "polkitcafeidentityresolver.h"
 #include "polkitcafeauthenticationdialog.h"
+#include "polkitcafedialogpool.h"
+
+/* An authentication goes through these states, driven entirely by
+ * signals from the dialog and the PAM session:
+ *
+ *   INITIAL -> SELECT_USER -> SESSION_START -> PROMPT -> VERIFY
+ *                                  ^                       |
+ *                                  +---- retry / new user -+-> COMPLETE
+ *
+ * SELECT_USER is skipped when a user is already selected and PROMPT may
+ * be entered several times per session. An authenticator started with
+ * polkit_cafe_authenticator_initiate_from() has no dialog and answers
+ * its PROMPTs from the answers recorded by another authenticator. If its
+ * PAM stack asks anything else, or the answers don't work, it builds a
+ * dialog and starts over like any other authenticator.
+ *
+ * Spawning the setuid helper and loading the PAM modules takes a while,
+ * so when an attempt fails the session for the retry is started right
+ * away and comes up while the error is shown.
+ */
+typedef enum
+{
+  STATE_INITIAL,
+  STATE_SELECT_USER,
+  STATE_SESSION_START,
+  STATE_PROMPT,
+  STATE_VERIFY,
+  STATE_COMPLETE
+} AuthState;
+
+/* number of failed attempts after which the authentication fails */
+#define MAX_TRIES 3
 
 struct _PolkitCafeAuthenticator
 {
@@ -49,14 +81,25 @@ struct _PolkitCafeAuthenticator
   PolkitActionDescription *action_desc;
   gchar **users;
 
+  AuthState state;
   gboolean gained_authorization;
   gboolean was_cancelled;
   gboolean new_user_selected;
   gchar *selected_user;
+  guint num_tries;
+  guint complete_id;
+
+  /* what the user answered in the current conversation, or the answers
+   * to replay if there is no dialog; wiped once completed */
+  GPtrArray *answers;
+  guint next_answer;
+
+  /* the prompt the dialog currently shows, as PAM sent it */
+  gchar *prompt_request;
+  gboolean prompt_echo_on;
 
   PolkitAgentSession *session;
   CtkWidget *dialog;
-  GMainLoop *loop;
 };
 
 struct _PolkitCafeAuthenticatorClass
@@ -75,9 +118,45 @@ static guint signals[LAST_SIGNAL] = {0};
 
 G_DEFINE_TYPE (PolkitCafeAuthenticator, polkit_cafe_authenticator, G_TYPE_OBJECT);
 
+
+static void
+free_secret (gchar *text)
+{
+  if (text == NULL)
+    return;
+
+  /* don't leave passwords lying around on the heap */
+  memset (text, 0, strlen (text));
+  g_free (text);
+}
+
+/* an answer and the prompt it was given to */
+typedef struct
+{
+  gchar *request;
+  gboolean echo_on;
+  gchar *text;
+} Answer;
+
+static void
+answer_wipe (Answer *answer)
+{
+  free_secret (answer->text);
+  answer->text = NULL;
+}
+
 static void
-polkit_cafe_authenticator_init (PolkitCafeAuthenticator *authenticator G_GNUC_UNUSED)
+answer_free (Answer *answer)
 {
+  answer_wipe (answer);
+  g_free (answer->request);
+  g_free (answer);
+}
+
+static void
+polkit_cafe_authenticator_init (PolkitCafeAuthenticator *authenticator)
+{
+  authenticator->answers = g_ptr_array_new_with_free_func ((GDestroyNotify) answer_free);
 }
 
 static void
@@ -103,12 +182,20 @@ polkit_cafe_authenticator_finalize (GObject *object)
   g_strfreev (authenticator->users);
 
   g_free (authenticator->selected_user);
+  g_ptr_array_unref (authenticator->answers);
+  g_free (authenticator->prompt_request);
+  if (authenticator->complete_id != 0)
+    g_source_remove (authenticator->complete_id);
   if (authenticator->session != NULL)
-    g_object_unref (authenticator->session);
+    {
+      g_signal_handlers_disconnect_by_data (authenticator->session, authenticator);
+      g_object_unref (authenticator->session);
+    }
   if (authenticator->dialog != NULL)
-    ctk_widget_destroy (authenticator->dialog);
-  if (authenticator->loop != NULL)
-    g_main_loop_unref (authenticator->loop);
+    {
+      g_signal_handlers_disconnect_by_data (authenticator->dialog, authenticator);
+      polkit_cafe_dialog_pool_release (polkit_cafe_dialog_pool_get_default (), authenticator->dialog);
+    }
 
   if (G_OBJECT_CLASS (polkit_cafe_authenticator_parent_class)->finalize != NULL)
     G_OBJECT_CLASS (polkit_cafe_authenticator_parent_class)->finalize (object);
@@ -145,86 +232,294 @@ polkit_cafe_authenticator_class_init (PolkitCafeAuthenticatorClass *klass)
                                             G_TYPE_BOOLEAN);
 }
 
-static PolkitActionDescription *
-get_desc_for_action (PolkitAuthority *authority,
-                     const gchar     *action_id)
+/* All authenticators share a single authority handle. Requests that
+ * arrive while it is being obtained wait for the same call; a waiter
+ * that is cancelled is completed right away.
+ */
+static PolkitAuthority *shared_authority = NULL;
+static gboolean shared_authority_pending = FALSE;
+static GList *shared_authority_waiters = NULL;
+
+static void
+authority_waiter_cancelled_cb (GCancellable *cancellable,
+                               gpointer      user_data)
 {
-  GList *action_descs;
+  GTask *task = G_TASK (user_data);
+  gulong *cancel_id = g_task_get_task_data (task);
+
+  g_signal_handler_disconnect (cancellable, *cancel_id);
+  *cancel_id = 0;
+
+  shared_authority_waiters = g_list_remove (shared_authority_waiters, task);
+  g_task_return_error_if_cancelled (task);
+  g_object_unref (task);
+}
+
+static void
+disconnect_authority_waiter (GTask *task)
+{
+  gulong *cancel_id = g_task_get_task_data (task);
+
+  if (*cancel_id == 0)
+    return;
+
+  g_signal_handler_disconnect (g_task_get_cancellable (task), *cancel_id);
+  *cancel_id = 0;
+}
+
+static void
+shared_authority_cb (GObject      *source_object G_GNUC_UNUSED,
+                     GAsyncResult *res,
+                     gpointer      user_data G_GNUC_UNUSED)
+{
+  GList *waiters;
   GList *l;
-  PolkitActionDescription *result;
+  GError *error;
+
+  shared_authority_pending = FALSE;
 
-  result = NULL;
+  waiters = shared_authority_waiters;
+  shared_authority_waiters = NULL;
 
-  action_descs = polkit_authority_enumerate_actions_sync (authority,
-                                                          NULL,
-                                                          NULL);
-  for (l = action_descs; l != NULL; l = l->next)
+  /* before any callback runs and possibly cancels another waiter */
+  g_list_foreach (waiters, (GFunc) disconnect_authority_waiter, NULL);
+
+  error = NULL;
+  shared_authority = polkit_authority_get_finish (res, &error);
+
+  for (l = waiters; l != NULL; l = l->next)
     {
-      PolkitActionDescription *action_desc = POLKIT_ACTION_DESCRIPTION (l->data);
+      GTask *task = G_TASK (l->data);
 
-      if (strcmp (polkit_action_description_get_action_id (action_desc), action_id) == 0)
-        {
-          result = g_object_ref (action_desc);
-          goto out;
-        }
+      if (shared_authority != NULL)
+        g_task_return_pointer (task, g_object_ref (shared_authority), g_object_unref);
+      else
+        g_task_return_error (task, g_error_copy (error));
     }
+  g_list_free_full (waiters, g_object_unref);
 
- out:
+  if (error != NULL)
+    g_error_free (error);
+}
+
+static void
+get_shared_authority (GCancellable        *cancellable,
+                      GAsyncReadyCallback  callback,
+                      gpointer             user_data)
+{
+  GTask *task;
+  gulong *cancel_id;
 
-  g_list_foreach (action_descs, (GFunc) g_object_unref, NULL);
-  g_list_free (action_descs);
+  task = g_task_new (NULL, cancellable, callback, user_data);
 
-  return result;
+  if (shared_authority != NULL)
+    {
+      g_task_return_pointer (task, g_object_ref (shared_authority), g_object_unref);
+      g_object_unref (task);
+      return;
+    }
+
+  if (g_task_return_error_if_cancelled (task))
+    {
+      g_object_unref (task);
+      return;
+    }
+
+  /* the call keeps going even if every waiter is cancelled; the next
+   * request gets its result */
+  if (!shared_authority_pending)
+    {
+      shared_authority_pending = TRUE;
+      polkit_authority_get_async (NULL, shared_authority_cb, NULL);
+    }
+
+  cancel_id = g_new0 (gulong, 1);
+  g_task_set_task_data (task, cancel_id, g_free);
+
+  /* the reference is released once the authority is known or the
+   * request is cancelled */
+  shared_authority_waiters = g_list_append (shared_authority_waiters, task);
+  if (cancellable != NULL)
+    *cancel_id = g_signal_connect (cancellable,
+                                   "cancelled",
+                                   G_CALLBACK (authority_waiter_cancelled_cb),
+                                   task);
 }
 
-static void
-on_dialog_deleted (CtkWidget *widget G_GNUC_UNUSED,
-		   CdkEvent  *event G_GNUC_UNUSED,
-		   gpointer   user_data)
+static PolkitAuthority *
+get_shared_authority_finish (GAsyncResult  *res,
+                             GError       **error)
 {
-  PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (user_data);
+  return g_task_propagate_pointer (G_TASK (res), error);
+}
 
-  polkit_cafe_authenticator_cancel (authenticator);
+/* Construction runs two branches concurrently - authority + action
+ * description, and identity resolution - and completes the task once
+ * both of them have finished.
+ */
+typedef struct
+{
+  guint pending;
+  GError *error;
+} NewData;
+
+static void
+new_data_free (NewData *data)
+{
+  if (data->error != NULL)
+    g_error_free (data->error);
+  g_free (data);
 }
 
+/* takes ownership of @error and of the reference to @task */
 static void
-on_user_selected (GObject    *object G_GNUC_UNUSED,
-		  GParamSpec *pspec G_GNUC_UNUSED,
-		  gpointer    user_data)
+new_step_done (GTask  *task,
+               GError *error)
 {
-  PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (user_data);
+  PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (g_task_get_source_object (task));
+  NewData *data = g_task_get_task_data (task);
 
-  /* clear any previous messages */
-  polkit_cafe_authentication_dialog_set_info_message (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog), "");
+  if (error != NULL)
+    {
+      if (data->error == NULL)
+        data->error = error;
+      else
+        g_error_free (error);
+    }
 
-  polkit_cafe_authenticator_cancel (authenticator);
-  authenticator->new_user_selected = TRUE;
+  data->pending--;
+  if (data->pending > 0)
+    goto out;
+
+  if (data->error != NULL)
+    {
+      g_task_return_error (task, data->error);
+      data->error = NULL;
+      goto out;
+    }
+
+  g_task_return_pointer (task, g_object_ref (authenticator), g_object_unref);
+
+ out:
+  g_object_unref (task);
 }
 
-PolkitCafeAuthenticator *
-polkit_cafe_authenticator_new (const gchar     *action_id,
-                                const gchar     *message,
-                                const gchar     *icon_name,
-                                PolkitDetails   *details,
-                                const gchar     *cookie,
-                                GList           *identities)
+static void
+action_desc_cb (GObject      *source_object,
+                GAsyncResult *res,
+                gpointer      user_data)
 {
-  PolkitCafeAuthenticator *authenticator;
-  GList *l;
-  guint n;
+  GTask *task = G_TASK (user_data);
+  PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (g_task_get_source_object (task));
   GError *error;
 
-  authenticator = POLKIT_CAFE_AUTHENTICATOR (g_object_new (POLKIT_CAFE_TYPE_AUTHENTICATOR, NULL));
+  error = NULL;
+  authenticator->action_desc = polkit_cafe_action_cache_lookup_finish (POLKIT_CAFE_ACTION_CACHE (source_object),
+                                                                       res,
+                                                                       &error);
+  new_step_done (task, error);
+}
+
+static void
+authority_cb (GObject      *source_object G_GNUC_UNUSED,
+              GAsyncResult *res,
+              gpointer      user_data)
+{
+  GTask *task = G_TASK (user_data);
+  PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (g_task_get_source_object (task));
+  GError *error;
 
   error = NULL;
-  authenticator->authority = polkit_authority_get_sync (NULL /* GCancellable* */, &error);
+  authenticator->authority = get_shared_authority_finish (res, &error);
   if (authenticator->authority == NULL)
     {
-      g_critical ("Error getting authority: %s", error->message);
-      g_error_free (error);
-      goto error;
+      new_step_done (task, error);
+      return;
+    }
+
+  polkit_cafe_action_cache_lookup (polkit_cafe_action_cache_get_default (),
+                                   authenticator->authority,
+                                   authenticator->action_id,
+                                   g_task_get_cancellable (task),
+                                   action_desc_cb,
+                                   task);
+}
+
+static void
+users_cb (GObject      *source_object,
+          GAsyncResult *res,
+          gpointer      user_data)
+{
+  GTask *task = G_TASK (user_data);
+  PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (g_task_get_source_object (task));
+  GPtrArray *records;
+  GError *error;
+  guint n;
+
+  error = NULL;
+  records = polkit_cafe_identity_resolver_resolve_finish (POLKIT_CAFE_IDENTITY_RESOLVER (source_object),
+                                                          res,
+                                                          &error);
+  if (records == NULL)
+    goto out;
+
+  if (records->len == 0)
+    {
+      g_set_error (&error,
+                   POLKIT_ERROR,
+                   POLKIT_ERROR_FAILED,
+                   "None of the identities could be resolved");
+      goto out;
+    }
+
+  authenticator->users = g_new0 (gchar *, records->len + 1);
+  for (n = 0; n < records->len; n++)
+    {
+      PolkitCafeUserRecord *record = g_ptr_array_index (records, n);
+
+      authenticator->users[n] = g_strdup (record->name);
     }
 
+ out:
+  if (records != NULL)
+    g_ptr_array_unref (records);
+  new_step_done (task, error);
+}
+
+/**
+ * polkit_cafe_authenticator_new_async:
+ * @action_id: The action to authenticate for.
+ * @message: The message to show.
+ * @icon_name: The icon to show or %NULL.
+ * @details: Details about the request or %NULL.
+ * @cookie: The cookie identifying the authentication request.
+ * @identities: A list of #PolkitIdentity objects that can be used to authenticate.
+ * @cancellable: A #GCancellable or %NULL.
+ * @callback: Function to call when the authenticator has been constructed.
+ * @user_data: Data to pass to @callback.
+ *
+ * Asynchronously constructs an authenticator. The shared authority and the
+ * action description are obtained while the identities are resolved in
+ * one batch by the identity resolver, so the main loop is never blocked.
+ * The dialog is not built until polkit_cafe_authenticator_initiate().
+ **/
+void
+polkit_cafe_authenticator_new_async (const gchar         *action_id,
+                                     const gchar         *message,
+                                     const gchar         *icon_name,
+                                     PolkitDetails       *details,
+                                     const gchar         *cookie,
+                                     GList               *identities,
+                                     GCancellable        *cancellable,
+                                     GAsyncReadyCallback  callback,
+                                     gpointer             user_data)
+{
+  PolkitCafeAuthenticator *authenticator;
+  GTask *task;
+  NewData *data;
+
+  authenticator = POLKIT_CAFE_AUTHENTICATOR (g_object_new (POLKIT_CAFE_TYPE_AUTHENTICATOR, NULL));
+
   authenticator->action_id = g_strdup (action_id);
   authenticator->message = g_strdup (message);
   authenticator->icon_name = g_strdup (icon_name);
@@ -234,45 +529,107 @@ polkit_cafe_authenticator_new (const gchar     *action_id,
   authenticator->identities = g_list_copy (identities);
   g_list_foreach (authenticator->identities, (GFunc) g_object_ref, NULL);
 
-  authenticator->action_desc = get_desc_for_action (authenticator->authority,
-                                                    authenticator->action_id);
-  if (authenticator->action_desc == NULL)
-    goto error;
+  task = g_task_new (G_OBJECT (authenticator), cancellable, callback, user_data);
+  g_task_set_source_tag (task, polkit_cafe_authenticator_new_async);
+  data = g_new0 (NewData, 1);
+  data->pending = 2;
+  g_task_set_task_data (task, data, (GDestroyNotify) new_data_free);
 
-  authenticator->users = g_new0 (gchar *, g_list_length (authenticator->identities) + 1);
-  for (l = authenticator->identities, n = 0; l != NULL; l = l->next, n++)
-    {
-      PolkitUnixUser *user = POLKIT_UNIX_USER (l->data);
-      uid_t uid;
-      struct passwd *passwd;
+  get_shared_authority (cancellable, authority_cb, g_object_ref (task));
 
-      uid = polkit_unix_user_get_uid (user);
-      passwd = getpwuid (uid);
-      authenticator->users[n] = g_strdup (passwd->pw_name);
-    }
+  polkit_cafe_identity_resolver_resolve (polkit_cafe_identity_resolver_get_default (),
+                                         authenticator->identities,
+                                         cancellable,
+                                         users_cb,
+                                         g_object_ref (task));
 
-  authenticator->dialog = polkit_cafe_authentication_dialog_new
-                            (authenticator->action_id,
-                             polkit_action_description_get_vendor_name (authenticator->action_desc),
-                             polkit_action_description_get_vendor_url (authenticator->action_desc),
-                             authenticator->icon_name,
-                             authenticator->message,
-                             authenticator->details,
-                             authenticator->users);
-  g_signal_connect (authenticator->dialog,
-                    "delete-event",
-                    G_CALLBACK (on_dialog_deleted),
-                    authenticator);
-  g_signal_connect (authenticator->dialog,
-                    "notify::selected-user",
-                    G_CALLBACK (on_user_selected),
-                    authenticator);
+  g_object_unref (task);
+  g_object_unref (authenticator);
+}
+
+/**
+ * polkit_cafe_authenticator_new_finish:
+ * @res: A #GAsyncResult obtained from the #GAsyncReadyCallback passed to polkit_cafe_authenticator_new_async().
+ * @error: Return location for error or %NULL.
+ *
+ * Finishes constructing an authenticator.
+ *
+ * Returns: A #PolkitCafeAuthenticator (free with g_object_unref()) or %NULL if @error is set.
+ **/
+PolkitCafeAuthenticator *
+polkit_cafe_authenticator_new_finish (GAsyncResult  *res,
+                                      GError       **error)
+{
+  GTask *task = G_TASK (res);
+
+  g_warn_if_fail (g_task_get_source_tag (task) == polkit_cafe_authenticator_new_async);
+
+  return g_task_propagate_pointer (task, error);
+}
+
+static void start_session (PolkitCafeAuthenticator *authenticator);
+static gboolean build_dialog (PolkitCafeAuthenticator *authenticator);
+static void show_dialog (PolkitCafeAuthenticator *authenticator);
 
-  return authenticator;
+static gboolean
+complete_idle_cb (gpointer user_data)
+{
+  PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (user_data);
+
+  authenticator->complete_id = 0;
+
+  g_signal_emit_by_name (authenticator,
+                         "completed",
+                         authenticator->gained_authorization,
+                         authenticator->was_cancelled);
 
- error:
+  /* handlers have handed the answers to any followers by now */
+  g_ptr_array_set_size (authenticator->answers, 0);
+
+  /* the reference taken in polkit_cafe_authenticator_initiate() */
   g_object_unref (authenticator);
-  return NULL;
+
+  return FALSE;
+}
+
+static void
+complete (PolkitCafeAuthenticator *authenticator)
+{
+  if (authenticator->state == STATE_COMPLETE)
+    return;
+
+  authenticator->state = STATE_COMPLETE;
+
+  /* only the answers that gained the authorization are replayed */
+  if (!authenticator->gained_authorization)
+    g_ptr_array_set_size (authenticator->answers, 0);
+
+  if (authenticator->dialog != NULL)
+    {
+      guint num_shown;
+      guint num_merged;
+
+      polkit_cafe_authentication_dialog_get_message_stats (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog),
+                                                           &num_shown,
+                                                           &num_merged);
+      g_debug ("Dialog has shown %u PAM messages so far, merged or dropped %u",
+               num_shown, num_merged);
+    }
+
+  /* emitted from idle so the listener never disposes of us from within
+   * a dialog or session signal handler */
+  authenticator->complete_id = g_idle_add (complete_idle_cb, authenticator);
+}
+
+static void
+clear_session (PolkitCafeAuthenticator *authenticator)
+{
+  if (authenticator->session == NULL)
+    return;
+
+  g_signal_handlers_disconnect_by_data (authenticator->session, authenticator);
+  g_object_unref (authenticator->session);
+  authenticator->session = NULL;
 }
 
 static void
@@ -282,12 +639,37 @@ session_request (PolkitAgentSession *session G_GNUC_UNUSED,
 		 gpointer            user_data)
 {
   PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (user_data);
-  gchar *password;
   gchar *modified_request;
 
-  password = NULL;
+  if (authenticator->dialog == NULL)
+    {
+      Answer *answer;
+
+      authenticator->state = STATE_VERIFY;
+
+      answer = NULL;
+      if (authenticator->next_answer < authenticator->answers->len)
+        answer = g_ptr_array_index (authenticator->answers, authenticator->next_answer++);
+
+      /* the conversation went differently this time, e.g. an OTP or a
+       * fingerprint; the user is asked once the session is gone */
+      if (answer == NULL ||
+          answer->echo_on != echo_on ||
+          g_strcmp0 (answer->request, request) != 0)
+        {
+          g_ptr_array_set_size (authenticator->answers, 0);
+          polkit_agent_session_cancel (authenticator->session);
+          return;
+        }
+
+      polkit_agent_session_response (authenticator->session, answer->text);
+      answer_wipe (answer);
+      return;
+    }
 
-  //g_debug ("in conversation_pam_prompt, request='%s', echo_on=%d", request, echo_on);
+  g_free (authenticator->prompt_request);
+  authenticator->prompt_request = g_strdup (request);
+  authenticator->prompt_echo_on = echo_on;
 
   /* Fix up, and localize, password prompt if it's password auth */
   if (g_ascii_strncasecmp (request, "password:", 9) == 0)
@@ -306,28 +688,14 @@ session_request (PolkitAgentSession *session G_GNUC_UNUSED,
       modified_request = g_strdup (request);
     }
 
-  ctk_widget_show_all (CTK_WIDGET (authenticator->dialog));
-  ctk_window_present_with_time (CTK_WINDOW (authenticator->dialog),
-                                cdk_x11_get_server_time (ctk_widget_get_window (CTK_WIDGET (authenticator->dialog))));
-  password = polkit_cafe_authentication_dialog_run_until_response_for_prompt (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog),
-                                                                               modified_request,
-                                                                               echo_on,
-                                                                               &authenticator->was_cancelled,
-                                                                               &authenticator->new_user_selected);
-
-  /* cancel auth unless user provided a password */
-  if (password == NULL)
-    {
-      polkit_cafe_authenticator_cancel (authenticator);
-      goto out;
-    }
-  else
-    {
-      polkit_agent_session_response (authenticator->session, password);
-      g_free (password);
-    }
+  authenticator->state = STATE_PROMPT;
+
+  /* the dialog is already up; further prompts of the conversation,
+   * e.g. an OTP after the password, just replace the previous one */
+  polkit_cafe_authentication_dialog_show_prompt (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog),
+                                                 modified_request,
+                                                 echo_on);
 
-out:
   g_free (modified_request);
 }
 
@@ -339,8 +707,11 @@ session_show_error (PolkitAgentSession *session G_GNUC_UNUSED,
   PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (user_data);
   gchar *s;
 
-  s = g_strconcat ("<b>", msg, "</b>", NULL);
-  polkit_cafe_authentication_dialog_set_info_message (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog), s);
+  if (authenticator->dialog == NULL)
+    return;
+
+  s = g_markup_printf_escaped ("<b>%s</b>", msg);
+  polkit_cafe_authentication_dialog_add_message (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog), s);
   g_free (s);
 }
 
@@ -352,63 +723,122 @@ session_show_info (PolkitAgentSession *session G_GNUC_UNUSED,
   PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (user_data);
   gchar *s;
 
-  s = g_strconcat ("<b>", msg, "</b>", NULL);
-  polkit_cafe_authentication_dialog_set_info_message (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog), s);
-  g_free (s);
+  if (authenticator->dialog == NULL)
+    return;
 
-  ctk_widget_show_all (CTK_WIDGET (authenticator->dialog));
-  ctk_window_present (CTK_WINDOW (authenticator->dialog));
+  /* e.g. "Swipe your finger" while the password prompt stays usable */
+  s = g_markup_escape_text (msg, -1);
+  polkit_cafe_authentication_dialog_add_message (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog), s);
+  g_free (s);
 }
 
-
 static void
 session_completed (PolkitAgentSession *session G_GNUC_UNUSED,
 		   gboolean            gained_authorization,
 		   gpointer            user_data)
 {
   PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (user_data);
+  gchar *s;
 
-  authenticator->gained_authorization = gained_authorization;
+  /* the signal emission holds its own reference to the session */
+  clear_session (authenticator);
 
-  //g_debug ("in conversation_done gained=%d", gained_authorization);
+  if (authenticator->dialog == NULL)
+    {
+      authenticator->gained_authorization = gained_authorization;
+      if (gained_authorization || authenticator->was_cancelled)
+        {
+          complete (authenticator);
+          return;
+        }
 
-  g_main_loop_quit (authenticator->loop);
-}
+      /* replaying the answers did not work; ask the user instead */
+      g_debug ("Replaying answers for %s failed, showing a dialog", authenticator->action_id);
+      g_ptr_array_set_size (authenticator->answers, 0);
+      if (!build_dialog (authenticator))
+        {
+          complete (authenticator);
+          return;
+        }
+      show_dialog (authenticator);
+      return;
+    }
 
+  /* whatever was typed while the attempt was verified */
+  free_secret (polkit_cafe_authentication_dialog_finish_prompt (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog)));
 
-static gboolean
-do_initiate (gpointer user_data)
-{
-  PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (user_data);
-  PolkitIdentity *identity;
-  gint num_tries;
+  if (authenticator->new_user_selected)
+    {
+      authenticator->new_user_selected = FALSE;
+      start_session (authenticator);
+      return;
+    }
 
-  ctk_widget_show_all (CTK_WIDGET (authenticator->dialog));
-  ctk_window_present (CTK_WINDOW (authenticator->dialog));
-  if (!polkit_cafe_authentication_dialog_run_until_user_is_selected (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog)))
+  authenticator->gained_authorization = gained_authorization;
+
+  if (gained_authorization || authenticator->was_cancelled)
     {
-      /* user cancelled the dialog */
-      /*g_debug ("User cancelled before selecting a user");*/
-      authenticator->was_cancelled = TRUE;
-      goto out;
+      complete (authenticator);
+      return;
     }
 
-  authenticator->loop = g_main_loop_new (NULL, TRUE);
+  authenticator->num_tries++;
 
-  num_tries = 0;
+  /* the messages of the failed attempt are stale now */
+  polkit_cafe_authentication_dialog_clear_messages (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog));
+  s = g_strconcat ("<b>", _("Your authentication attempt was unsuccessful. Please try again."), "</b>", NULL);
+  polkit_cafe_authentication_dialog_add_message (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog), s);
+  g_free (s);
 
- try_again:
+  /* shake the dialog to indicate error */
+  polkit_cafe_authentication_dialog_indicate_error (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog));
 
-  g_free (authenticator->selected_user);
-  authenticator->selected_user = polkit_cafe_authentication_dialog_get_selected_user (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog));
+  if (authenticator->num_tries < MAX_TRIES)
+    start_session (authenticator);
+  else
+    complete (authenticator);
+}
 
-  /*g_debug ("Authenticating user %s", authenticator->selected_user);*/
-  identity = polkit_unix_user_new_for_name (authenticator->selected_user, NULL);
+static PolkitAgentSession *
+new_session (const gchar *user_name,
+             const gchar *cookie)
+{
+  PolkitIdentity *identity;
+  PolkitAgentSession *session;
 
-  authenticator->session = polkit_agent_session_new (identity, authenticator->cookie);
+  identity = polkit_unix_user_new_for_name (user_name, NULL);
+  if (identity == NULL)
+    return NULL;
 
+  session = polkit_agent_session_new (identity, cookie);
   g_object_unref (identity);
 
+  return session;
+}
+
+static void
+start_session (PolkitCafeAuthenticator *authenticator)
+{
+  authenticator->state = STATE_SESSION_START;
+  authenticator->next_answer = 0;
+
+  if (authenticator->dialog != NULL)
+    {
+      g_free (authenticator->selected_user);
+      authenticator->selected_user = polkit_cafe_authentication_dialog_get_selected_user (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog));
+
+      /* a new conversation */
+      g_ptr_array_set_size (authenticator->answers, 0);
+    }
+
+  authenticator->session = new_session (authenticator->selected_user, authenticator->cookie);
+  if (authenticator->session == NULL)
+    {
+      g_warning ("Cannot authenticate unknown user %s", authenticator->selected_user);
+      complete (authenticator);
+      return;
+    }
+
   g_signal_connect (authenticator->session,
                     "request",
                     G_CALLBACK (session_request),
@@ -430,86 +860,283 @@ do_initiate (gpointer user_data)
                     authenticator);
 
   polkit_agent_session_initiate (authenticator->session);
+}
+
+static void
+on_dialog_response (CtkDialog *dialog G_GNUC_UNUSED,
+                    gint       response_id,
+                    gpointer   user_data)
+{
+  PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (user_data);
+  Answer *answer;
 
-  g_main_loop_run (authenticator->loop);
+  switch (response_id)
+    {
+    case CTK_RESPONSE_OK:
+      if (authenticator->state != STATE_PROMPT)
+        break;
+
+      answer = g_new0 (Answer, 1);
+      answer->request = g_strdup (authenticator->prompt_request);
+      answer->echo_on = authenticator->prompt_echo_on;
+      answer->text = polkit_cafe_authentication_dialog_finish_prompt (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog));
+      authenticator->state = STATE_VERIFY;
+      polkit_agent_session_response (authenticator->session, answer->text);
+      g_ptr_array_add (authenticator->answers, answer);
+      break;
+
+    case CTK_RESPONSE_CANCEL:
+    case CTK_RESPONSE_DELETE_EVENT:
+    case CTK_RESPONSE_NONE:
+      polkit_cafe_authenticator_cancel (authenticator);
+      break;
 
-  /*g_debug ("gained_authorization=%d was_cancelled=%d new_user_selected=%d.",
-           authenticator->gained_authorization,
-           authenticator->was_cancelled,
-           authenticator->new_user_selected);*/
+    default:
+      break;
+    }
+}
 
-  if (authenticator->new_user_selected)
+static gboolean
+on_dialog_deleted (CtkWidget *widget G_GNUC_UNUSED,
+		   CdkEvent  *event G_GNUC_UNUSED,
+		   gpointer   user_data)
+{
+  PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (user_data);
+
+  polkit_cafe_authenticator_cancel (authenticator);
+
+  /* the dialog goes back to the pool; don't let it be destroyed */
+  return TRUE;
+}
+
+static void
+on_user_selected (GObject    *object G_GNUC_UNUSED,
+		  GParamSpec *pspec G_GNUC_UNUSED,
+		  gpointer    user_data)
+{
+  PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (user_data);
+
+  /* clear any previous messages */
+  polkit_cafe_authentication_dialog_clear_messages (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog));
+
+  switch (authenticator->state)
     {
-      /*g_debug ("New user selected");*/
-      authenticator->new_user_selected = FALSE;
-      g_object_unref (authenticator->session);
-      authenticator->session = NULL;
-      goto try_again;
+    case STATE_SELECT_USER:
+      start_session (authenticator);
+      break;
+
+    case STATE_SESSION_START:
+    case STATE_PROMPT:
+    case STATE_VERIFY:
+      /* restart with the new user once the current session is gone */
+      authenticator->new_user_selected = TRUE;
+      polkit_agent_session_cancel (authenticator->session);
+      break;
+
+    default:
+      break;
     }
+}
+
+static gboolean
+build_dialog (PolkitCafeAuthenticator *authenticator)
+{
+  authenticator->dialog = polkit_cafe_dialog_pool_acquire
+                            (polkit_cafe_dialog_pool_get_default (),
+                             authenticator->action_id,
+                             polkit_action_description_get_vendor_name (authenticator->action_desc),
+                             polkit_action_description_get_vendor_url (authenticator->action_desc),
+                             authenticator->icon_name,
+                             authenticator->message,
+                             authenticator->details,
+                             authenticator->users);
+  if (authenticator->dialog == NULL)
+    return FALSE;
+
+  g_signal_connect (authenticator->dialog,
+                    "response",
+                    G_CALLBACK (on_dialog_response),
+                    authenticator);
+  g_signal_connect (authenticator->dialog,
+                    "delete-event",
+                    G_CALLBACK (on_dialog_deleted),
+                    authenticator);
+  g_signal_connect (authenticator->dialog,
+                    "notify::selected-user",
+                    G_CALLBACK (on_user_selected),
+                    authenticator);
 
-  num_tries++;
+  return TRUE;
+}
 
-  if (!authenticator->gained_authorization && !authenticator->was_cancelled)
+static gboolean
+do_initiate (gpointer user_data)
+{
+  PolkitCafeAuthenticator *authenticator = POLKIT_CAFE_AUTHENTICATOR (user_data);
+
+  /* cancelled while waiting in the queue */
+  if (authenticator->was_cancelled)
     {
-      if (authenticator->dialog != NULL)
-        {
-          gchar *s;
-
-          s = g_strconcat ("<b>", _("Your authentication attempt was unsuccessful. Please try again."), "</b>", NULL);
-          polkit_cafe_authentication_dialog_set_info_message (
-                                  POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog),
-                                  s);
-          g_free (s);
-          ctk_widget_queue_draw (authenticator->dialog);
-
-          /* shake the dialog to indicate error */
-          polkit_cafe_authentication_dialog_indicate_error (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog));
-
-          if (num_tries < 3)
-            {
-              g_object_unref (authenticator->session);
-              authenticator->session = NULL;
-              goto try_again;
-            }
-        }
+      complete (authenticator);
+      return FALSE;
     }
 
- out:
-  g_signal_emit_by_name (authenticator,
-                         "completed",
-                         authenticator->gained_authorization,
-                         authenticator->was_cancelled);
+  /* the dialog is only built once the request becomes active so queued
+   * requests don't each hold on to a realized window */
+  if (!build_dialog (authenticator))
+    {
+      complete (authenticator);
+      return FALSE;
+    }
 
-  g_object_unref (authenticator);
+  show_dialog (authenticator);
 
   return FALSE;
 }
 
+static void
+show_dialog (PolkitCafeAuthenticator *authenticator)
+{
+  gchar *selected_user;
+
+  /* spawn the helper for a preselected user before mapping the window
+   * so the two overlap */
+  selected_user = polkit_cafe_authentication_dialog_get_selected_user (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog));
+  if (selected_user != NULL)
+    start_session (authenticator);
+  else
+    authenticator->state = STATE_SELECT_USER;
+  g_free (selected_user);
+
+  if (authenticator->state == STATE_COMPLETE)
+    return;
+
+  /* shown and presented once; the PAM conversation only updates it */
+  ctk_widget_show_all (CTK_WIDGET (authenticator->dialog));
+  ctk_window_present_with_time (CTK_WINDOW (authenticator->dialog),
+                                cdk_x11_get_server_time (ctk_widget_get_window (CTK_WIDGET (authenticator->dialog))));
+}
+
+/**
+ * polkit_cafe_authenticator_initiate:
+ * @authenticator: A #PolkitCafeAuthenticator.
+ *
+ * Starts the authentication. This returns right away; the
+ * #PolkitCafeAuthenticator::completed signal is emitted once the user
+ * has authenticated, given up or the request was cancelled.
+ **/
 void
 polkit_cafe_authenticator_initiate (PolkitCafeAuthenticator *authenticator)
 {
-  /* run from idle since we're going to block the main loop in the dialog (which has a recursive mainloop) */
+  g_return_if_fail (authenticator->state == STATE_INITIAL);
+
+  /* released once completed has been emitted */
   g_idle_add (do_initiate, g_object_ref (authenticator));
 }
 
+/**
+ * polkit_cafe_authenticator_initiate_from:
+ * @authenticator: A #PolkitCafeAuthenticator that has not been initiated.
+ * @leader: A completed #PolkitCafeAuthenticator for an equivalent request.
+ *
+ * Completes @authenticator with the outcome of @leader without showing
+ * a dialog. If @leader gained the authorization, the answers the user
+ * gave to it are replayed to a PAM session for the cookie of
+ * @authenticator, since every cookie needs its own helper. Each answer
+ * is wiped as soon as it has been sent. If the session asks for
+ * something @leader was not asked, or the answers are rejected,
+ * @authenticator prompts the user with a dialog of its own.
+ *
+ * This must be called from a handler of the
+ * #PolkitCafeAuthenticator::completed signal of @leader, which wipes
+ * its answers right after the emission.
+ **/
 void
-polkit_cafe_authenticator_cancel (PolkitCafeAuthenticator *authenticator)
+polkit_cafe_authenticator_initiate_from (PolkitCafeAuthenticator *authenticator,
+                                         PolkitCafeAuthenticator *leader)
 {
-  if (authenticator->dialog != NULL)
-    polkit_cafe_authentication_dialog_cancel (POLKIT_CAFE_AUTHENTICATION_DIALOG (authenticator->dialog));
+  guint n;
+
+  g_return_if_fail (authenticator->state == STATE_INITIAL);
+  g_return_if_fail (leader->state == STATE_COMPLETE);
 
+  /* released once completed has been emitted */
+  g_object_ref (authenticator);
+
+  if (authenticator->was_cancelled || !leader->gained_authorization)
+    {
+      authenticator->was_cancelled = authenticator->was_cancelled || leader->was_cancelled;
+      complete (authenticator);
+      return;
+    }
+
+  authenticator->selected_user = g_strdup (leader->selected_user);
+  for (n = 0; n < leader->answers->len; n++)
+    {
+      Answer *leader_answer = g_ptr_array_index (leader->answers, n);
+      Answer *answer;
+
+      answer = g_new0 (Answer, 1);
+      answer->request = g_strdup (leader_answer->request);
+      answer->echo_on = leader_answer->echo_on;
+      answer->text = g_strdup (leader_answer->text);
+      g_ptr_array_add (authenticator->answers, answer);
+    }
+
+  start_session (authenticator);
+}
+
+void
+polkit_cafe_authenticator_cancel (PolkitCafeAuthenticator *authenticator)
+{
   authenticator->was_cancelled = TRUE;
+  authenticator->new_user_selected = FALSE;
 
-  if (authenticator->session != NULL)
+  switch (authenticator->state)
     {
+    case STATE_SELECT_USER:
+      complete (authenticator);
+      break;
+
+    case STATE_SESSION_START:
+    case STATE_PROMPT:
+    case STATE_VERIFY:
+      /* completes via session_completed() */
       polkit_agent_session_cancel (authenticator->session);
+      break;
+
+    default:
+      /* not initiated yet, or already done */
+      break;
     }
 }
 
+const gchar *
+polkit_cafe_authenticator_get_action_id (PolkitCafeAuthenticator *authenticator)
+{
+  return authenticator->action_id;
+}
+
 const gchar *
 polkit_cafe_authenticator_get_cookie (PolkitCafeAuthenticator *authenticator)
 {
   return authenticator->cookie;
 }
 
+/**
+ * polkit_cafe_authenticator_is_prompting:
+ * @authenticator: A #PolkitCafeAuthenticator.
+ *
+ * Checks whether the dialog of @authenticator waits for the user to
+ * answer a prompt, or the answer is being verified.
+ *
+ * Returns: %TRUE if the user is in the middle of authenticating.
+ **/
+gboolean
+polkit_cafe_authenticator_is_prompting (PolkitCafeAuthenticator *authenticator)
+{
+  return authenticator->dialog != NULL &&
+         (authenticator->state == STATE_PROMPT || authenticator->state == STATE_VERIFY);
+}
+
 
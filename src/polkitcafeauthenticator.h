@@ -39,15 +39,24 @@ typedef struct _PolkitCafeAuthenticator PolkitCafeAuthenticator;
 typedef struct _PolkitCafeAuthenticatorClass PolkitCafeAuthenticatorClass;
 
 GType                      polkit_cafe_authenticator_get_type   (void) G_GNUC_CONST;
-PolkitCafeAuthenticator  *polkit_cafe_authenticator_new        (const gchar              *action_id,
+void                       polkit_cafe_authenticator_new_async  (const gchar              *action_id,
                                                                   const gchar              *message,
                                                                   const gchar              *icon_name,
                                                                   PolkitDetails            *details,
                                                                   const gchar              *cookie,
-                                                                  GList                    *identities);
+                                                                  GList                    *identities,
+                                                                  GCancellable             *cancellable,
+                                                                  GAsyncReadyCallback       callback,
+                                                                  gpointer                  user_data);
+PolkitCafeAuthenticator  *polkit_cafe_authenticator_new_finish (GAsyncResult             *res,
+                                                                  GError                  **error);
 void                       polkit_cafe_authenticator_initiate   (PolkitCafeAuthenticator *authenticator);
+void                       polkit_cafe_authenticator_initiate_from (PolkitCafeAuthenticator *authenticator,
+                                                                     PolkitCafeAuthenticator *leader);
 void                       polkit_cafe_authenticator_cancel     (PolkitCafeAuthenticator *authenticator);
+const gchar               *polkit_cafe_authenticator_get_action_id (PolkitCafeAuthenticator *authenticator);
 const gchar               *polkit_cafe_authenticator_get_cookie (PolkitCafeAuthenticator *authenticator);
+gboolean                   polkit_cafe_authenticator_is_prompting (PolkitCafeAuthenticator *authenticator);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,475 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include <glib/gstdio.h>
+#include <ctk/ctk.h>
+
+#include "polkitcafeavatarcache.h"
+
+/* number of scaled avatars kept in memory */
+#define MAX_ENTRIES 64
+
+/* on-disk thumbnails are the raw pixel data behind a small header so
+ * that loading them does not involve any image decoder. There is one
+ * file per image, size and scale; the header records the modification
+ * time and size of the image it was made from, so a thumbnail of an
+ * older version is replaced rather than joined by a new file. The
+ * header is written in the byte order of the host. A thumbnail written
+ * on a host with the other byte order fails the magic check and is
+ * made again.
+ */
+#define THUMBNAIL_MAGIC 0x32414350 /* "PCA2" */
+#define THUMBNAIL_MAX_SIZE 1024
+
+typedef struct
+{
+  guint32 magic;
+  guint32 width;
+  guint32 height;
+  guint32 rowstride;
+  guint32 has_alpha;
+  gint64 source_mtime;
+  gint64 source_size;
+} ThumbnailHeader;
+
+typedef struct
+{
+  gchar *thumbnail_path;
+  GdkPixbuf *pixbuf;
+  ThumbnailHeader header;
+} SaveData;
+
+typedef struct
+{
+  gchar *key;
+  GdkPixbuf *pixbuf;
+} CacheEntry;
+
+struct _PolkitCafeAvatarCache
+{
+  GObject parent_instance;
+
+  /* key -> GList link in lru; the keys are owned by the entries */
+  GHashTable *entries;
+
+  /* CacheEntry, most recently used first */
+  GQueue lru;
+
+  gboolean use_thumbnails;
+
+  GdkPixbuf *fallback;
+  gint fallback_size;
+};
+
+struct _PolkitCafeAvatarCacheClass
+{
+  GObjectClass parent_class;
+};
+
+G_DEFINE_TYPE (PolkitCafeAvatarCache, polkit_cafe_avatar_cache, G_TYPE_OBJECT);
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_free (entry->key);
+  g_object_unref (entry->pixbuf);
+  g_free (entry);
+}
+
+static void
+on_icon_theme_changed (CtkIconTheme *icon_theme G_GNUC_UNUSED,
+                       gpointer      user_data)
+{
+  PolkitCafeAvatarCache *cache = POLKIT_CAFE_AVATAR_CACHE (user_data);
+
+  if (cache->fallback != NULL)
+    {
+      g_object_unref (cache->fallback);
+      cache->fallback = NULL;
+    }
+}
+
+static void
+polkit_cafe_avatar_cache_init (PolkitCafeAvatarCache *cache)
+{
+  cache->entries = g_hash_table_new (g_str_hash, g_str_equal);
+  g_queue_init (&cache->lru);
+
+  g_signal_connect_object (ctk_icon_theme_get_default (),
+                           "changed",
+                           G_CALLBACK (on_icon_theme_changed),
+                           cache,
+                           0);
+}
+
+static void
+polkit_cafe_avatar_cache_finalize (GObject *object)
+{
+  PolkitCafeAvatarCache *cache;
+
+  cache = POLKIT_CAFE_AVATAR_CACHE (object);
+
+  g_hash_table_unref (cache->entries);
+  g_queue_clear_full (&cache->lru, (GDestroyNotify) cache_entry_free);
+  if (cache->fallback != NULL)
+    g_object_unref (cache->fallback);
+
+  if (G_OBJECT_CLASS (polkit_cafe_avatar_cache_parent_class)->finalize != NULL)
+    G_OBJECT_CLASS (polkit_cafe_avatar_cache_parent_class)->finalize (object);
+}
+
+static void
+polkit_cafe_avatar_cache_class_init (PolkitCafeAvatarCacheClass *klass)
+{
+  GObjectClass *gobject_class;
+
+  gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = polkit_cafe_avatar_cache_finalize;
+}
+
+/**
+ * polkit_cafe_avatar_cache_get_default:
+ *
+ * Gets the process-wide cache of scaled user avatars.
+ *
+ * Returns: A #PolkitCafeAvatarCache. Do not unref.
+ **/
+PolkitCafeAvatarCache *
+polkit_cafe_avatar_cache_get_default (void)
+{
+  static PolkitCafeAvatarCache *default_cache = NULL;
+
+  if (default_cache == NULL)
+    default_cache = POLKIT_CAFE_AVATAR_CACHE (g_object_new (POLKIT_CAFE_TYPE_AVATAR_CACHE, NULL));
+
+  return default_cache;
+}
+
+/**
+ * polkit_cafe_avatar_cache_set_use_thumbnails:
+ * @cache: A #PolkitCafeAvatarCache.
+ * @use_thumbnails: Whether to keep scaled avatars on disk.
+ *
+ * Sets whether scaled avatars are also stored below the user cache
+ * directory so that they survive restarts of the agent. Each image
+ * has one raw, native-endian thumbnail per size and scale, which is
+ * overwritten when the image changes. Thumbnails are written from a
+ * worker thread.
+ **/
+void
+polkit_cafe_avatar_cache_set_use_thumbnails (PolkitCafeAvatarCache *cache,
+                                             gboolean               use_thumbnails)
+{
+  cache->use_thumbnails = use_thumbnails;
+}
+
+/* the name does not depend on the version of the image */
+static gchar *
+get_thumbnail_path (const gchar *path,
+                    gint         size,
+                    gint         scale)
+{
+  gchar *name;
+  gchar *checksum;
+  gchar *basename;
+  gchar *thumbnail_path;
+
+  name = g_strdup_printf ("%s\n%d\n%d", path, size, scale);
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, name, -1);
+  basename = g_strdup_printf ("%s.raw", checksum);
+  thumbnail_path = g_build_filename (g_get_user_cache_dir (), "polkit-cafe", "avatars", basename, NULL);
+  g_free (basename);
+  g_free (checksum);
+  g_free (name);
+
+  return thumbnail_path;
+}
+
+static GdkPixbuf *
+thumbnail_load (const gchar    *thumbnail_path,
+                const GStatBuf *statbuf)
+{
+  ThumbnailHeader header;
+  gchar *contents;
+  gsize length;
+  gsize expected;
+  GBytes *bytes;
+  GBytes *pixels;
+  GdkPixbuf *pixbuf;
+
+  pixbuf = NULL;
+
+  if (!g_file_get_contents (thumbnail_path, &contents, &length, NULL))
+    goto out;
+
+  bytes = g_bytes_new_take (contents, length);
+
+  if (length < sizeof (ThumbnailHeader))
+    goto out_bytes;
+
+  memcpy (&header, contents, sizeof (ThumbnailHeader));
+  if (header.magic != THUMBNAIL_MAGIC ||
+      header.source_mtime != (gint64) statbuf->st_mtime ||
+      header.source_size != (gint64) statbuf->st_size ||
+      header.width == 0 || header.width > THUMBNAIL_MAX_SIZE ||
+      header.height == 0 || header.height > THUMBNAIL_MAX_SIZE ||
+      header.rowstride < header.width * (header.has_alpha ? 4 : 3))
+    goto out_bytes;
+
+  expected = (gsize) (header.height - 1) * header.rowstride + header.width * (header.has_alpha ? 4 : 3);
+  if (length - sizeof (ThumbnailHeader) != expected)
+    goto out_bytes;
+
+  pixels = g_bytes_new_from_bytes (bytes, sizeof (ThumbnailHeader), expected);
+  pixbuf = gdk_pixbuf_new_from_bytes (pixels,
+                                      GDK_COLORSPACE_RGB,
+                                      header.has_alpha,
+                                      8,
+                                      header.width,
+                                      header.height,
+                                      header.rowstride);
+  g_bytes_unref (pixels);
+
+ out_bytes:
+  g_bytes_unref (bytes);
+ out:
+  return pixbuf;
+}
+
+static void
+save_data_free (SaveData *data)
+{
+  g_free (data->thumbnail_path);
+  g_object_unref (data->pixbuf);
+  g_free (data);
+}
+
+static void
+thumbnail_save_thread (GTask        *task G_GNUC_UNUSED,
+                       gpointer      source_object G_GNUC_UNUSED,
+                       gpointer      task_data,
+                       GCancellable *cancellable G_GNUC_UNUSED)
+{
+  SaveData *data = task_data;
+  GByteArray *contents;
+  gchar *dir;
+  GError *error;
+
+  contents = g_byte_array_new ();
+  g_byte_array_append (contents, (const guint8 *) &data->header, sizeof (ThumbnailHeader));
+  g_byte_array_append (contents, gdk_pixbuf_read_pixels (data->pixbuf), gdk_pixbuf_get_byte_length (data->pixbuf));
+
+  dir = g_path_get_dirname (data->thumbnail_path);
+  g_mkdir_with_parents (dir, 0700);
+  g_free (dir);
+
+  /* replaces the thumbnail of an older version atomically */
+  error = NULL;
+  if (!g_file_set_contents (data->thumbnail_path, (const gchar *) contents->data, contents->len, &error))
+    {
+      g_warning ("Error saving avatar thumbnail: %s", error->message);
+      g_error_free (error);
+    }
+
+  g_byte_array_unref (contents);
+}
+
+/* writes the thumbnail from a worker thread; @pixbuf is not modified
+ * once it has been loaded, so it can be read from there */
+static void
+thumbnail_save (PolkitCafeAvatarCache *cache,
+                const gchar           *thumbnail_path,
+                GdkPixbuf             *pixbuf,
+                const GStatBuf        *statbuf)
+{
+  SaveData *data;
+  GTask *task;
+
+  /* gdk_pixbuf_read_pixels() only works for 8-bit RGB(A) data */
+  if (gdk_pixbuf_get_bits_per_sample (pixbuf) != 8 ||
+      gdk_pixbuf_get_colorspace (pixbuf) != GDK_COLORSPACE_RGB)
+    return;
+
+  data = g_new0 (SaveData, 1);
+  data->thumbnail_path = g_strdup (thumbnail_path);
+  data->pixbuf = g_object_ref (pixbuf);
+  /* no uninitialized padding ends up on disk */
+  memset (&data->header, 0, sizeof (ThumbnailHeader));
+  data->header.magic = THUMBNAIL_MAGIC;
+  data->header.width = gdk_pixbuf_get_width (pixbuf);
+  data->header.height = gdk_pixbuf_get_height (pixbuf);
+  data->header.rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  data->header.has_alpha = gdk_pixbuf_get_has_alpha (pixbuf);
+  data->header.source_mtime = statbuf->st_mtime;
+  data->header.source_size = statbuf->st_size;
+
+  task = g_task_new (G_OBJECT (cache), NULL, NULL, NULL);
+  g_task_set_task_data (task, data, (GDestroyNotify) save_data_free);
+  g_task_run_in_thread (task, thumbnail_save_thread);
+  g_object_unref (task);
+}
+
+static void
+cache_insert (PolkitCafeAvatarCache *cache,
+              gchar                 *key,
+              GdkPixbuf             *pixbuf)
+{
+  CacheEntry *entry;
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->key = key;
+  entry->pixbuf = g_object_ref (pixbuf);
+
+  g_queue_push_head (&cache->lru, entry);
+  g_hash_table_insert (cache->entries, entry->key, cache->lru.head);
+
+  while (cache->lru.length > MAX_ENTRIES)
+    {
+      entry = g_queue_pop_tail (&cache->lru);
+      g_hash_table_remove (cache->entries, entry->key);
+      cache_entry_free (entry);
+    }
+}
+
+/**
+ * polkit_cafe_avatar_cache_load:
+ * @cache: A #PolkitCafeAvatarCache.
+ * @path: The image file to load.
+ * @size: The size in logical pixels to scale the image to.
+ * @scale: The scale factor of the output the image is shown on.
+ * @error: Return location for error or %NULL.
+ *
+ * Loads @path scaled to fit into a square of @size times @scale pixels,
+ * preserving the aspect ratio. The image is only decoded if it is not
+ * in the cache or has been modified since it was cached.
+ *
+ * Returns: A #GdkPixbuf (free with g_object_unref()) or %NULL if @error is set.
+ **/
+GdkPixbuf *
+polkit_cafe_avatar_cache_load (PolkitCafeAvatarCache  *cache,
+                               const gchar            *path,
+                               gint                    size,
+                               gint                    scale,
+                               GError                **error)
+{
+  GStatBuf statbuf;
+  GdkPixbuf *pixbuf;
+  GList *link;
+  gchar *key;
+  gchar *thumbnail_path;
+
+  if (g_stat (path, &statbuf) != 0)
+    {
+      int errsv = errno;
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   g_file_error_from_errno (errsv),
+                   "Error statting %s: %s",
+                   path,
+                   g_strerror (errsv));
+      return NULL;
+    }
+
+  key = g_strdup_printf ("%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT "\n%d\n%d",
+                         path,
+                         (gint64) statbuf.st_mtime,
+                         (gint64) statbuf.st_size,
+                         size,
+                         scale);
+
+  link = g_hash_table_lookup (cache->entries, key);
+  if (link != NULL)
+    {
+      g_queue_unlink (&cache->lru, link);
+      g_queue_push_head_link (&cache->lru, link);
+      g_free (key);
+      return g_object_ref (((CacheEntry *) link->data)->pixbuf);
+    }
+
+  thumbnail_path = NULL;
+  pixbuf = NULL;
+
+  if (cache->use_thumbnails)
+    {
+      thumbnail_path = get_thumbnail_path (path, size, scale);
+      pixbuf = thumbnail_load (thumbnail_path, &statbuf);
+    }
+
+  if (pixbuf == NULL)
+    {
+      pixbuf = gdk_pixbuf_new_from_file_at_size (path, size * scale, size * scale, error);
+      if (pixbuf == NULL)
+        {
+          g_free (thumbnail_path);
+          g_free (key);
+          return NULL;
+        }
+
+      if (thumbnail_path != NULL)
+        thumbnail_save (cache, thumbnail_path, pixbuf, &statbuf);
+    }
+  g_free (thumbnail_path);
+
+  /* takes ownership of key */
+  cache_insert (cache, key, pixbuf);
+
+  return pixbuf;
+}
+
+/**
+ * polkit_cafe_avatar_cache_get_fallback:
+ * @cache: A #PolkitCafeAvatarCache.
+ * @size: The size in pixels.
+ *
+ * Gets the icon shown for users without an avatar. The icon is only
+ * loaded from the icon theme again when the theme changes.
+ *
+ * Returns: A #GdkPixbuf (free with g_object_unref()) or %NULL.
+ **/
+GdkPixbuf *
+polkit_cafe_avatar_cache_get_fallback (PolkitCafeAvatarCache *cache,
+                                       gint                   size)
+{
+  if (cache->fallback != NULL && cache->fallback_size != size)
+    {
+      g_object_unref (cache->fallback);
+      cache->fallback = NULL;
+    }
+
+  if (cache->fallback == NULL)
+    {
+      cache->fallback = ctk_icon_theme_load_icon (ctk_icon_theme_get_default (),
+                                                  "stock_person",
+                                                  size,
+                                                  0,
+                                                  NULL);
+      cache->fallback_size = size;
+    }
+
+  return cache->fallback != NULL ? g_object_ref (cache->fallback) : NULL;
+}
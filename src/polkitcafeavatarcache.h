@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __POLKIT_CAFE_AVATAR_CACHE_H
+#define __POLKIT_CAFE_AVATAR_CACHE_H
+
+#include <ctk/ctk.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POLKIT_CAFE_TYPE_AVATAR_CACHE          (polkit_cafe_avatar_cache_get_type())
+#define POLKIT_CAFE_AVATAR_CACHE(o)            (G_TYPE_CHECK_INSTANCE_CAST ((o), POLKIT_CAFE_TYPE_AVATAR_CACHE, PolkitCafeAvatarCache))
+#define POLKIT_CAFE_AVATAR_CACHE_CLASS(k)      (G_TYPE_CHECK_CLASS_CAST((k), POLKIT_CAFE_TYPE_AVATAR_CACHE, PolkitCafeAvatarCacheClass))
+#define POLKIT_CAFE_AVATAR_CACHE_GET_CLASS(o)  (G_TYPE_INSTANCE_GET_CLASS ((o), POLKIT_CAFE_TYPE_AVATAR_CACHE, PolkitCafeAvatarCacheClass))
+#define POLKIT_CAFE_IS_AVATAR_CACHE(o)         (G_TYPE_CHECK_INSTANCE_TYPE ((o), POLKIT_CAFE_TYPE_AVATAR_CACHE))
+#define POLKIT_CAFE_IS_AVATAR_CACHE_CLASS(k)   (G_TYPE_CHECK_CLASS_TYPE ((k), POLKIT_CAFE_TYPE_AVATAR_CACHE))
+
+typedef struct _PolkitCafeAvatarCache PolkitCafeAvatarCache;
+typedef struct _PolkitCafeAvatarCacheClass PolkitCafeAvatarCacheClass;
+
+GType                   polkit_cafe_avatar_cache_get_type             (void) G_GNUC_CONST;
+PolkitCafeAvatarCache  *polkit_cafe_avatar_cache_get_default          (void);
+void                    polkit_cafe_avatar_cache_set_use_thumbnails   (PolkitCafeAvatarCache  *cache,
+                                                                       gboolean                use_thumbnails);
+GdkPixbuf              *polkit_cafe_avatar_cache_load                 (PolkitCafeAvatarCache  *cache,
+                                                                       const gchar            *path,
+                                                                       gint                    size,
+                                                                       gint                    scale,
+                                                                       GError                **error);
+GdkPixbuf              *polkit_cafe_avatar_cache_get_fallback         (PolkitCafeAvatarCache  *cache,
+                                                                       gint                    size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __POLKIT_CAFE_AVATAR_CACHE_H */
@@ -0,0 +1,428 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "config.h"
+
+#include <gio/gio.h>
+
+#include "polkitcafeavatarloader.h"
+
+/* per-call timeout unless configured otherwise; accounts-daemon answers
+ * these from memory so anything slower than this means it is stuck
+ */
+#define DEFAULT_TIMEOUT_MSEC 500
+
+/* how many lookups may be outstanding on the bus at the same time */
+#define MAX_IN_FLIGHT 16
+
+/* after this many lookups in a row that accounts-daemon did not answer,
+ * further lookups fail immediately until the cooldown has passed
+ */
+#define CIRCUIT_FAILURE_THRESHOLD 3
+#define CIRCUIT_COOLDOWN_USEC (30 * G_USEC_PER_SEC)
+
+struct _PolkitCafeAvatarLoader
+{
+  GObject parent_instance;
+
+  gint timeout_msec;
+
+  GDBusConnection *connection;
+  gboolean connecting;
+
+  /* lookups waiting for the connection or for a free slot */
+  GQueue pending;
+  guint in_flight;
+
+  guint consecutive_failures;
+  gint64 circuit_open_until;
+};
+
+struct _PolkitCafeAvatarLoaderClass
+{
+  GObjectClass parent_class;
+};
+
+G_DEFINE_TYPE (PolkitCafeAvatarLoader, polkit_cafe_avatar_loader, G_TYPE_OBJECT);
+
+static void dispatch_pending (PolkitCafeAvatarLoader *loader);
+
+static void
+polkit_cafe_avatar_loader_init (PolkitCafeAvatarLoader *loader)
+{
+  loader->timeout_msec = DEFAULT_TIMEOUT_MSEC;
+  g_queue_init (&loader->pending);
+}
+
+static void
+polkit_cafe_avatar_loader_finalize (GObject *object)
+{
+  PolkitCafeAvatarLoader *loader;
+
+  loader = POLKIT_CAFE_AVATAR_LOADER (object);
+
+  g_queue_clear_full (&loader->pending, g_object_unref);
+  if (loader->connection != NULL)
+    g_object_unref (loader->connection);
+
+  if (G_OBJECT_CLASS (polkit_cafe_avatar_loader_parent_class)->finalize != NULL)
+    G_OBJECT_CLASS (polkit_cafe_avatar_loader_parent_class)->finalize (object);
+}
+
+static void
+polkit_cafe_avatar_loader_class_init (PolkitCafeAvatarLoaderClass *klass)
+{
+  GObjectClass *gobject_class;
+
+  gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = polkit_cafe_avatar_loader_finalize;
+}
+
+/**
+ * polkit_cafe_avatar_loader_get_default:
+ *
+ * Gets the process-wide AccountsService avatar loader.
+ *
+ * Returns: A #PolkitCafeAvatarLoader. Do not unref.
+ **/
+PolkitCafeAvatarLoader *
+polkit_cafe_avatar_loader_get_default (void)
+{
+  static PolkitCafeAvatarLoader *default_loader = NULL;
+
+  if (default_loader == NULL)
+    default_loader = POLKIT_CAFE_AVATAR_LOADER (g_object_new (POLKIT_CAFE_TYPE_AVATAR_LOADER, NULL));
+
+  return default_loader;
+}
+
+/**
+ * polkit_cafe_avatar_loader_set_timeout:
+ * @loader: A #PolkitCafeAvatarLoader.
+ * @timeout_msec: Timeout for each D-Bus call in milliseconds or 0 for the default.
+ *
+ * Sets how long to wait for accounts-daemon before giving up on an avatar.
+ **/
+void
+polkit_cafe_avatar_loader_set_timeout (PolkitCafeAvatarLoader *loader,
+                                       gint                    timeout_msec)
+{
+  loader->timeout_msec = timeout_msec > 0 ? timeout_msec : DEFAULT_TIMEOUT_MSEC;
+}
+
+static gboolean
+circuit_is_open (PolkitCafeAvatarLoader *loader)
+{
+  return loader->circuit_open_until > g_get_monotonic_time ();
+}
+
+static void
+open_circuit (PolkitCafeAvatarLoader *loader)
+{
+  if (!circuit_is_open (loader))
+    g_warning ("accounts-daemon is not answering; using default user icons for %d seconds",
+               (gint) (CIRCUIT_COOLDOWN_USEC / G_USEC_PER_SEC));
+
+  loader->circuit_open_until = g_get_monotonic_time () + CIRCUIT_COOLDOWN_USEC;
+}
+
+/* whether @error means accounts-daemon did not answer at all, as opposed
+ * to answering that there is no such user or icon
+ */
+static gboolean
+is_unavailable_error (const GError *error)
+{
+  return g_error_matches (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT) ||
+         g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CLOSED) ||
+         g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN) ||
+         g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_NAME_HAS_NO_OWNER) ||
+         g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_NO_REPLY) ||
+         g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_TIMEOUT) ||
+         g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_TIMED_OUT);
+}
+
+/* takes ownership of @error and @icon_file */
+static void
+lookup_done (PolkitCafeAvatarLoader *loader,
+             GTask                  *task,
+             GError                 *error,
+             gchar                  *icon_file)
+{
+  loader->in_flight--;
+
+  if (error != NULL)
+    {
+      if (is_unavailable_error (error))
+        {
+          loader->consecutive_failures++;
+          if (loader->consecutive_failures >= CIRCUIT_FAILURE_THRESHOLD)
+            open_circuit (loader);
+        }
+      else if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          loader->consecutive_failures = 0;
+        }
+      g_task_return_error (task, error);
+    }
+  else
+    {
+      loader->consecutive_failures = 0;
+      g_task_return_pointer (task, icon_file, g_free);
+    }
+  g_object_unref (task);
+
+  dispatch_pending (loader);
+}
+
+static void
+get_icon_cb (GObject      *source_object,
+             GAsyncResult *res,
+             gpointer      user_data)
+{
+  GTask *task = G_TASK (user_data);
+  PolkitCafeAvatarLoader *loader = g_task_get_source_object (task);
+  GVariant *result;
+  GVariant *value;
+  gchar *icon_file;
+  GError *error;
+
+  error = NULL;
+  icon_file = NULL;
+  result = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &error);
+  if (result == NULL)
+    goto out;
+
+  g_variant_get (result, "(v)", &value);
+  if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING) &&
+      g_variant_get_string (value, NULL)[0] != '\0')
+    {
+      icon_file = g_variant_dup_string (value, NULL);
+    }
+  else
+    {
+      error = g_error_new (G_IO_ERROR,
+                           G_IO_ERROR_NOT_FOUND,
+                           "No icon set for user %s",
+                           (const gchar *) g_task_get_task_data (task));
+    }
+  g_variant_unref (value);
+  g_variant_unref (result);
+
+ out:
+  lookup_done (loader, task, error, icon_file);
+}
+
+static void
+find_user_cb (GObject      *source_object,
+              GAsyncResult *res,
+              gpointer      user_data)
+{
+  GTask *task = G_TASK (user_data);
+  PolkitCafeAvatarLoader *loader = g_task_get_source_object (task);
+  GVariant *result;
+  const gchar *user_path;
+  GError *error;
+
+  error = NULL;
+  result = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &error);
+  if (result == NULL)
+    {
+      lookup_done (loader, task, error, NULL);
+      return;
+    }
+
+  g_variant_get (result, "(&o)", &user_path);
+
+  g_dbus_connection_call (G_DBUS_CONNECTION (source_object),
+                          "org.freedesktop.Accounts",
+                          user_path,
+                          "org.freedesktop.DBus.Properties",
+                          "Get",
+                          g_variant_new ("(ss)",
+                                         "org.freedesktop.Accounts.User",
+                                         "IconFile"),
+                          G_VARIANT_TYPE ("(v)"),
+                          G_DBUS_CALL_FLAGS_NONE,
+                          loader->timeout_msec,
+                          g_task_get_cancellable (task),
+                          get_icon_cb,
+                          task);
+
+  g_variant_unref (result);
+}
+
+static void
+dispatch_pending (PolkitCafeAvatarLoader *loader)
+{
+  GTask *task;
+
+  if (loader->connection == NULL)
+    return;
+
+  while (loader->in_flight < MAX_IN_FLIGHT &&
+         (task = g_queue_pop_head (&loader->pending)) != NULL)
+    {
+      if (g_task_return_error_if_cancelled (task))
+        {
+          g_object_unref (task);
+          continue;
+        }
+
+      if (circuit_is_open (loader))
+        {
+          g_task_return_new_error (task,
+                                   G_IO_ERROR,
+                                   G_IO_ERROR_FAILED,
+                                   "Not asking accounts-daemon after repeated failures");
+          g_object_unref (task);
+          continue;
+        }
+
+      /* the reference is released in lookup_done() */
+      loader->in_flight++;
+      g_dbus_connection_call (loader->connection,
+                              "org.freedesktop.Accounts",
+                              "/org/freedesktop/Accounts",
+                              "org.freedesktop.Accounts",
+                              "FindUserByName",
+                              g_variant_new ("(s)",
+                                             (const gchar *) g_task_get_task_data (task)),
+                              G_VARIANT_TYPE ("(o)"),
+                              G_DBUS_CALL_FLAGS_NONE,
+                              loader->timeout_msec,
+                              g_task_get_cancellable (task),
+                              find_user_cb,
+                              task);
+    }
+}
+
+static void
+bus_get_cb (GObject      *source_object G_GNUC_UNUSED,
+            GAsyncResult *res,
+            gpointer      user_data)
+{
+  PolkitCafeAvatarLoader *loader = POLKIT_CAFE_AVATAR_LOADER (user_data);
+  GError *error;
+  GTask *task;
+
+  loader->connecting = FALSE;
+
+  error = NULL;
+  loader->connection = g_bus_get_finish (res, &error);
+  if (loader->connection == NULL)
+    {
+      g_warning ("Unable to connect to system bus: %s", error->message);
+      open_circuit (loader);
+
+      while ((task = g_queue_pop_head (&loader->pending)) != NULL)
+        {
+          g_task_return_error (task, g_error_copy (error));
+          g_object_unref (task);
+        }
+      g_error_free (error);
+      goto out;
+    }
+
+  dispatch_pending (loader);
+
+ out:
+  g_object_unref (loader);
+}
+
+/**
+ * polkit_cafe_avatar_loader_lookup:
+ * @loader: A #PolkitCafeAvatarLoader.
+ * @user_name: The user to get the avatar for.
+ * @cancellable: A #GCancellable or %NULL.
+ * @callback: Function to call when the lookup is complete.
+ * @user_data: Data to pass to @callback.
+ *
+ * Asks accounts-daemon for the icon file of @user_name. Lookups for
+ * several users are sent without waiting for each other and every call
+ * is bounded by the timeout set with polkit_cafe_avatar_loader_set_timeout().
+ * If accounts-daemon stops answering, lookups fail right away for a
+ * while instead of each one waiting for the timeout.
+ **/
+void
+polkit_cafe_avatar_loader_lookup (PolkitCafeAvatarLoader *loader,
+                                  const gchar            *user_name,
+                                  GCancellable           *cancellable,
+                                  GAsyncReadyCallback     callback,
+                                  gpointer                user_data)
+{
+  GTask *task;
+
+  task = g_task_new (G_OBJECT (loader), cancellable, callback, user_data);
+  g_task_set_source_tag (task, polkit_cafe_avatar_loader_lookup);
+  g_task_set_task_data (task, g_strdup (user_name), g_free);
+
+  if (circuit_is_open (loader))
+    {
+      g_task_return_new_error (task,
+                               G_IO_ERROR,
+                               G_IO_ERROR_FAILED,
+                               "Not asking accounts-daemon after repeated failures");
+      g_object_unref (task);
+      return;
+    }
+
+  if (loader->connection != NULL && g_dbus_connection_is_closed (loader->connection))
+    {
+      g_object_unref (loader->connection);
+      loader->connection = NULL;
+    }
+
+  g_queue_push_tail (&loader->pending, task);
+
+  if (loader->connection == NULL)
+    {
+      if (!loader->connecting)
+        {
+          loader->connecting = TRUE;
+          g_bus_get (G_BUS_TYPE_SYSTEM, NULL, bus_get_cb, g_object_ref (loader));
+        }
+      return;
+    }
+
+  dispatch_pending (loader);
+}
+
+/**
+ * polkit_cafe_avatar_loader_lookup_finish:
+ * @loader: A #PolkitCafeAvatarLoader.
+ * @res: A #GAsyncResult obtained from the #GAsyncReadyCallback passed to polkit_cafe_avatar_loader_lookup().
+ * @error: Return location for error or %NULL.
+ *
+ * Finishes looking up an avatar.
+ *
+ * Returns: The path of the icon file (free with g_free()) or %NULL if @error is set.
+ **/
+gchar *
+polkit_cafe_avatar_loader_lookup_finish (PolkitCafeAvatarLoader  *loader G_GNUC_UNUSED,
+                                         GAsyncResult            *res,
+                                         GError                 **error)
+{
+  GTask *task = G_TASK (res);
+
+  g_warn_if_fail (g_task_get_source_tag (task) == polkit_cafe_avatar_loader_lookup);
+
+  return g_task_propagate_pointer (task, error);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __POLKIT_CAFE_AVATAR_LOADER_H
+#define __POLKIT_CAFE_AVATAR_LOADER_H
+
+#include <gio/gio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POLKIT_CAFE_TYPE_AVATAR_LOADER          (polkit_cafe_avatar_loader_get_type())
+#define POLKIT_CAFE_AVATAR_LOADER(o)            (G_TYPE_CHECK_INSTANCE_CAST ((o), POLKIT_CAFE_TYPE_AVATAR_LOADER, PolkitCafeAvatarLoader))
+#define POLKIT_CAFE_AVATAR_LOADER_CLASS(k)      (G_TYPE_CHECK_CLASS_CAST((k), POLKIT_CAFE_TYPE_AVATAR_LOADER, PolkitCafeAvatarLoaderClass))
+#define POLKIT_CAFE_AVATAR_LOADER_GET_CLASS(o)  (G_TYPE_INSTANCE_GET_CLASS ((o), POLKIT_CAFE_TYPE_AVATAR_LOADER, PolkitCafeAvatarLoaderClass))
+#define POLKIT_CAFE_IS_AVATAR_LOADER(o)         (G_TYPE_CHECK_INSTANCE_TYPE ((o), POLKIT_CAFE_TYPE_AVATAR_LOADER))
+#define POLKIT_CAFE_IS_AVATAR_LOADER_CLASS(k)   (G_TYPE_CHECK_CLASS_TYPE ((k), POLKIT_CAFE_TYPE_AVATAR_LOADER))
+
+typedef struct _PolkitCafeAvatarLoader PolkitCafeAvatarLoader;
+typedef struct _PolkitCafeAvatarLoaderClass PolkitCafeAvatarLoaderClass;
+
+GType                    polkit_cafe_avatar_loader_get_type         (void) G_GNUC_CONST;
+PolkitCafeAvatarLoader  *polkit_cafe_avatar_loader_get_default      (void);
+void                     polkit_cafe_avatar_loader_set_timeout      (PolkitCafeAvatarLoader  *loader,
+                                                                     gint                     timeout_msec);
+void                     polkit_cafe_avatar_loader_lookup           (PolkitCafeAvatarLoader  *loader,
+                                                                     const gchar             *user_name,
+                                                                     GCancellable            *cancellable,
+                                                                     GAsyncReadyCallback      callback,
+                                                                     gpointer                 user_data);
+gchar                   *polkit_cafe_avatar_loader_lookup_finish    (PolkitCafeAvatarLoader  *loader,
+                                                                     GAsyncResult            *res,
+                                                                     GError                 **error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __POLKIT_CAFE_AVATAR_LOADER_H */
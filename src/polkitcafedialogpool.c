@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "config.h"
+
+#include <ctk/ctk.h>
+#include <polkit/polkit.h>
+
+#include "polkitcafeauthenticationdialog.h"
+#include "polkitcafedialogpool.h"
+
+/* number of idle dialogs to keep around */
+#define POOL_SIZE 2
+
+struct _PolkitCafeDialogPool
+{
+  GObject parent_instance;
+
+  /* hidden, realized dialogs not showing any request */
+  GQueue idle;
+
+  guint prewarm_id;
+
+  /* opens the display for the first dialog, or NULL if it is open */
+  PolkitCafeDialogPoolInitFunc init_func;
+};
+
+struct _PolkitCafeDialogPoolClass
+{
+  GObjectClass parent_class;
+};
+
+G_DEFINE_TYPE (PolkitCafeDialogPool, polkit_cafe_dialog_pool, G_TYPE_OBJECT);
+
+static void
+polkit_cafe_dialog_pool_init (PolkitCafeDialogPool *pool)
+{
+  g_queue_init (&pool->idle);
+}
+
+static void
+polkit_cafe_dialog_pool_finalize (GObject *object)
+{
+  PolkitCafeDialogPool *pool;
+  CtkWidget *dialog;
+
+  pool = POLKIT_CAFE_DIALOG_POOL (object);
+
+  if (pool->prewarm_id != 0)
+    g_source_remove (pool->prewarm_id);
+
+  while ((dialog = g_queue_pop_head (&pool->idle)) != NULL)
+    ctk_widget_destroy (dialog);
+
+  if (G_OBJECT_CLASS (polkit_cafe_dialog_pool_parent_class)->finalize != NULL)
+    G_OBJECT_CLASS (polkit_cafe_dialog_pool_parent_class)->finalize (object);
+}
+
+static void
+polkit_cafe_dialog_pool_class_init (PolkitCafeDialogPoolClass *klass)
+{
+  GObjectClass *gobject_class;
+
+  gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = polkit_cafe_dialog_pool_finalize;
+}
+
+/**
+ * polkit_cafe_dialog_pool_get_default:
+ *
+ * Gets the process-wide pool of authentication dialogs.
+ *
+ * Returns: A #PolkitCafeDialogPool. Do not unref.
+ **/
+PolkitCafeDialogPool *
+polkit_cafe_dialog_pool_get_default (void)
+{
+  static PolkitCafeDialogPool *default_pool = NULL;
+
+  if (default_pool == NULL)
+    default_pool = POLKIT_CAFE_DIALOG_POOL (g_object_new (POLKIT_CAFE_TYPE_DIALOG_POOL, NULL));
+
+  return default_pool;
+}
+
+/**
+ * polkit_cafe_dialog_pool_set_init_func:
+ * @pool: A #PolkitCafeDialogPool.
+ * @init_func: The function initializing the toolkit or %NULL.
+ *
+ * Makes polkit_cafe_dialog_pool_acquire() call @init_func before it
+ * creates or hands out a dialog, for programs that don't initialize
+ * the toolkit at startup. @init_func is the place that does it, so the
+ * program's own bookkeeping stays in one place.
+ **/
+void
+polkit_cafe_dialog_pool_set_init_func (PolkitCafeDialogPool         *pool,
+                                       PolkitCafeDialogPoolInitFunc  init_func)
+{
+  pool->init_func = init_func;
+}
+
+static CtkWidget *
+new_blank_dialog (void)
+{
+  CtkWidget *dialog;
+
+  dialog = polkit_cafe_authentication_dialog_new (NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+  /* the pool owns the toplevel until it hands it out */
+  g_object_ref_sink (dialog);
+
+  return dialog;
+}
+
+static gboolean
+prewarm_cb (gpointer user_data)
+{
+  PolkitCafeDialogPool *pool = POLKIT_CAFE_DIALOG_POOL (user_data);
+
+  pool->prewarm_id = 0;
+
+  if (g_queue_is_empty (&pool->idle))
+    g_queue_push_tail (&pool->idle, new_blank_dialog ());
+
+  return FALSE;
+}
+
+/**
+ * polkit_cafe_dialog_pool_prewarm:
+ * @pool: A #PolkitCafeDialogPool.
+ *
+ * Builds and realizes a dialog once the main loop is idle so the first
+ * authentication request does not have to pay for creating the widgets.
+ **/
+void
+polkit_cafe_dialog_pool_prewarm (PolkitCafeDialogPool *pool)
+{
+  if (pool->prewarm_id != 0 || !g_queue_is_empty (&pool->idle))
+    return;
+
+  pool->prewarm_id = g_idle_add_full (G_PRIORITY_LOW, prewarm_cb, pool, NULL);
+}
+
+/**
+ * polkit_cafe_dialog_pool_acquire:
+ * @pool: A #PolkitCafeDialogPool.
+ * @action_id: The action the request is for.
+ * @vendor: The vendor of the action.
+ * @vendor_url: The vendor URL of the action.
+ * @icon_name: The icon name of the action or %NULL.
+ * @message_markup: The message to show.
+ * @details: A #PolkitDetails or %NULL.
+ * @users: The users that can authenticate.
+ *
+ * Gets a dialog for a request, reusing an idle one from @pool if
+ * possible. See polkit_cafe_authentication_dialog_new() for the
+ * parameters. The toolkit is initialized first if that has not
+ * happened yet, see polkit_cafe_dialog_pool_set_init_func().
+ *
+ * Returns: A #PolkitCafeAuthenticationDialog or %NULL if the display
+ * cannot be opened. Hand it back with polkit_cafe_dialog_pool_release()
+ * instead of destroying it.
+ **/
+CtkWidget *
+polkit_cafe_dialog_pool_acquire (PolkitCafeDialogPool  *pool,
+                                 const gchar           *action_id,
+                                 const gchar           *vendor,
+                                 const gchar           *vendor_url,
+                                 const gchar           *icon_name,
+                                 const gchar           *message_markup,
+                                 PolkitDetails         *details,
+                                 gchar                **users)
+{
+  CtkWidget *dialog;
+
+  /* the agent may have been started without opening the display */
+  if (pool->init_func != NULL && !pool->init_func ())
+    return NULL;
+
+  dialog = g_queue_pop_head (&pool->idle);
+  if (dialog == NULL)
+    {
+      g_debug ("No pooled dialog available, creating a new one");
+      dialog = new_blank_dialog ();
+    }
+
+  polkit_cafe_authentication_dialog_reset (POLKIT_CAFE_AUTHENTICATION_DIALOG (dialog),
+                                            action_id,
+                                            vendor,
+                                            vendor_url,
+                                            icon_name,
+                                            message_markup,
+                                            details,
+                                            users);
+
+  /* keep one dialog ready for the next request */
+  polkit_cafe_dialog_pool_prewarm (pool);
+
+  return dialog;
+}
+
+/**
+ * polkit_cafe_dialog_pool_release:
+ * @pool: A #PolkitCafeDialogPool.
+ * @dialog: A dialog obtained from polkit_cafe_dialog_pool_acquire().
+ *
+ * Hides @dialog and keeps it for a later request, or destroys it if
+ * @pool is full. The caller must have disconnected its signal handlers.
+ **/
+void
+polkit_cafe_dialog_pool_release (PolkitCafeDialogPool *pool,
+                                 CtkWidget            *dialog)
+{
+  ctk_widget_hide (dialog);
+
+  if (g_queue_get_length (&pool->idle) >= POOL_SIZE)
+    {
+      ctk_widget_destroy (dialog);
+      g_object_unref (dialog);
+      return;
+    }
+
+  /* drop everything that belongs to the finished request */
+  polkit_cafe_authentication_dialog_reset (POLKIT_CAFE_AUTHENTICATION_DIALOG (dialog),
+                                            NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+
+  g_queue_push_tail (&pool->idle, dialog);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __POLKIT_CAFE_DIALOG_POOL_H
+#define __POLKIT_CAFE_DIALOG_POOL_H
+
+#include <ctk/ctk.h>
+#include <polkit/polkit.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POLKIT_CAFE_TYPE_DIALOG_POOL          (polkit_cafe_dialog_pool_get_type())
+#define POLKIT_CAFE_DIALOG_POOL(o)            (G_TYPE_CHECK_INSTANCE_CAST ((o), POLKIT_CAFE_TYPE_DIALOG_POOL, PolkitCafeDialogPool))
+#define POLKIT_CAFE_DIALOG_POOL_CLASS(k)      (G_TYPE_CHECK_CLASS_CAST((k), POLKIT_CAFE_TYPE_DIALOG_POOL, PolkitCafeDialogPoolClass))
+#define POLKIT_CAFE_DIALOG_POOL_GET_CLASS(o)  (G_TYPE_INSTANCE_GET_CLASS ((o), POLKIT_CAFE_TYPE_DIALOG_POOL, PolkitCafeDialogPoolClass))
+#define POLKIT_CAFE_IS_DIALOG_POOL(o)         (G_TYPE_CHECK_INSTANCE_TYPE ((o), POLKIT_CAFE_TYPE_DIALOG_POOL))
+#define POLKIT_CAFE_IS_DIALOG_POOL_CLASS(k)   (G_TYPE_CHECK_CLASS_TYPE ((k), POLKIT_CAFE_TYPE_DIALOG_POOL))
+
+typedef struct _PolkitCafeDialogPool PolkitCafeDialogPool;
+typedef struct _PolkitCafeDialogPoolClass PolkitCafeDialogPoolClass;
+
+/**
+ * PolkitCafeDialogPoolInitFunc:
+ *
+ * Initializes the toolkit if that has not happened yet.
+ *
+ * Returns: %TRUE if the toolkit can be used.
+ */
+typedef gboolean (*PolkitCafeDialogPoolInitFunc) (void);
+
+GType                  polkit_cafe_dialog_pool_get_type     (void) G_GNUC_CONST;
+PolkitCafeDialogPool  *polkit_cafe_dialog_pool_get_default  (void);
+void                   polkit_cafe_dialog_pool_set_init_func (PolkitCafeDialogPool         *pool,
+                                                              PolkitCafeDialogPoolInitFunc  init_func);
+void                   polkit_cafe_dialog_pool_prewarm      (PolkitCafeDialogPool  *pool);
+CtkWidget             *polkit_cafe_dialog_pool_acquire      (PolkitCafeDialogPool  *pool,
+                                                             const gchar           *action_id,
+                                                             const gchar           *vendor,
+                                                             const gchar           *vendor_url,
+                                                             const gchar           *icon_name,
+                                                             const gchar           *message_markup,
+                                                             PolkitDetails         *details,
+                                                             gchar                **users);
+void                   polkit_cafe_dialog_pool_release      (PolkitCafeDialogPool  *pool,
+                                                             CtkWidget             *dialog);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __POLKIT_CAFE_DIALOG_POOL_H */
@@ -0,0 +1,642 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <pwd.h>
+
+#include <polkit/polkit.h>
+
+#include "polkitcafeidentityresolver.h"
+
+/* how long a resolved entry is trusted before NSS is asked again */
+#define RECORD_TTL_USEC (300 * G_USEC_PER_SEC)
+
+/* a batch is split across up to MAX_WORKERS threads, each taking at
+ * least MIN_CHUNK_SIZE users */
+#define MAX_WORKERS 4
+#define MIN_CHUNK_SIZE 16
+
+struct _PolkitCafeIdentityResolver
+{
+  GObject parent_instance;
+
+  /* protects the tables below; they are filled from worker threads */
+  GMutex lock;
+
+  /* uid -> PolkitCafeUserRecord */
+  GHashTable *by_uid;
+
+  /* name -> PolkitCafeUserRecord; the keys are owned by the values */
+  GHashTable *by_name;
+
+  /* updated atomically, from worker threads too */
+  gint hits;
+  gint lookups;
+};
+
+struct _PolkitCafeIdentityResolverClass
+{
+  GObjectClass parent_class;
+};
+
+G_DEFINE_TYPE (PolkitCafeIdentityResolver, polkit_cafe_identity_resolver, G_TYPE_OBJECT);
+
+PolkitCafeUserRecord *
+polkit_cafe_user_record_ref (PolkitCafeUserRecord *record)
+{
+  g_atomic_int_inc (&record->ref_count);
+  return record;
+}
+
+void
+polkit_cafe_user_record_unref (PolkitCafeUserRecord *record)
+{
+  if (!g_atomic_int_dec_and_test (&record->ref_count))
+    return;
+
+  g_free (record->name);
+  g_free (record->real_name);
+  g_free (record->home_dir);
+  g_free (record);
+}
+
+static PolkitCafeUserRecord *
+user_record_new (const struct passwd *passwd)
+{
+  PolkitCafeUserRecord *record;
+
+  record = g_new0 (PolkitCafeUserRecord, 1);
+  record->ref_count = 1;
+  record->resolved_at = g_get_monotonic_time ();
+  record->uid = passwd->pw_uid;
+  record->name = g_strdup (passwd->pw_name);
+  record->home_dir = g_strdup (passwd->pw_dir);
+
+  if (passwd->pw_gecos != NULL)
+    {
+      gchar *gecos;
+
+      gecos = g_locale_to_utf8 (passwd->pw_gecos, -1, NULL, NULL, NULL);
+      if (gecos != NULL)
+        {
+          gchar *first_comma;
+
+          first_comma = strchr (gecos, ',');
+          if (first_comma != NULL)
+            *first_comma = '\0';
+        }
+
+      if (gecos != NULL && strlen (gecos) > 0)
+        record->real_name = gecos;
+      else
+        g_free (gecos);
+    }
+
+  return record;
+}
+
+/* Looks up @name, or @uid if @name is %NULL, in the user database.
+ * This may block for a long time with network backed NSS modules.
+ */
+static PolkitCafeUserRecord *
+resolve_user (const gchar *name,
+              uid_t        uid)
+{
+  PolkitCafeUserRecord *record;
+  struct passwd pwd;
+  struct passwd *passwd;
+  gchar *buf;
+  glong bufsize;
+  int rc;
+
+  bufsize = sysconf (_SC_GETPW_R_SIZE_MAX);
+  if (bufsize <= 0)
+    bufsize = 16384;
+  buf = g_malloc (bufsize);
+
+  for (;;)
+    {
+      passwd = NULL;
+      if (name != NULL)
+        rc = getpwnam_r (name, &pwd, buf, bufsize, &passwd);
+      else
+        rc = getpwuid_r (uid, &pwd, buf, bufsize, &passwd);
+      if (rc != ERANGE)
+        break;
+      bufsize *= 2;
+      buf = g_realloc (buf, bufsize);
+    }
+
+  if (passwd == NULL)
+    {
+      if (name != NULL)
+        g_warning ("Error doing getpwnam(\"%s\"): %s", name, rc != 0 ? g_strerror (rc) : "No such user");
+      else
+        g_warning ("Error doing getpwuid(%d): %s", (gint) uid, rc != 0 ? g_strerror (rc) : "No such user");
+      record = NULL;
+    }
+  else
+    {
+      record = user_record_new (passwd);
+    }
+
+  g_free (buf);
+
+  return record;
+}
+
+static gboolean
+record_is_fresh (PolkitCafeUserRecord *record)
+{
+  return g_get_monotonic_time () - record->resolved_at < RECORD_TTL_USEC;
+}
+
+static PolkitCafeUserRecord *
+lookup_uid_locked (PolkitCafeIdentityResolver *resolver,
+                   uid_t                       uid)
+{
+  PolkitCafeUserRecord *record;
+
+  record = g_hash_table_lookup (resolver->by_uid, GUINT_TO_POINTER (uid));
+  if (record == NULL || !record_is_fresh (record))
+    return NULL;
+
+  return polkit_cafe_user_record_ref (record);
+}
+
+static void
+insert_locked (PolkitCafeIdentityResolver *resolver,
+               PolkitCafeUserRecord       *record)
+{
+  PolkitCafeUserRecord *old;
+
+  /* drop the name index entry of a previous record for this uid, the
+   * user may have been renamed
+   */
+  old = g_hash_table_lookup (resolver->by_uid, GUINT_TO_POINTER (record->uid));
+  if (old != NULL && g_hash_table_lookup (resolver->by_name, old->name) == old)
+    g_hash_table_remove (resolver->by_name, old->name);
+
+  g_hash_table_replace (resolver->by_uid,
+                        GUINT_TO_POINTER (record->uid),
+                        polkit_cafe_user_record_ref (record));
+  /* replace, not insert, so the key is switched to the new record */
+  g_hash_table_replace (resolver->by_name,
+                        record->name,
+                        polkit_cafe_user_record_ref (record));
+}
+
+static void
+polkit_cafe_identity_resolver_init (PolkitCafeIdentityResolver *resolver)
+{
+  g_mutex_init (&resolver->lock);
+  resolver->by_uid = g_hash_table_new_full (g_direct_hash,
+                                            g_direct_equal,
+                                            NULL,
+                                            (GDestroyNotify) polkit_cafe_user_record_unref);
+  resolver->by_name = g_hash_table_new_full (g_str_hash,
+                                             g_str_equal,
+                                             NULL,
+                                             (GDestroyNotify) polkit_cafe_user_record_unref);
+}
+
+static void
+polkit_cafe_identity_resolver_finalize (GObject *object)
+{
+  PolkitCafeIdentityResolver *resolver;
+
+  resolver = POLKIT_CAFE_IDENTITY_RESOLVER (object);
+
+  g_hash_table_unref (resolver->by_name);
+  g_hash_table_unref (resolver->by_uid);
+  g_mutex_clear (&resolver->lock);
+
+  if (G_OBJECT_CLASS (polkit_cafe_identity_resolver_parent_class)->finalize != NULL)
+    G_OBJECT_CLASS (polkit_cafe_identity_resolver_parent_class)->finalize (object);
+}
+
+static void
+polkit_cafe_identity_resolver_class_init (PolkitCafeIdentityResolverClass *klass)
+{
+  GObjectClass *gobject_class;
+
+  gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = polkit_cafe_identity_resolver_finalize;
+}
+
+/**
+ * polkit_cafe_identity_resolver_get_default:
+ *
+ * Gets the process-wide identity resolver.
+ *
+ * Returns: A #PolkitCafeIdentityResolver. Do not unref.
+ **/
+PolkitCafeIdentityResolver *
+polkit_cafe_identity_resolver_get_default (void)
+{
+  static PolkitCafeIdentityResolver *default_resolver = NULL;
+
+  if (default_resolver == NULL)
+    default_resolver = POLKIT_CAFE_IDENTITY_RESOLVER (g_object_new (POLKIT_CAFE_TYPE_IDENTITY_RESOLVER, NULL));
+
+  return default_resolver;
+}
+
+/* Returns the fresh cache entries for @uids in order. Unless
+ * @skip_missing is set, %NULL is returned if any of them is missing.
+ */
+static GPtrArray *
+lookup_cached (PolkitCafeIdentityResolver *resolver,
+               GArray                     *uids,
+               gboolean                    skip_missing)
+{
+  GPtrArray *records;
+  guint n;
+
+  records = g_ptr_array_new_with_free_func ((GDestroyNotify) polkit_cafe_user_record_unref);
+
+  g_mutex_lock (&resolver->lock);
+  for (n = 0; n < uids->len; n++)
+    {
+      PolkitCafeUserRecord *record;
+
+      record = lookup_uid_locked (resolver, g_array_index (uids, uid_t, n));
+      if (record != NULL)
+        {
+          g_ptr_array_add (records, record);
+        }
+      else if (!skip_missing)
+        {
+          g_ptr_array_unref (records);
+          records = NULL;
+          break;
+        }
+    }
+  g_mutex_unlock (&resolver->lock);
+
+  return records;
+}
+
+/* resolves a slice of a batch into the cache */
+static void
+resolve_chunk_thread (GTask        *task,
+                      gpointer      source_object,
+                      gpointer      task_data,
+                      GCancellable *cancellable)
+{
+  PolkitCafeIdentityResolver *resolver = POLKIT_CAFE_IDENTITY_RESOLVER (source_object);
+  GArray *uids = task_data;
+  guint n;
+
+  for (n = 0; n < uids->len; n++)
+    {
+      uid_t uid = g_array_index (uids, uid_t, n);
+      PolkitCafeUserRecord *record;
+
+      if (g_cancellable_is_cancelled (cancellable))
+        break;
+
+      g_mutex_lock (&resolver->lock);
+      record = lookup_uid_locked (resolver, uid);
+      g_mutex_unlock (&resolver->lock);
+
+      if (record != NULL)
+        {
+          g_atomic_int_inc (&resolver->hits);
+          polkit_cafe_user_record_unref (record);
+          continue;
+        }
+
+      g_atomic_int_inc (&resolver->lookups);
+      record = resolve_user (NULL, uid);
+      if (record == NULL)
+        continue;
+
+      g_mutex_lock (&resolver->lock);
+      insert_locked (resolver, record);
+      g_mutex_unlock (&resolver->lock);
+      polkit_cafe_user_record_unref (record);
+    }
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  g_task_return_boolean (task, TRUE);
+}
+
+typedef struct
+{
+  GArray *uids;
+  guint pending;
+  GError *error;
+} BatchData;
+
+static void
+batch_data_free (BatchData *data)
+{
+  g_array_unref (data->uids);
+  if (data->error != NULL)
+    g_error_free (data->error);
+  g_free (data);
+}
+
+static void
+chunk_done_cb (GObject      *source_object,
+               GAsyncResult *res,
+               gpointer      user_data)
+{
+  PolkitCafeIdentityResolver *resolver = POLKIT_CAFE_IDENTITY_RESOLVER (source_object);
+  GTask *task = G_TASK (user_data);
+  BatchData *data = g_task_get_task_data (task);
+  GError *error;
+
+  error = NULL;
+  if (!g_task_propagate_boolean (G_TASK (res), &error))
+    {
+      if (data->error == NULL)
+        data->error = error;
+      else
+        g_error_free (error);
+    }
+
+  data->pending--;
+  if (data->pending > 0)
+    goto out;
+
+  if (data->error != NULL)
+    {
+      g_task_return_error (task, data->error);
+      data->error = NULL;
+      goto out;
+    }
+
+  /* everything the chunks found is in the cache now */
+  g_task_return_pointer (task,
+                         lookup_cached (resolver, data->uids, TRUE),
+                         (GDestroyNotify) g_ptr_array_unref);
+
+ out:
+  g_object_unref (task);
+}
+
+/**
+ * polkit_cafe_identity_resolver_resolve:
+ * @resolver: A #PolkitCafeIdentityResolver.
+ * @identities: A list of #PolkitIdentity objects.
+ * @cancellable: A #GCancellable or %NULL.
+ * @callback: Function to call when all identities have been resolved.
+ * @user_data: Data to pass to @callback.
+ *
+ * Resolves all the Unix users in @identities as one batch. If every one
+ * of them is in the cache the result is delivered without touching NSS,
+ * otherwise the batch is split across a few worker threads that look
+ * up the missing entries.
+ **/
+void
+polkit_cafe_identity_resolver_resolve (PolkitCafeIdentityResolver *resolver,
+                                       GList                      *identities,
+                                       GCancellable               *cancellable,
+                                       GAsyncReadyCallback         callback,
+                                       gpointer                    user_data)
+{
+  GTask *task;
+  GArray *uids;
+  GPtrArray *records;
+  BatchData *data;
+  guint num_chunks;
+  guint chunk_size;
+  guint n;
+  GList *l;
+
+  task = g_task_new (G_OBJECT (resolver), cancellable, callback, user_data);
+  g_task_set_source_tag (task, polkit_cafe_identity_resolver_resolve);
+
+  uids = g_array_new (FALSE, FALSE, sizeof (uid_t));
+  for (l = identities; l != NULL; l = l->next)
+    {
+      uid_t uid;
+
+      if (!POLKIT_IS_UNIX_USER (l->data))
+        continue;
+
+      uid = polkit_unix_user_get_uid (POLKIT_UNIX_USER (l->data));
+      g_array_append_val (uids, uid);
+    }
+
+  records = lookup_cached (resolver, uids, FALSE);
+  if (records != NULL)
+    {
+      g_atomic_int_add (&resolver->hits, records->len);
+      g_task_return_pointer (task, records, (GDestroyNotify) g_ptr_array_unref);
+      g_array_unref (uids);
+      goto out;
+    }
+
+  num_chunks = CLAMP ((uids->len + MIN_CHUNK_SIZE - 1) / MIN_CHUNK_SIZE, 1, MAX_WORKERS);
+  chunk_size = (uids->len + num_chunks - 1) / num_chunks;
+
+  data = g_new0 (BatchData, 1);
+  data->uids = uids;
+  data->pending = num_chunks;
+  g_task_set_task_data (task, data, (GDestroyNotify) batch_data_free);
+
+  for (n = 0; n < num_chunks; n++)
+    {
+      GTask *chunk_task;
+      GArray *chunk;
+      guint start;
+
+      start = n * chunk_size;
+      chunk = g_array_new (FALSE, FALSE, sizeof (uid_t));
+      g_array_append_vals (chunk, &g_array_index (uids, uid_t, start), MIN (chunk_size, uids->len - start));
+
+      chunk_task = g_task_new (G_OBJECT (resolver), cancellable, chunk_done_cb, g_object_ref (task));
+      g_task_set_task_data (chunk_task, chunk, (GDestroyNotify) g_array_unref);
+      /* don't keep the caller waiting for a slow NSS backend; the
+       * threads notice the cancellation before their next lookup */
+      g_task_set_return_on_cancel (chunk_task, TRUE);
+      g_task_run_in_thread (chunk_task, resolve_chunk_thread);
+      g_object_unref (chunk_task);
+    }
+
+ out:
+  g_object_unref (task);
+}
+
+/**
+ * polkit_cafe_identity_resolver_resolve_finish:
+ * @resolver: A #PolkitCafeIdentityResolver.
+ * @res: A #GAsyncResult obtained from the #GAsyncReadyCallback passed to polkit_cafe_identity_resolver_resolve().
+ * @error: Return location for error or %NULL.
+ *
+ * Finishes resolving identities. Users that do not exist in the user
+ * database are left out.
+ *
+ * Returns: An array of #PolkitCafeUserRecord (free with g_ptr_array_unref()) or %NULL if @error is set.
+ **/
+GPtrArray *
+polkit_cafe_identity_resolver_resolve_finish (PolkitCafeIdentityResolver  *resolver G_GNUC_UNUSED,
+                                              GAsyncResult                *res,
+                                              GError                     **error)
+{
+  GTask *task = G_TASK (res);
+
+  g_warn_if_fail (g_task_get_source_tag (task) == polkit_cafe_identity_resolver_resolve);
+
+  return g_task_propagate_pointer (task, error);
+}
+
+/**
+ * polkit_cafe_identity_resolver_lookup_by_name:
+ * @resolver: A #PolkitCafeIdentityResolver.
+ * @name: A login name.
+ *
+ * Looks up @name in the cache, which normally already holds every
+ * user of a request that went through polkit_cafe_identity_resolver_resolve().
+ * This never blocks; on a miss use
+ * polkit_cafe_identity_resolver_resolve_name().
+ *
+ * Returns: A #PolkitCafeUserRecord (free with polkit_cafe_user_record_unref()) or %NULL if @name is not cached.
+ **/
+PolkitCafeUserRecord *
+polkit_cafe_identity_resolver_lookup_by_name (PolkitCafeIdentityResolver *resolver,
+                                              const gchar                *name)
+{
+  PolkitCafeUserRecord *record;
+
+  g_mutex_lock (&resolver->lock);
+  record = g_hash_table_lookup (resolver->by_name, name);
+  if (record != NULL && record_is_fresh (record))
+    record = polkit_cafe_user_record_ref (record);
+  else
+    record = NULL;
+  g_mutex_unlock (&resolver->lock);
+
+  if (record != NULL)
+    g_atomic_int_inc (&resolver->hits);
+
+  return record;
+}
+
+static void
+resolve_name_thread (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable G_GNUC_UNUSED)
+{
+  PolkitCafeIdentityResolver *resolver = POLKIT_CAFE_IDENTITY_RESOLVER (source_object);
+  const gchar *name = task_data;
+  PolkitCafeUserRecord *record;
+
+  g_atomic_int_inc (&resolver->lookups);
+  record = resolve_user (name, 0);
+  if (record == NULL)
+    {
+      g_task_return_new_error (task,
+                               G_IO_ERROR,
+                               G_IO_ERROR_NOT_FOUND,
+                               "No such user %s",
+                               name);
+      return;
+    }
+
+  g_mutex_lock (&resolver->lock);
+  insert_locked (resolver, record);
+  g_mutex_unlock (&resolver->lock);
+
+  g_task_return_pointer (task, record, (GDestroyNotify) polkit_cafe_user_record_unref);
+}
+
+/**
+ * polkit_cafe_identity_resolver_resolve_name:
+ * @resolver: A #PolkitCafeIdentityResolver.
+ * @name: A login name.
+ * @cancellable: A #GCancellable or %NULL.
+ * @callback: Function to call when @name has been resolved.
+ * @user_data: Data to pass to @callback.
+ *
+ * Resolves @name on a worker thread and caches the result, for users
+ * that polkit_cafe_identity_resolver_lookup_by_name() does not know.
+ **/
+void
+polkit_cafe_identity_resolver_resolve_name (PolkitCafeIdentityResolver *resolver,
+                                            const gchar                *name,
+                                            GCancellable               *cancellable,
+                                            GAsyncReadyCallback         callback,
+                                            gpointer                    user_data)
+{
+  GTask *task;
+
+  task = g_task_new (G_OBJECT (resolver), cancellable, callback, user_data);
+  g_task_set_source_tag (task, polkit_cafe_identity_resolver_resolve_name);
+  g_task_set_task_data (task, g_strdup (name), g_free);
+  g_task_set_return_on_cancel (task, TRUE);
+  g_task_run_in_thread (task, resolve_name_thread);
+  g_object_unref (task);
+}
+
+/**
+ * polkit_cafe_identity_resolver_resolve_name_finish:
+ * @resolver: A #PolkitCafeIdentityResolver.
+ * @res: A #GAsyncResult obtained from the #GAsyncReadyCallback passed to polkit_cafe_identity_resolver_resolve_name().
+ * @error: Return location for error or %NULL.
+ *
+ * Finishes resolving a login name. If there is no such user, @error is
+ * set to %G_IO_ERROR_NOT_FOUND.
+ *
+ * Returns: A #PolkitCafeUserRecord (free with polkit_cafe_user_record_unref()) or %NULL if @error is set.
+ **/
+PolkitCafeUserRecord *
+polkit_cafe_identity_resolver_resolve_name_finish (PolkitCafeIdentityResolver  *resolver G_GNUC_UNUSED,
+                                                   GAsyncResult                *res,
+                                                   GError                     **error)
+{
+  GTask *task = G_TASK (res);
+
+  g_warn_if_fail (g_task_get_source_tag (task) == polkit_cafe_identity_resolver_resolve_name);
+
+  return g_task_propagate_pointer (task, error);
+}
+
+/**
+ * polkit_cafe_identity_resolver_get_stats:
+ * @resolver: A #PolkitCafeIdentityResolver.
+ * @out_hits: Return location for the number of users served from the cache or %NULL.
+ * @out_lookups: Return location for the number of users looked up in the user database or %NULL.
+ *
+ * Gets the counters of @resolver. Lookups still running on a worker
+ * thread are included as soon as they start.
+ **/
+void
+polkit_cafe_identity_resolver_get_stats (PolkitCafeIdentityResolver *resolver,
+                                         guint                      *out_hits,
+                                         guint                      *out_lookups)
+{
+  if (out_hits != NULL)
+    *out_hits = g_atomic_int_get (&resolver->hits);
+  if (out_lookups != NULL)
+    *out_lookups = g_atomic_int_get (&resolver->lookups);
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __POLKIT_CAFE_IDENTITY_RESOLVER_H
+#define __POLKIT_CAFE_IDENTITY_RESOLVER_H
+
+#include <sys/types.h>
+#include <polkit/polkit.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POLKIT_CAFE_TYPE_IDENTITY_RESOLVER          (polkit_cafe_identity_resolver_get_type())
+#define POLKIT_CAFE_IDENTITY_RESOLVER(o)            (G_TYPE_CHECK_INSTANCE_CAST ((o), POLKIT_CAFE_TYPE_IDENTITY_RESOLVER, PolkitCafeIdentityResolver))
+#define POLKIT_CAFE_IDENTITY_RESOLVER_CLASS(k)      (G_TYPE_CHECK_CLASS_CAST((k), POLKIT_CAFE_TYPE_IDENTITY_RESOLVER, PolkitCafeIdentityResolverClass))
+#define POLKIT_CAFE_IDENTITY_RESOLVER_GET_CLASS(o)  (G_TYPE_INSTANCE_GET_CLASS ((o), POLKIT_CAFE_TYPE_IDENTITY_RESOLVER, PolkitCafeIdentityResolverClass))
+#define POLKIT_CAFE_IS_IDENTITY_RESOLVER(o)         (G_TYPE_CHECK_INSTANCE_TYPE ((o), POLKIT_CAFE_TYPE_IDENTITY_RESOLVER))
+#define POLKIT_CAFE_IS_IDENTITY_RESOLVER_CLASS(k)   (G_TYPE_CHECK_CLASS_TYPE ((k), POLKIT_CAFE_TYPE_IDENTITY_RESOLVER))
+
+typedef struct _PolkitCafeIdentityResolver PolkitCafeIdentityResolver;
+typedef struct _PolkitCafeIdentityResolverClass PolkitCafeIdentityResolverClass;
+
+/**
+ * PolkitCafeUserRecord:
+ * @uid: The user id.
+ * @name: The login name.
+ * @real_name: The first GECOS field converted to UTF-8 or %NULL.
+ * @home_dir: The home directory or %NULL.
+ *
+ * An immutable, reference counted user database entry.
+ */
+typedef struct
+{
+  /*< private >*/
+  gint ref_count;
+  gint64 resolved_at;
+
+  /*< public >*/
+  uid_t uid;
+  gchar *name;
+  gchar *real_name;
+  gchar *home_dir;
+} PolkitCafeUserRecord;
+
+PolkitCafeUserRecord        *polkit_cafe_user_record_ref                       (PolkitCafeUserRecord        *record);
+void                         polkit_cafe_user_record_unref                     (PolkitCafeUserRecord        *record);
+
+GType                        polkit_cafe_identity_resolver_get_type            (void) G_GNUC_CONST;
+PolkitCafeIdentityResolver  *polkit_cafe_identity_resolver_get_default         (void);
+void                         polkit_cafe_identity_resolver_resolve             (PolkitCafeIdentityResolver  *resolver,
+                                                                                GList                       *identities,
+                                                                                GCancellable                *cancellable,
+                                                                                GAsyncReadyCallback          callback,
+                                                                                gpointer                     user_data);
+GPtrArray                   *polkit_cafe_identity_resolver_resolve_finish      (PolkitCafeIdentityResolver  *resolver,
+                                                                                GAsyncResult                *res,
+                                                                                GError                     **error);
+PolkitCafeUserRecord        *polkit_cafe_identity_resolver_lookup_by_name      (PolkitCafeIdentityResolver  *resolver,
+                                                                                const gchar                 *name);
+void                         polkit_cafe_identity_resolver_resolve_name        (PolkitCafeIdentityResolver  *resolver,
+                                                                                const gchar                 *name,
+                                                                                GCancellable                *cancellable,
+                                                                                GAsyncReadyCallback          callback,
+                                                                                gpointer                     user_data);
+PolkitCafeUserRecord        *polkit_cafe_identity_resolver_resolve_name_finish (PolkitCafeIdentityResolver  *resolver,
+                                                                                GAsyncResult                *res,
+                                                                                GError                     **error);
+void                         polkit_cafe_identity_resolver_get_stats           (PolkitCafeIdentityResolver  *resolver,
+                                                                                guint                       *out_hits,
+                                                                                guint                       *out_lookups);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __POLKIT_CAFE_IDENTITY_RESOLVER_H */
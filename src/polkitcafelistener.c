@@ -22,20 +22,114 @@
 
 #include "config.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <glib/gi18n.h>
 
 #include "polkitcafelistener.h"
 #include "polkitcafeauthenticator.h"
 
+/* how many authentications may show a dialog at the same time unless
+ * configured otherwise; one at a time, as before queueing was added
+ */
+#define DEFAULT_MAX_CONCURRENT 1
+
+/* Queued requests are grouped by caller and callers are served
+ * round-robin. A caller's own requests are served in order of a virtual
+ * queueing time: a request for an action with priority N counts as if it
+ * had been queued N * PRIORITY_STEP_USEC earlier. Since the real
+ * queueing time is part of the key, low priority requests still get
+ * their turn.
+ */
+#define PRIORITY_STEP_USEC (10 * G_USEC_PER_SEC)
+
+/* If throttling is enabled, each caller may open up to caller_burst
+ * dialogs at once and one more every CALLER_REFILL_USEC; requests beyond
+ * that are rejected. Callers that have nothing pending, are not in the
+ * ring and have a full bucket are forgotten once there are more than
+ * MAX_IDLE_CALLERS of them.
+ */
+#define CALLER_REFILL_USEC (2 * G_USEC_PER_SEC)
+#define MAX_IDLE_CALLERS 128
+
+/* requests beyond this many waiting ones are rejected unless configured
+ * otherwise
+ */
+#define DEFAULT_MAX_QUEUED 64
+
+/* a request whose deadline passes while the user is typing into its
+ * dialog gets this much longer, again and again as long as that lasts */
+#define PROMPT_GRACE_SEC 30
+
+/* the process requests are made for, as far as polkit tells us */
+typedef struct
+{
+  gchar *id;
+
+  /* binary min-heap of queued AuthData ordered by sort_key */
+  GPtrArray *queue;
+  gboolean in_ring;
+
+  /* requests that arrived and have not completed yet */
+  guint pending;
+
+  /* token bucket */
+  gint64 tokens_usec;
+  gint64 refilled_at;
+} Caller;
+
+static void
+caller_free (Caller *caller)
+{
+  g_free (caller->id);
+  g_ptr_array_unref (caller->queue);
+  g_free (caller);
+}
+
 struct _PolkitCafeListener
 {
   PolkitAgentListener parent_instance;
 
-  /* we support multiple authenticators - they are simply queued up */
-  GList *authenticators;
+  /* cookie -> AuthData for every request from the moment it arrives
+   * until it completes */
+  GHashTable *requests;
+
+  /* up to max_concurrent authentications run at the same time, as long
+   * as they are for different actions; the rest wait in the queue of
+   * their Caller. Callers with queued requests take turns in the ring.
+   */
+  GQueue ring;
+  guint num_queued;
+  guint num_active;
+  guint max_concurrent;
+  guint max_queued;
+  guint request_timeout_sec;
+  guint caller_burst;
+
+  /* action id -> number of running authentications */
+  GHashTable *active_actions;
+
+  /* coalesce key -> AuthData of the request followers attach to;
+   * requests without a key are never coalesced */
+  GHashTable *leaders;
 
-  PolkitCafeAuthenticator *active_authenticator;
+  /* caller id -> Caller */
+  GHashTable *callers;
+
+  /* action id, or prefix ending in ".*" -> priority */
+  GHashTable *action_priorities;
+
+  /* statistics */
+  guint peak_queued;
+  guint num_started;
+  gint64 total_wait_usec;
+  gint64 max_wait_usec;
+  guint num_rejected;
+  guint num_expired;
+  guint num_throttled;
+  guint num_coalesced;
 };
 
 struct _PolkitCafeListenerClass
@@ -61,13 +155,32 @@ static gboolean polkit_cafe_listener_initiate_authentication_finish (PolkitAgent
 G_DEFINE_TYPE (PolkitCafeListener, polkit_cafe_listener, POLKIT_AGENT_TYPE_LISTENER);
 
 static void
-polkit_cafe_listener_init (PolkitCafeListener *listener G_GNUC_UNUSED)
+polkit_cafe_listener_init (PolkitCafeListener *listener)
 {
+  listener->requests = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_queue_init (&listener->ring);
+  listener->active_actions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  listener->leaders = g_hash_table_new (g_str_hash, g_str_equal);
+  listener->callers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) caller_free);
+  listener->action_priorities = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  listener->max_concurrent = DEFAULT_MAX_CONCURRENT;
+  listener->max_queued = DEFAULT_MAX_QUEUED;
 }
 
 static void
 polkit_cafe_listener_finalize (GObject *object)
 {
+  PolkitCafeListener *listener;
+
+  listener = POLKIT_CAFE_LISTENER (object);
+
+  g_hash_table_unref (listener->requests);
+  g_queue_clear (&listener->ring);
+  g_hash_table_unref (listener->active_actions);
+  g_hash_table_unref (listener->leaders);
+  g_hash_table_unref (listener->callers);
+  g_hash_table_unref (listener->action_priorities);
+
   if (G_OBJECT_CLASS (polkit_cafe_listener_parent_class)->finalize != NULL)
     G_OBJECT_CLASS (polkit_cafe_listener_parent_class)->finalize (object);
 }
@@ -93,7 +206,144 @@ polkit_cafe_listener_new (void)
   return POLKIT_AGENT_LISTENER (g_object_new (POLKIT_CAFE_TYPE_LISTENER, NULL));
 }
 
-typedef struct
+static void maybe_initiate_next_authenticator (PolkitCafeListener *listener);
+
+/**
+ * polkit_cafe_listener_set_max_concurrent:
+ * @listener: A #PolkitCafeListener.
+ * @max_concurrent: The maximum number of authentication dialogs to show at once or 0 for the default.
+ *
+ * Sets how many authentications may run at the same time. Requests for
+ * an action that is already being authenticated always wait for it.
+ **/
+void
+polkit_cafe_listener_set_max_concurrent (PolkitCafeListener *listener,
+                                         guint               max_concurrent)
+{
+  listener->max_concurrent = max_concurrent > 0 ? max_concurrent : DEFAULT_MAX_CONCURRENT;
+  maybe_initiate_next_authenticator (listener);
+}
+
+/**
+ * polkit_cafe_listener_set_max_queued:
+ * @listener: A #PolkitCafeListener.
+ * @max_queued: The maximum number of requests waiting for a dialog or 0 for the default.
+ *
+ * Bounds the number of waiting requests. A request arriving when
+ * @max_queued requests are already waiting fails right away with
+ * %POLKIT_ERROR_FAILED.
+ **/
+void
+polkit_cafe_listener_set_max_queued (PolkitCafeListener *listener,
+                                     guint               max_queued)
+{
+  listener->max_queued = max_queued > 0 ? max_queued : DEFAULT_MAX_QUEUED;
+}
+
+/**
+ * polkit_cafe_listener_set_request_timeout:
+ * @listener: A #PolkitCafeListener.
+ * @timeout_sec: Seconds after which an unanswered request is cancelled, or 0 to never cancel.
+ *
+ * Sets the deadline of requests arriving from now on. A request that is
+ * still pending @timeout_sec seconds after it arrived is cancelled as if
+ * the user had dismissed its dialog, unless the user is answering a
+ * prompt of it at the time. Requests are never cancelled by default.
+ **/
+void
+polkit_cafe_listener_set_request_timeout (PolkitCafeListener *listener,
+                                          guint               timeout_sec)
+{
+  listener->request_timeout_sec = timeout_sec;
+}
+
+/**
+ * polkit_cafe_listener_set_caller_burst:
+ * @listener: A #PolkitCafeListener.
+ * @burst: The number of dialogs a process may open at once, or 0 to not throttle processes.
+ *
+ * Throttles the processes requests are made for. Each may open @burst
+ * dialogs at once and one more every two seconds after that; further
+ * requests fail right away with %POLKIT_ERROR_FAILED. Requests that
+ * share the dialog of an equivalent one don't count. Processes are not
+ * throttled by default.
+ **/
+void
+polkit_cafe_listener_set_caller_burst (PolkitCafeListener *listener,
+                                       guint               burst)
+{
+  listener->caller_burst = burst;
+}
+
+/**
+ * polkit_cafe_listener_set_action_priority:
+ * @listener: A #PolkitCafeListener.
+ * @pattern: An action id, or an action id prefix followed by <literal>.*</literal>.
+ * @priority: The priority; higher values are served earlier, 0 is the default.
+ *
+ * Sets the priority of queued requests for actions matching @pattern.
+ * An exact action id takes precedence over prefixes, and longer
+ * prefixes over shorter ones.
+ **/
+void
+polkit_cafe_listener_set_action_priority (PolkitCafeListener *listener,
+                                          const gchar        *pattern,
+                                          gint                priority)
+{
+  g_hash_table_insert (listener->action_priorities, g_strdup (pattern), GINT_TO_POINTER (priority));
+}
+
+/**
+ * polkit_cafe_listener_get_stats:
+ * @listener: A #PolkitCafeListener.
+ * @out_active: Return location for the number of running authentications or %NULL.
+ * @out_queued: Return location for the number of queued authentications or %NULL.
+ * @out_peak_queued: Return location for the largest number of queued authentications seen or %NULL.
+ * @out_mean_wait_usec: Return location for the mean time authentications spent queued or %NULL.
+ * @out_max_wait_usec: Return location for the longest time an authentication spent queued or %NULL.
+ * @out_rejected: Return location for the number of requests rejected because too many were waiting or %NULL.
+ * @out_expired: Return location for the number of requests cancelled because nobody answered them in time or %NULL.
+ * @out_throttled: Return location for the number of requests rejected because their caller made too many or %NULL.
+ * @out_coalesced: Return location for the number of requests that waited for an identical one instead of showing a dialog or %NULL.
+ *
+ * Gets queueing statistics of @listener, e.g. for tuning
+ * polkit_cafe_listener_set_max_concurrent().
+ **/
+void
+polkit_cafe_listener_get_stats (PolkitCafeListener *listener,
+                                guint              *out_active,
+                                guint              *out_queued,
+                                guint              *out_peak_queued,
+                                gint64             *out_mean_wait_usec,
+                                gint64             *out_max_wait_usec,
+                                guint              *out_rejected,
+                                guint              *out_expired,
+                                guint              *out_throttled,
+                                guint              *out_coalesced)
+{
+  if (out_active != NULL)
+    *out_active = listener->num_active;
+  if (out_queued != NULL)
+    *out_queued = listener->num_queued;
+  if (out_peak_queued != NULL)
+    *out_peak_queued = listener->peak_queued;
+  if (out_mean_wait_usec != NULL)
+    *out_mean_wait_usec = listener->num_started > 0 ? listener->total_wait_usec / listener->num_started : 0;
+  if (out_max_wait_usec != NULL)
+    *out_max_wait_usec = listener->max_wait_usec;
+  if (out_rejected != NULL)
+    *out_rejected = listener->num_rejected;
+  if (out_expired != NULL)
+    *out_expired = listener->num_expired;
+  if (out_throttled != NULL)
+    *out_throttled = listener->num_throttled;
+  if (out_coalesced != NULL)
+    *out_coalesced = listener->num_coalesced;
+}
+
+typedef struct _AuthData AuthData;
+
+struct _AuthData
 {
   PolkitCafeListener *listener;
   PolkitCafeAuthenticator *authenticator;
@@ -102,11 +352,38 @@ typedef struct
   GCancellable *cancellable;
 
   gulong cancel_id;
-} AuthData;
+
+  /* passed to every lookup made for the request and cancelled along
+   * with it, so nothing keeps running on its behalf */
+  GCancellable *work_cancellable;
+
+  gchar *cookie;
+  Caller *caller;
+
+  /* when the request was queued, and the key it is ordered by */
+  gint64 queued_at;
+  gint64 sort_key;
+
+  /* position in the queue of the caller or -1 */
+  gint heap_index;
+  gboolean active;
+
+  /* when the request arrived, when it expires or 0, and the timeout
+   * cancelling it */
+  gint64 received_at;
+  gint64 deadline;
+  guint deadline_id;
+  gboolean expired;
+
+  /* equivalent requests share one dialog: followers wait for their
+   * leader instead of being queued */
+  gchar *coalesce_key;
+  AuthData *leader;
+  GList *followers;
+};
 
 static AuthData *
 auth_data_new (PolkitCafeListener *listener,
-               PolkitCafeAuthenticator *authenticator,
                GTask *task,
                GCancellable *cancellable)
 {
@@ -114,9 +391,11 @@ auth_data_new (PolkitCafeListener *listener,
 
   data = g_new0 (AuthData, 1);
   data->listener = g_object_ref (listener);
-  data->authenticator = g_object_ref (authenticator);
   data->task = g_object_ref (task);
   data->cancellable = g_object_ref (cancellable);
+  data->work_cancellable = g_cancellable_new ();
+  data->heap_index = -1;
+  data->received_at = g_get_monotonic_time ();
   return data;
 }
 
@@ -124,52 +403,628 @@ static void
 auth_data_free (AuthData *data)
 {
   g_object_unref (data->listener);
-  g_object_unref (data->authenticator);
+  if (data->authenticator != NULL)
+    g_object_unref (data->authenticator);
   g_object_unref (data->task);
   if (data->cancellable != NULL && data->cancel_id > 0)
     g_signal_handler_disconnect (data->cancellable, data->cancel_id);
+  if (data->deadline_id != 0)
+    g_source_remove (data->deadline_id);
   g_object_unref (data->cancellable);
+  g_object_unref (data->work_cancellable);
+  g_free (data->coalesce_key);
+  g_free (data->cookie);
   g_free (data);
 }
 
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+  return g_strcmp0 (*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Reads the owner and the start time of process @pid, which together
+ * with the pid tell the process apart from any later one reusing it.
+ */
+static gboolean
+get_process_identity (const gchar *pid,
+                      guint       *out_uid,
+                      guint64     *out_start_time)
+{
+  struct stat statbuf;
+  gchar *path;
+  gchar *contents;
+  gchar **fields;
+  gchar *p;
+  gboolean ret;
+
+  ret = FALSE;
+  contents = NULL;
+  fields = NULL;
+
+  path = g_strdup_printf ("/proc/%s/stat", pid);
+  if (stat (path, &statbuf) != 0)
+    goto out;
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    goto out;
+
+  /* the command name may contain spaces and parentheses; the start time
+   * is the 20th field after it */
+  p = strrchr (contents, ')');
+  if (p == NULL || p[1] != ' ')
+    goto out;
+  fields = g_strsplit (p + 2, " ", 21);
+  if (g_strv_length (fields) < 20)
+    goto out;
+
+  *out_uid = statbuf.st_uid;
+  *out_start_time = g_ascii_strtoull (fields[19], NULL, 10);
+  ret = TRUE;
+
+ out:
+  g_strfreev (fields);
+  g_free (contents);
+  g_free (path);
+  return ret;
+}
+
+/* Requests are equivalent if they are for the same action, can be
+ * authenticated by the same identities, carry the same details and are
+ * made for the same subject. The answers given for one of them are
+ * replayed for the others, so requests that don't say which process
+ * they are for, or for a process that cannot be told apart from a later
+ * one reusing its pid, are never coalesced. The D-Bus caller is left out
+ * since it is the subject that gets authorized; for pkexec that is its
+ * parent, so a burst of pkexec calls from one script is still coalesced.
+ *
+ * Returns: The key or %NULL if the request must not be coalesced.
+ */
+static gchar *
+compute_coalesce_key (const gchar   *action_id,
+                      GList         *identities,
+                      PolkitDetails *details)
+{
+  GString *key;
+  GPtrArray *strings;
+  const gchar *subject_pid;
+  gchar *end;
+  gchar **keys;
+  GList *l;
+  guint n;
+  guint uid;
+  guint64 start_time;
+
+  subject_pid = details != NULL ? polkit_details_lookup (details, "polkit.subject-pid") : NULL;
+  if (subject_pid == NULL ||
+      g_ascii_strtoull (subject_pid, &end, 10) == 0 || *end != '\0' ||
+      !get_process_identity (subject_pid, &uid, &start_time))
+    return NULL;
+
+  key = g_string_new (action_id);
+  g_string_append_printf (key, "\n%s:%u:%" G_GUINT64_FORMAT, subject_pid, uid, start_time);
+
+  strings = g_ptr_array_new_with_free_func (g_free);
+  for (l = identities; l != NULL; l = l->next)
+    g_ptr_array_add (strings, polkit_identity_to_string (POLKIT_IDENTITY (l->data)));
+  g_ptr_array_sort (strings, compare_strings);
+  for (n = 0; n < strings->len; n++)
+    g_string_append_printf (key, "\n%s", (const gchar *) g_ptr_array_index (strings, n));
+  g_ptr_array_unref (strings);
+
+  keys = polkit_details_get_keys (details);
+  qsort (keys, g_strv_length (keys), sizeof (gchar *), compare_strings);
+  for (n = 0; keys[n] != NULL; n++)
+    {
+      if (strcmp (keys[n], "polkit.caller-pid") == 0)
+        continue;
+
+      g_string_append_printf (key, "\n%s=%s", keys[n], polkit_details_lookup (details, keys[n]));
+    }
+  g_strfreev (keys);
+
+  return g_string_free (key, FALSE);
+}
+
+/* Requests are accounted to the subject, i.e. the process asking for
+ * the authorization, rather than to the D-Bus caller. For pkexec that is
+ * its parent, so a script looping over pkexec is one caller no matter
+ * how many pkexec processes it starts.
+ *
+ * Returns: The caller id or %NULL if the request does not say where it
+ * came from; such requests are not throttled.
+ */
+static gchar *
+compute_caller_id (PolkitDetails *details)
+{
+  const gchar *pid;
+  gchar *end;
+  guint uid;
+  guint64 start_time;
+
+  pid = NULL;
+  if (details != NULL)
+    {
+      pid = polkit_details_lookup (details, "polkit.subject-pid");
+      if (pid == NULL)
+        pid = polkit_details_lookup (details, "polkit.caller-pid");
+    }
+
+  if (pid == NULL || g_ascii_strtoull (pid, &end, 10) == 0 || *end != '\0')
+    return NULL;
+
+  /* the process is gone already; its pid still tells it apart from
+   * the processes that are running */
+  if (!get_process_identity (pid, &uid, &start_time))
+    return g_strdup (pid);
+
+  return g_strdup_printf ("%s:%u:%" G_GUINT64_FORMAT, pid, uid, start_time);
+}
+
+/* the bucket holds up to @burst tokens, counted in microseconds of
+ * refill time so it can be refilled without rounding */
+static void
+caller_refill (Caller *caller,
+               guint   burst,
+               gint64  now)
+{
+  caller->tokens_usec = MIN (caller->tokens_usec + (now - caller->refilled_at),
+                             (gint64) burst * CALLER_REFILL_USEC);
+  caller->refilled_at = now;
+}
+
+static gboolean
+caller_is_idle (Caller *caller,
+                guint   burst,
+                gint64  now)
+{
+  /* a caller whose queue ran empty may still wait for its turn in the
+   * ring and must not be freed before it is popped */
+  if (caller->pending > 0 || caller->in_ring)
+    return FALSE;
+
+  caller_refill (caller, burst, now);
+  return caller->tokens_usec == (gint64) burst * CALLER_REFILL_USEC;
+}
+
+static Caller *
+lookup_caller (PolkitCafeListener *listener,
+               const gchar        *id)
+{
+  Caller *caller;
+  gint64 now;
+
+  caller = g_hash_table_lookup (listener->callers, id);
+  if (caller != NULL)
+    return caller;
+
+  now = g_get_monotonic_time ();
+
+  if (g_hash_table_size (listener->callers) >= MAX_IDLE_CALLERS)
+    {
+      GHashTableIter iter;
+      Caller *other;
+
+      g_hash_table_iter_init (&iter, listener->callers);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &other))
+        {
+          if (caller_is_idle (other, listener->caller_burst, now))
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+
+  caller = g_new0 (Caller, 1);
+  caller->id = g_strdup (id);
+  caller->queue = g_ptr_array_new ();
+  caller->tokens_usec = (gint64) listener->caller_burst * CALLER_REFILL_USEC;
+  caller->refilled_at = now;
+  g_hash_table_insert (listener->callers, caller->id, caller);
+
+  return caller;
+}
+
+static gboolean
+caller_has_token (Caller *caller,
+                  guint   burst)
+{
+  caller_refill (caller, burst, g_get_monotonic_time ());
+
+  return caller->tokens_usec >= CALLER_REFILL_USEC;
+}
+
+/* requests that were let in while the bucket was running empty may
+ * take it below zero tokens; they don't buy the caller anything */
+static void
+caller_take_token (Caller *caller,
+                   guint   burst)
+{
+  caller_refill (caller, burst, g_get_monotonic_time ());
+
+  caller->tokens_usec = MAX (caller->tokens_usec - CALLER_REFILL_USEC, 0);
+}
+
+static gint
+lookup_action_priority (PolkitCafeListener *listener,
+                        const gchar        *action_id)
+{
+  gpointer value;
+  gchar *prefix;
+  gchar *pattern;
+  gchar *dot;
+  gboolean found;
+
+  if (g_hash_table_lookup_extended (listener->action_priorities, action_id, NULL, &value))
+    return GPOINTER_TO_INT (value);
+
+  found = FALSE;
+  prefix = g_strdup (action_id);
+  while (!found && (dot = strrchr (prefix, '.')) != NULL)
+    {
+      *dot = '\0';
+      pattern = g_strconcat (prefix, ".*", NULL);
+      found = g_hash_table_lookup_extended (listener->action_priorities, pattern, NULL, &value);
+      g_free (pattern);
+    }
+  g_free (prefix);
+
+  return found ? GPOINTER_TO_INT (value) : 0;
+}
+
+/* binary min-heap on AuthData::sort_key */
+
+static void
+heap_set (GPtrArray *heap,
+          guint      index,
+          AuthData  *data)
+{
+  g_ptr_array_index (heap, index) = data;
+  data->heap_index = index;
+}
+
+static void
+heap_sift_up (GPtrArray *heap,
+              guint      index)
+{
+  AuthData *data = g_ptr_array_index (heap, index);
+
+  while (index > 0)
+    {
+      guint parent = (index - 1) / 2;
+      AuthData *parent_data = g_ptr_array_index (heap, parent);
+
+      if (parent_data->sort_key <= data->sort_key)
+        break;
+
+      heap_set (heap, index, parent_data);
+      index = parent;
+    }
+  heap_set (heap, index, data);
+}
+
+static void
+heap_sift_down (GPtrArray *heap,
+                guint      index)
+{
+  AuthData *data = g_ptr_array_index (heap, index);
+  guint len = heap->len;
+
+  for (;;)
+    {
+      guint child = 2 * index + 1;
+      AuthData *child_data;
+
+      if (child >= len)
+        break;
+
+      if (child + 1 < len &&
+          ((AuthData *) g_ptr_array_index (heap, child + 1))->sort_key <
+          ((AuthData *) g_ptr_array_index (heap, child))->sort_key)
+        child++;
+
+      child_data = g_ptr_array_index (heap, child);
+      if (data->sort_key <= child_data->sort_key)
+        break;
+
+      heap_set (heap, index, child_data);
+      index = child;
+    }
+  heap_set (heap, index, data);
+}
+
+static void
+queue_push (PolkitCafeListener *listener,
+            AuthData           *data)
+{
+  Caller *caller = data->caller;
+
+  g_ptr_array_add (caller->queue, data);
+  heap_sift_up (caller->queue, caller->queue->len - 1);
+
+  if (!caller->in_ring)
+    {
+      g_queue_push_tail (&listener->ring, caller);
+      caller->in_ring = TRUE;
+    }
+
+  listener->num_queued++;
+  listener->peak_queued = MAX (listener->peak_queued, listener->num_queued);
+}
+
+/* a caller whose queue runs empty stays in the ring until its turn */
+static void
+queue_remove (PolkitCafeListener *listener,
+              AuthData           *data)
+{
+  GPtrArray *heap = data->caller->queue;
+  guint index = data->heap_index;
+  AuthData *last;
+
+  last = g_ptr_array_index (heap, heap->len - 1);
+  g_ptr_array_set_size (heap, heap->len - 1);
+  data->heap_index = -1;
+  listener->num_queued--;
+
+  if (last == data)
+    return;
+
+  heap_set (heap, index, last);
+  heap_sift_up (heap, index);
+  heap_sift_down (heap, last->heap_index);
+}
+
+static void
+activate (PolkitCafeListener *listener,
+          AuthData           *data)
+{
+  const gchar *action_id = polkit_cafe_authenticator_get_action_id (data->authenticator);
+
+  data->active = TRUE;
+  listener->num_active++;
+  g_hash_table_insert (listener->active_actions,
+                       g_strdup (action_id),
+                       GUINT_TO_POINTER (GPOINTER_TO_UINT (g_hash_table_lookup (listener->active_actions, action_id)) + 1));
+
+  polkit_cafe_authenticator_initiate (data->authenticator);
+}
+
+static void
+deactivate (PolkitCafeListener *listener,
+            AuthData           *data)
+{
+  const gchar *action_id = polkit_cafe_authenticator_get_action_id (data->authenticator);
+  guint count;
+
+  if (!data->active)
+    return;
+
+  data->active = FALSE;
+  listener->num_active--;
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (listener->active_actions, action_id));
+  if (count <= 1)
+    g_hash_table_remove (listener->active_actions, action_id);
+  else
+    g_hash_table_insert (listener->active_actions, g_strdup (action_id), GUINT_TO_POINTER (count - 1));
+}
+
+static void
+start_authenticator (PolkitCafeListener *listener,
+                     AuthData           *data)
+{
+  gint64 waited;
+
+  waited = g_get_monotonic_time () - data->queued_at;
+  listener->num_started++;
+  listener->total_wait_usec += waited;
+  listener->max_wait_usec = MAX (listener->max_wait_usec, waited);
+
+  activate (listener, data);
+
+  g_debug ("Starting authentication for %s after %" G_GINT64_FORMAT " ms in the queue (active=%u queued=%u)",
+           polkit_cafe_authenticator_get_action_id (data->authenticator),
+           waited / 1000,
+           listener->num_active,
+           listener->num_queued);
+}
+
+static void
+enqueue (PolkitCafeListener *listener,
+         AuthData           *data)
+{
+  gint priority;
+
+  priority = lookup_action_priority (listener, polkit_cafe_authenticator_get_action_id (data->authenticator));
+
+  data->sort_key = data->queued_at - (gint64) priority * PRIORITY_STEP_USEC;
+
+  /* only requests that get a dialog of their own are charged; requests
+   * that don't say where they came from are not throttled */
+  if (listener->caller_burst > 0 && data->caller->id[0] != '\0')
+    caller_take_token (data->caller, listener->caller_burst);
+
+  if (data->coalesce_key != NULL)
+    g_hash_table_insert (listener->leaders, data->coalesce_key, data);
+  queue_push (listener, data);
+}
+
 static void
 maybe_initiate_next_authenticator (PolkitCafeListener *listener)
 {
-  if (listener->active_authenticator == NULL && listener->authenticators != NULL)
+  GList *blocked;
+  GList *l;
+
+  /* callers take turns; a caller whose next request is for an action
+   * that is already being authenticated keeps its place for later */
+  blocked = NULL;
+  while (listener->num_active < listener->max_concurrent && !g_queue_is_empty (&listener->ring))
     {
-      polkit_cafe_authenticator_initiate (POLKIT_CAFE_AUTHENTICATOR (listener->authenticators->data));
-      listener->active_authenticator = listener->authenticators->data;
+      Caller *caller = g_queue_pop_head (&listener->ring);
+      AuthData *data;
+
+      if (caller->queue->len == 0)
+        {
+          caller->in_ring = FALSE;
+          continue;
+        }
+
+      data = g_ptr_array_index (caller->queue, 0);
+      if (g_hash_table_contains (listener->active_actions, polkit_cafe_authenticator_get_action_id (data->authenticator)))
+        {
+          blocked = g_list_prepend (blocked, caller);
+          continue;
+        }
+
+      queue_remove (listener, data);
+      g_queue_push_tail (&listener->ring, caller);
+
+      start_authenticator (listener, data);
     }
+
+  /* blocked is in reverse order */
+  for (l = blocked; l != NULL; l = l->next)
+    g_queue_push_head (&listener->ring, l->data);
+  g_list_free (blocked);
 }
 
+static void expire_request (AuthData *data);
+
 static void
-authenticator_completed (PolkitCafeAuthenticator *authenticator,
-			 gboolean                 gained_authorization G_GNUC_UNUSED,
-			 gboolean                 dismissed,
-			 gpointer                 user_data)
+release_followers (AuthData *data)
 {
-  AuthData *data = user_data;
+  PolkitCafeListener *listener = data->listener;
+  AuthData *new_leader;
+  GList *followers;
+  GList *l;
+  gint64 now;
+
+  followers = data->followers;
+  data->followers = NULL;
+
+  if (followers == NULL)
+    return;
+
+  /* the leader's caller went away or nobody answered it in time - that
+   * says nothing about the other requests, so the oldest follower that
+   * has time left gets a dialog of its own instead. Followers whose
+   * deadline has passed as well expire now.
+   */
+  if (g_cancellable_is_cancelled (data->cancellable) || data->expired)
+    {
+      now = g_get_monotonic_time ();
+      new_leader = NULL;
+      for (l = followers; l != NULL; l = l->next)
+        {
+          AuthData *follower = l->data;
+
+          /* still attached to @data, so it completes without a dialog */
+          if (follower->deadline != 0 && follower->deadline <= now)
+            {
+              expire_request (follower);
+            }
+          else if (new_leader == NULL)
+            {
+              new_leader = follower;
+              new_leader->leader = NULL;
+            }
+          else
+            {
+              follower->leader = new_leader;
+              new_leader->followers = g_list_append (new_leader->followers, follower);
+            }
+        }
+      g_list_free (followers);
+
+      if (new_leader != NULL)
+        enqueue (listener, new_leader);
+      return;
+    }
+
+  for (l = followers; l != NULL; l = l->next)
+    {
+      AuthData *follower = l->data;
+
+      follower->leader = NULL;
+      polkit_cafe_authenticator_initiate_from (follower->authenticator, data->authenticator);
+    }
+  g_list_free (followers);
+}
+
+/* completes the task of @data and frees it */
+static void
+complete_request (AuthData *data,
+                  gboolean  dismissed)
+{
+  PolkitCafeListener *listener = data->listener;
 
-  data->listener->authenticators = g_list_remove (data->listener->authenticators, authenticator);
-  if (authenticator == data->listener->active_authenticator)
-    data->listener->active_authenticator = NULL;
+  deactivate (listener, data);
+  if (data->heap_index >= 0)
+    queue_remove (listener, data);
+  if (data->coalesce_key != NULL &&
+      g_hash_table_lookup (listener->leaders, data->coalesce_key) == data)
+    g_hash_table_remove (listener->leaders, data->coalesce_key);
+  g_hash_table_remove (listener->requests, data->cookie);
+  data->caller->pending--;
 
-  g_object_unref (authenticator);
+  release_followers (data);
 
-  if (dismissed)
+  if (data->expired)
+    {
+      g_task_return_new_error (data->task,
+                               POLKIT_ERROR,
+                               POLKIT_ERROR_CANCELLED,
+                               "Authentication request was not answered in time");
+    }
+  else if (g_cancellable_is_cancelled (data->cancellable))
+    {
+      g_task_return_new_error (data->task,
+                               POLKIT_ERROR,
+                               POLKIT_ERROR_CANCELLED,
+                               "Authentication request was cancelled");
+    }
+  else if (dismissed)
     {
       g_task_return_new_error (data->task,
                                POLKIT_ERROR,
                                POLKIT_ERROR_CANCELLED,
                                _("Authentication dialog was dismissed by the user"));
     }
+  else
+    {
+      g_task_return_boolean (data->task, TRUE);
+    }
 
-  g_task_return_boolean (data->task, TRUE);
-  g_object_unref (data->task);
+  auth_data_free (data);
 
-  maybe_initiate_next_authenticator (data->listener);
+  maybe_initiate_next_authenticator (listener);
+}
 
-  auth_data_free (data);
+static void
+authenticator_completed (PolkitCafeAuthenticator *authenticator G_GNUC_UNUSED,
+			 gboolean                 gained_authorization G_GNUC_UNUSED,
+			 gboolean                 dismissed,
+			 gpointer                 user_data)
+{
+  complete_request (user_data, dismissed);
+}
+
+static void
+cancel_request (AuthData *data)
+{
+  g_cancellable_cancel (data->work_cancellable);
+  polkit_cafe_authenticator_cancel (data->authenticator);
+
+  /* a coalesced request completes without showing a dialog, and a
+   * queued one right away without ever taking a slot, freeing @data */
+  if (data->leader != NULL)
+    {
+      data->leader->followers = g_list_remove (data->leader->followers, data);
+      data->leader = NULL;
+      polkit_cafe_authenticator_initiate (data->authenticator);
+    }
+  else if (data->heap_index >= 0)
+    {
+      complete_request (data, TRUE);
+    }
 }
 
 static void
@@ -178,7 +1033,121 @@ cancelled_cb (GCancellable *cancellable G_GNUC_UNUSED,
 {
   AuthData *data = user_data;
 
-  polkit_cafe_authenticator_cancel (data->authenticator);
+  /* still being set up - the lookups fail with G_IO_ERROR_CANCELLED and
+   * authenticator_new_cb() frees @data, possibly before this returns */
+  if (data->authenticator == NULL)
+    {
+      g_cancellable_cancel (data->work_cancellable);
+      return;
+    }
+
+  cancel_request (data);
+}
+
+static void
+expire_request (AuthData *data)
+{
+  if (data->deadline_id != 0)
+    {
+      g_source_remove (data->deadline_id);
+      data->deadline_id = 0;
+    }
+
+  data->expired = TRUE;
+  data->listener->num_expired++;
+
+  g_debug ("Authentication request for %s expired after %" G_GINT64_FORMAT " s",
+           polkit_cafe_authenticator_get_action_id (data->authenticator),
+           (data->deadline - data->received_at) / G_USEC_PER_SEC);
+
+  cancel_request (data);
+}
+
+static gboolean
+deadline_cb (gpointer user_data)
+{
+  AuthData *data = user_data;
+
+  /* don't take the dialog away from under the user's fingers */
+  if (data->active && polkit_cafe_authenticator_is_prompting (data->authenticator))
+    {
+      g_debug ("Authentication request for %s is past its deadline, waiting for the user",
+               polkit_cafe_authenticator_get_action_id (data->authenticator));
+      data->deadline_id = g_timeout_add_seconds (PROMPT_GRACE_SEC, deadline_cb, data);
+      return FALSE;
+    }
+
+  data->deadline_id = 0;
+  expire_request (data);
+
+  return FALSE;
+}
+
+static void
+authenticator_new_cb (GObject      *source_object G_GNUC_UNUSED,
+                      GAsyncResult *res,
+                      gpointer      user_data)
+{
+  AuthData *data = user_data;
+  PolkitCafeListener *listener = data->listener;
+  AuthData *leader;
+  GError *error;
+
+  error = NULL;
+  data->authenticator = polkit_cafe_authenticator_new_finish (res, &error);
+  if (data->authenticator == NULL)
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_task_return_new_error (data->task,
+                                 POLKIT_ERROR,
+                                 POLKIT_ERROR_CANCELLED,
+                                 "Authentication request was cancelled");
+      else
+        g_task_return_new_error (data->task,
+                                 POLKIT_ERROR,
+                                 POLKIT_ERROR_FAILED,
+                                 "Error creating authentication object: %s",
+                                 error->message);
+      g_error_free (error);
+      g_hash_table_remove (listener->requests, data->cookie);
+      data->caller->pending--;
+      auth_data_free (data);
+      return;
+    }
+
+  g_signal_connect (data->authenticator,
+                    "completed",
+                    G_CALLBACK (authenticator_completed),
+                    data);
+
+  if (listener->request_timeout_sec > 0)
+    {
+      gint64 remaining_msec;
+
+      /* the deadline counts from when the request arrived */
+      data->deadline = data->received_at + (gint64) listener->request_timeout_sec * G_USEC_PER_SEC;
+      remaining_msec = (data->deadline - g_get_monotonic_time ()) / 1000;
+      data->deadline_id = g_timeout_add (MAX (remaining_msec, 0), deadline_cb, data);
+    }
+
+  data->queued_at = g_get_monotonic_time ();
+
+  leader = NULL;
+  if (data->coalesce_key != NULL)
+    leader = g_hash_table_lookup (listener->leaders, data->coalesce_key);
+  if (leader != NULL)
+    {
+      g_debug ("Coalescing authentication request for %s with a pending one",
+               polkit_cafe_authenticator_get_action_id (data->authenticator));
+      data->leader = leader;
+      leader->followers = g_list_append (leader->followers, data);
+      listener->num_coalesced++;
+      return;
+    }
+
+  enqueue (listener, data);
+
+  maybe_initiate_next_authenticator (listener);
 }
 
 static void
@@ -195,8 +1164,9 @@ polkit_cafe_listener_initiate_authentication (PolkitAgentListener  *agent_listen
 {
   PolkitCafeListener *listener = POLKIT_CAFE_LISTENER (agent_listener);
   GTask *task;
-  PolkitCafeAuthenticator *authenticator;
   AuthData *data;
+  Caller *caller;
+  gchar *caller_id;
 
   task = g_task_new (G_OBJECT (listener),
                      NULL,
@@ -205,43 +1175,85 @@ polkit_cafe_listener_initiate_authentication (PolkitAgentListener  *agent_listen
   g_task_set_source_tag (task,
                          polkit_cafe_listener_initiate_authentication);
 
-  authenticator = polkit_cafe_authenticator_new (action_id,
-                                                  message,
-                                                  icon_name,
-                                                  details,
-                                                  cookie,
-                                                  identities);
-  if (authenticator == NULL)
+  data = auth_data_new (listener, task, cancellable);
+  g_object_unref (task);
+
+  /* everything that arrived but is not running waits for a dialog,
+   * including requests that are still being set up */
+  if (g_hash_table_size (listener->requests) - listener->num_active >= listener->max_queued)
+    {
+      listener->num_rejected++;
+      g_debug ("Rejecting authentication request for %s, %u requests are already waiting",
+               action_id, g_hash_table_size (listener->requests) - listener->num_active);
+      g_task_return_new_error (data->task,
+                               POLKIT_ERROR,
+                               POLKIT_ERROR_FAILED,
+                               "Too many authentication requests are waiting");
+      auth_data_free (data);
+      return;
+    }
+
+  if (g_hash_table_contains (listener->requests, cookie))
     {
-      g_task_return_new_error (task,
+      g_task_return_new_error (data->task,
                                POLKIT_ERROR,
                                POLKIT_ERROR_FAILED,
-                               "Error creating authentication object");
-      g_object_unref (task);
-      goto out;
+                               "An authentication request with this cookie is already pending");
+      auth_data_free (data);
+      return;
     }
 
-  data = auth_data_new (listener, authenticator, task, cancellable);
+  /* requests that don't say where they came from take turns with the
+   * other callers but are not throttled */
+  caller_id = compute_caller_id (details);
+  caller = lookup_caller (listener, caller_id != NULL ? caller_id : "");
 
-  g_signal_connect (authenticator,
-                    "completed",
-                    G_CALLBACK (authenticator_completed),
-                    data);
+  /* fail fast rather than letting one process take all the slots; the
+   * token is only taken once the request turns out to need a dialog */
+  if (caller_id != NULL &&
+      listener->caller_burst > 0 &&
+      !caller_has_token (caller, listener->caller_burst))
+    {
+      listener->num_throttled++;
+      g_debug ("Rejecting authentication request for %s, process %s made too many",
+               action_id, caller->id);
+      g_task_return_new_error (data->task,
+                               POLKIT_ERROR,
+                               POLKIT_ERROR_FAILED,
+                               "Too many authentication requests from this process");
+      g_free (caller_id);
+      auth_data_free (data);
+      return;
+    }
+  g_free (caller_id);
+
+  data->cookie = g_strdup (cookie);
+  data->caller = caller;
+  data->coalesce_key = compute_coalesce_key (action_id, identities, details);
 
-  if (cancellable != NULL)
+  g_hash_table_insert (listener->requests, g_strdup (cookie), data);
+  caller->pending++;
+
+  if (data->cancellable != NULL)
     {
-      data->cancel_id = g_signal_connect (cancellable,
+      data->cancel_id = g_signal_connect (data->cancellable,
                                           "cancelled",
                                           G_CALLBACK (cancelled_cb),
                                           data);
     }
 
-  listener->authenticators = g_list_append (listener->authenticators, authenticator);
-
-  maybe_initiate_next_authenticator (listener);
-
- out:
-  ;
+  /* the dialog is only built once the authority, the action description
+   * and the identities are known; none of that blocks the main loop
+   */
+  polkit_cafe_authenticator_new_async (action_id,
+                                       message,
+                                       icon_name,
+                                       details,
+                                       cookie,
+                                       identities,
+                                       data->work_cancellable,
+                                       authenticator_new_cb,
+                                       data);
 }
 
 static gboolean
@@ -253,10 +1265,6 @@ polkit_cafe_listener_initiate_authentication_finish (PolkitAgentListener  *liste
 
   g_warn_if_fail (g_task_get_source_tag (task) == polkit_cafe_listener_initiate_authentication);
 
-  if (g_task_propagate_pointer (task, error) == NULL) {
-    return FALSE;
-  }
-
-  return TRUE;
+  return g_task_propagate_boolean (task, error);
 }
 
@@ -38,8 +38,29 @@ extern "C" {
 typedef struct _PolkitCafeListener PolkitCafeListener;
 typedef struct _PolkitCafeListenerClass PolkitCafeListenerClass;
 
-GType                 polkit_cafe_listener_get_type   (void) G_GNUC_CONST;
-PolkitAgentListener  *polkit_cafe_listener_new        (void);
+GType                 polkit_cafe_listener_get_type            (void) G_GNUC_CONST;
+PolkitAgentListener  *polkit_cafe_listener_new                 (void);
+void                  polkit_cafe_listener_set_max_concurrent  (PolkitCafeListener *listener,
+                                                                guint               max_concurrent);
+void                  polkit_cafe_listener_set_max_queued      (PolkitCafeListener *listener,
+                                                                guint               max_queued);
+void                  polkit_cafe_listener_set_request_timeout (PolkitCafeListener *listener,
+                                                                guint               timeout_sec);
+void                  polkit_cafe_listener_set_caller_burst    (PolkitCafeListener *listener,
+                                                                guint               burst);
+void                  polkit_cafe_listener_set_action_priority (PolkitCafeListener *listener,
+                                                                const gchar        *pattern,
+                                                                gint                priority);
+void                  polkit_cafe_listener_get_stats           (PolkitCafeListener *listener,
+                                                                guint              *out_active,
+                                                                guint              *out_queued,
+                                                                guint              *out_peak_queued,
+                                                                gint64             *out_mean_wait_usec,
+                                                                gint64             *out_max_wait_usec,
+                                                                guint              *out_rejected,
+                                                                guint              *out_expired,
+                                                                guint              *out_throttled,
+                                                                guint              *out_coalesced);
 
 #ifdef __cplusplus
 }
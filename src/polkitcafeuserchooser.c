@@ -0,0 +1,786 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib/gi18n-lib.h>
+#include <ctk/ctk.h>
+
+#include "polkitcafeuserchooser.h"
+
+typedef struct
+{
+  /* position of the user in the model */
+  gint row;
+
+  /* casefolded login name and displayed text; the latter changes when
+   * the real name is filled in
+   */
+  gchar *name_key;
+  gchar *text_key;
+
+  /* whether ::fill-row has been emitted for the row */
+  gboolean requested;
+} UserEntry;
+
+struct _PolkitCafeUserChooserPrivate
+{
+  CtkTreeModel *model;
+  gint pixbuf_column;
+  gint text_column;
+  gint user_name_column;
+
+  CtkTreeModel *filter;
+  CtkWidget *search_entry;
+  CtkWidget *tree_view;
+  CtkTreeViewColumn *column;
+
+  /* UserEntry, one per row with a user name */
+  GArray *entries;
+
+  /* model row -> index into entries or -1 */
+  gint *row_to_entry;
+  gint n_rows;
+
+  /* indices into entries sorted by name_key, for prefix lookups */
+  guint *by_name;
+
+  /* the casefolded query or NULL; visible[i] tells whether entry i
+   * matches it and matches lists those entries so that the next,
+   * longer, query only has to look at them
+   */
+  gchar *query;
+  gboolean *visible;
+  GArray *matches;
+
+  /* entries to emit ::fill-row for */
+  GQueue fill_queue;
+  guint fill_idle_id;
+
+  gchar *selected_user;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (PolkitCafeUserChooser, polkit_cafe_user_chooser, CTK_TYPE_BOX);
+
+enum {
+  PROP_0,
+  PROP_MODEL,
+  PROP_PIXBUF_COLUMN,
+  PROP_TEXT_COLUMN,
+  PROP_USER_NAME_COLUMN,
+  PROP_SELECTED_USER,
+};
+
+enum
+{
+  FILL_ROW_SIGNAL,
+  LAST_SIGNAL,
+};
+
+static guint signals[LAST_SIGNAL] = {0};
+
+static gint
+entry_for_iter (PolkitCafeUserChooser *chooser,
+                CtkTreeIter           *iter)
+{
+  CtkTreePath *path;
+  gint row;
+
+  path = ctk_tree_model_get_path (chooser->priv->model, iter);
+  row = ctk_tree_path_get_indices (path)[0];
+  ctk_tree_path_free (path);
+
+  if (row < 0 || row >= chooser->priv->n_rows)
+    return -1;
+
+  return chooser->priv->row_to_entry[row];
+}
+
+static gchar *
+get_casefolded_text (PolkitCafeUserChooser *chooser,
+                     CtkTreeIter           *iter,
+                     gint                   column)
+{
+  gchar *text;
+  gchar *key;
+
+  ctk_tree_model_get (chooser->priv->model, iter, column, &text, -1);
+  key = g_utf8_casefold (text != NULL ? text : "", -1);
+  g_free (text);
+
+  return key;
+}
+
+static gint
+compare_by_name (gconstpointer a,
+                 gconstpointer b,
+                 gpointer      user_data)
+{
+  GArray *entries = user_data;
+
+  return strcmp (g_array_index (entries, UserEntry, *(const guint *) a).name_key,
+                 g_array_index (entries, UserEntry, *(const guint *) b).name_key);
+}
+
+static void
+build_index (PolkitCafeUserChooser *chooser)
+{
+  PolkitCafeUserChooserPrivate *priv = chooser->priv;
+  CtkTreeIter iter;
+  gboolean valid;
+  guint n;
+
+  priv->n_rows = ctk_tree_model_iter_n_children (priv->model, NULL);
+  priv->row_to_entry = g_new (gint, priv->n_rows);
+  priv->entries = g_array_sized_new (FALSE, TRUE, sizeof (UserEntry), priv->n_rows);
+
+  n = 0;
+  for (valid = ctk_tree_model_get_iter_first (priv->model, &iter);
+       valid;
+       valid = ctk_tree_model_iter_next (priv->model, &iter), n++)
+    {
+      UserEntry entry;
+      gchar *user_name;
+
+      ctk_tree_model_get (priv->model, &iter, priv->user_name_column, &user_name, -1);
+      if (user_name == NULL)
+        {
+          priv->row_to_entry[n] = -1;
+          continue;
+        }
+
+      entry.row = n;
+      entry.name_key = g_utf8_casefold (user_name, -1);
+      entry.text_key = get_casefolded_text (chooser, &iter, priv->text_column);
+      entry.requested = FALSE;
+      g_free (user_name);
+
+      priv->row_to_entry[n] = priv->entries->len;
+      g_array_append_val (priv->entries, entry);
+    }
+
+  priv->by_name = g_new (guint, priv->entries->len);
+  for (n = 0; n < priv->entries->len; n++)
+    priv->by_name[n] = n;
+  g_qsort_with_data (priv->by_name,
+                     priv->entries->len,
+                     sizeof (guint),
+                     compare_by_name,
+                     priv->entries);
+
+  priv->visible = g_new0 (gboolean, priv->entries->len);
+}
+
+/* Returns the first entry whose login name starts with @key or -1 */
+static gint
+find_prefix_match (PolkitCafeUserChooser *chooser,
+                   const gchar           *key)
+{
+  PolkitCafeUserChooserPrivate *priv = chooser->priv;
+  guint lo, hi, mid;
+
+  lo = 0;
+  hi = priv->entries->len;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (strcmp (g_array_index (priv->entries, UserEntry, priv->by_name[mid]).name_key, key) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  if (lo < priv->entries->len &&
+      g_str_has_prefix (g_array_index (priv->entries, UserEntry, priv->by_name[lo]).name_key, key))
+    return priv->by_name[lo];
+
+  return -1;
+}
+
+static gboolean
+is_row_visible (CtkTreeModel *model,
+                CtkTreeIter  *iter,
+                gpointer      user_data)
+{
+  PolkitCafeUserChooser *chooser = POLKIT_CAFE_USER_CHOOSER (user_data);
+  gint index;
+
+  index = entry_for_iter (chooser, iter);
+  if (index < 0)
+    return FALSE;
+
+  if (chooser->priv->query == NULL)
+    return TRUE;
+
+  return chooser->priv->visible[index];
+}
+
+/* Moves the cursor to the row of @index, if it is shown */
+static gboolean
+set_cursor_to_entry (PolkitCafeUserChooser *chooser,
+                     gint                   index)
+{
+  CtkTreePath *child_path;
+  CtkTreePath *path;
+
+  child_path = ctk_tree_path_new_from_indices (g_array_index (chooser->priv->entries, UserEntry, index).row, -1);
+  path = ctk_tree_model_filter_convert_child_path_to_path (CTK_TREE_MODEL_FILTER (chooser->priv->filter),
+                                                           child_path);
+  ctk_tree_path_free (child_path);
+
+  if (path == NULL)
+    return FALSE;
+
+  ctk_tree_view_set_cursor (CTK_TREE_VIEW (chooser->priv->tree_view), path, NULL, FALSE);
+  ctk_tree_view_scroll_to_cell (CTK_TREE_VIEW (chooser->priv->tree_view), path, NULL, FALSE, 0.0, 0.0);
+  ctk_tree_path_free (path);
+
+  return TRUE;
+}
+
+static void
+update_filter (PolkitCafeUserChooser *chooser)
+{
+  PolkitCafeUserChooserPrivate *priv = chooser->priv;
+  GArray *candidates;
+  GArray *matches;
+  gchar *query;
+  guint n_candidates;
+  guint n;
+  gint index;
+
+  query = g_utf8_casefold (ctk_entry_get_text (CTK_ENTRY (priv->search_entry)), -1);
+
+  if (query[0] == '\0')
+    {
+      g_free (query);
+      query = NULL;
+      matches = NULL;
+    }
+  else
+    {
+      /* typing more characters can only remove matches */
+      candidates = NULL;
+      if (priv->query != NULL && priv->matches != NULL && g_str_has_prefix (query, priv->query))
+        candidates = priv->matches;
+
+      n_candidates = candidates != NULL ? candidates->len : priv->entries->len;
+      matches = g_array_new (FALSE, FALSE, sizeof (guint));
+
+      memset (priv->visible, 0, priv->entries->len * sizeof (gboolean));
+      for (n = 0; n < n_candidates; n++)
+        {
+          guint i = candidates != NULL ? g_array_index (candidates, guint, n) : n;
+
+          if (strstr (g_array_index (priv->entries, UserEntry, i).text_key, query) != NULL)
+            {
+              priv->visible[i] = TRUE;
+              g_array_append_val (matches, i);
+            }
+        }
+    }
+
+  if (priv->matches != NULL)
+    g_array_unref (priv->matches);
+  priv->matches = matches;
+  g_free (priv->query);
+  priv->query = query;
+
+  ctk_tree_model_filter_refilter (CTK_TREE_MODEL_FILTER (priv->filter));
+
+  /* prefer a user whose login name starts with what was typed */
+  if (query != NULL)
+    {
+      index = find_prefix_match (chooser, query);
+      if (index < 0 && matches->len > 0)
+        index = g_array_index (matches, guint, 0);
+      if (index >= 0)
+        set_cursor_to_entry (chooser, index);
+    }
+  else if (priv->selected_user != NULL)
+    {
+      polkit_cafe_user_chooser_set_selected_user (chooser, priv->selected_user);
+    }
+}
+
+static void
+on_search_changed (CtkSearchEntry *entry G_GNUC_UNUSED,
+                   gpointer        user_data)
+{
+  update_filter (POLKIT_CAFE_USER_CHOOSER (user_data));
+}
+
+static void
+on_search_activate (CtkEntry *entry G_GNUC_UNUSED,
+                    gpointer  user_data)
+{
+  PolkitCafeUserChooser *chooser = POLKIT_CAFE_USER_CHOOSER (user_data);
+  CtkTreePath *path;
+
+  ctk_tree_view_get_cursor (CTK_TREE_VIEW (chooser->priv->tree_view), &path, NULL);
+  if (path != NULL)
+    {
+      ctk_tree_view_row_activated (CTK_TREE_VIEW (chooser->priv->tree_view), path, chooser->priv->column);
+      ctk_tree_path_free (path);
+    }
+}
+
+static void
+on_row_activated (CtkTreeView       *tree_view G_GNUC_UNUSED,
+                  CtkTreePath       *path,
+                  CtkTreeViewColumn *column G_GNUC_UNUSED,
+                  gpointer           user_data)
+{
+  PolkitCafeUserChooser *chooser = POLKIT_CAFE_USER_CHOOSER (user_data);
+  CtkTreeIter iter;
+  gchar *user_name;
+
+  if (!ctk_tree_model_get_iter (chooser->priv->filter, &iter, path))
+    return;
+
+  ctk_tree_model_get (chooser->priv->filter, &iter, chooser->priv->user_name_column, &user_name, -1);
+  if (user_name == NULL)
+    return;
+
+  g_free (chooser->priv->selected_user);
+  chooser->priv->selected_user = user_name;
+
+  g_object_notify (G_OBJECT (chooser), "selected-user");
+}
+
+/* Keeps the search index current when a row is filled in. This runs
+ * before the filter model re-evaluates the row.
+ */
+static void
+on_row_changed (CtkTreeModel *model G_GNUC_UNUSED,
+                CtkTreePath  *path G_GNUC_UNUSED,
+                CtkTreeIter  *iter,
+                gpointer      user_data)
+{
+  PolkitCafeUserChooser *chooser = POLKIT_CAFE_USER_CHOOSER (user_data);
+  PolkitCafeUserChooserPrivate *priv = chooser->priv;
+  UserEntry *entry;
+  gint index;
+
+  index = entry_for_iter (chooser, iter);
+  if (index < 0)
+    return;
+
+  entry = &g_array_index (priv->entries, UserEntry, index);
+  g_free (entry->text_key);
+  entry->text_key = get_casefolded_text (chooser, iter, priv->text_column);
+
+  if (priv->query != NULL && !priv->visible[index] &&
+      strstr (entry->text_key, priv->query) != NULL)
+    {
+      guint i = index;
+
+      priv->visible[index] = TRUE;
+      g_array_append_val (priv->matches, i);
+    }
+}
+
+static gboolean
+fill_rows_idle (gpointer user_data)
+{
+  PolkitCafeUserChooser *chooser = POLKIT_CAFE_USER_CHOOSER (user_data);
+  PolkitCafeUserChooserPrivate *priv = chooser->priv;
+  CtkTreeIter iter;
+
+  while (!g_queue_is_empty (&priv->fill_queue))
+    {
+      gint index = GPOINTER_TO_INT (g_queue_pop_head (&priv->fill_queue));
+
+      if (ctk_tree_model_iter_nth_child (priv->model,
+                                         &iter,
+                                         NULL,
+                                         g_array_index (priv->entries, UserEntry, index).row))
+        g_signal_emit (chooser, signals[FILL_ROW_SIGNAL], 0, &iter);
+    }
+
+  priv->fill_idle_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
+/* Only called for rows that are about to be drawn; the details of the
+ * row are requested from an idle handler since the model must not be
+ * changed while the view is rendering it
+ */
+static void
+request_fill (CtkTreeViewColumn *column G_GNUC_UNUSED,
+              CtkCellRenderer   *cell G_GNUC_UNUSED,
+              CtkTreeModel      *model,
+              CtkTreeIter       *iter,
+              gpointer           user_data)
+{
+  PolkitCafeUserChooser *chooser = POLKIT_CAFE_USER_CHOOSER (user_data);
+  PolkitCafeUserChooserPrivate *priv = chooser->priv;
+  CtkTreeIter child_iter;
+  UserEntry *entry;
+  gint index;
+
+  ctk_tree_model_filter_convert_iter_to_child_iter (CTK_TREE_MODEL_FILTER (model), &child_iter, iter);
+  index = entry_for_iter (chooser, &child_iter);
+  if (index < 0)
+    return;
+
+  entry = &g_array_index (priv->entries, UserEntry, index);
+  if (entry->requested)
+    return;
+  entry->requested = TRUE;
+
+  g_queue_push_tail (&priv->fill_queue, GINT_TO_POINTER (index));
+  if (priv->fill_idle_id == 0)
+    priv->fill_idle_id = g_idle_add (fill_rows_idle, chooser);
+}
+
+static void
+polkit_cafe_user_chooser_init (PolkitCafeUserChooser *chooser)
+{
+  chooser->priv = polkit_cafe_user_chooser_get_instance_private (chooser);
+  g_queue_init (&chooser->priv->fill_queue);
+}
+
+static void
+polkit_cafe_user_chooser_constructed (GObject *object)
+{
+  PolkitCafeUserChooser *chooser;
+  PolkitCafeUserChooserPrivate *priv;
+  CtkWidget *scrolled_window;
+  CtkCellRenderer *renderer;
+
+  chooser = POLKIT_CAFE_USER_CHOOSER (object);
+  priv = chooser->priv;
+
+  if (G_OBJECT_CLASS (polkit_cafe_user_chooser_parent_class)->constructed != NULL)
+    G_OBJECT_CLASS (polkit_cafe_user_chooser_parent_class)->constructed (object);
+
+  ctk_orientable_set_orientation (CTK_ORIENTABLE (chooser), CTK_ORIENTATION_VERTICAL);
+  ctk_box_set_spacing (CTK_BOX (chooser), 6);
+
+  build_index (chooser);
+
+  /* connect before creating the filter so the index is updated first */
+  g_signal_connect (priv->model, "row-changed", G_CALLBACK (on_row_changed), chooser);
+
+  priv->filter = ctk_tree_model_filter_new (priv->model, NULL);
+  ctk_tree_model_filter_set_visible_func (CTK_TREE_MODEL_FILTER (priv->filter),
+                                          is_row_visible,
+                                          chooser,
+                                          NULL);
+
+  priv->search_entry = ctk_search_entry_new ();
+  ctk_entry_set_placeholder_text (CTK_ENTRY (priv->search_entry), _("Search users..."));
+  ctk_box_pack_start (CTK_BOX (chooser), priv->search_entry, FALSE, FALSE, 0);
+  g_signal_connect (priv->search_entry, "search-changed", G_CALLBACK (on_search_changed), chooser);
+  g_signal_connect (priv->search_entry, "activate", G_CALLBACK (on_search_activate), chooser);
+
+  scrolled_window = ctk_scrolled_window_new (NULL, NULL);
+  ctk_scrolled_window_set_policy (CTK_SCROLLED_WINDOW (scrolled_window),
+                                  CTK_POLICY_NEVER,
+                                  CTK_POLICY_AUTOMATIC);
+  ctk_scrolled_window_set_shadow_type (CTK_SCROLLED_WINDOW (scrolled_window), CTK_SHADOW_IN);
+  ctk_scrolled_window_set_min_content_height (CTK_SCROLLED_WINDOW (scrolled_window), 180);
+  ctk_box_pack_start (CTK_BOX (chooser), scrolled_window, TRUE, TRUE, 0);
+
+  /* with fixed height mode only the visible rows are measured and drawn */
+  priv->tree_view = ctk_tree_view_new_with_model (priv->filter);
+  ctk_tree_view_set_headers_visible (CTK_TREE_VIEW (priv->tree_view), FALSE);
+  ctk_tree_view_set_enable_search (CTK_TREE_VIEW (priv->tree_view), FALSE);
+  ctk_tree_view_set_activate_on_single_click (CTK_TREE_VIEW (priv->tree_view), TRUE);
+  ctk_container_add (CTK_CONTAINER (scrolled_window), priv->tree_view);
+  g_signal_connect (priv->tree_view, "row-activated", G_CALLBACK (on_row_activated), chooser);
+
+  priv->column = ctk_tree_view_column_new ();
+  ctk_tree_view_column_set_sizing (priv->column, CTK_TREE_VIEW_COLUMN_FIXED);
+  ctk_tree_view_column_set_expand (priv->column, TRUE);
+
+  renderer = ctk_cell_renderer_pixbuf_new ();
+  ctk_cell_renderer_set_fixed_size (renderer, 16, 16);
+  ctk_tree_view_column_pack_start (priv->column, renderer, FALSE);
+  ctk_tree_view_column_add_attribute (priv->column, renderer, "pixbuf", priv->pixbuf_column);
+
+  renderer = ctk_cell_renderer_text_new ();
+  g_object_set (renderer, "ellipsize", PANGO_ELLIPSIZE_END, NULL);
+  ctk_tree_view_column_pack_start (priv->column, renderer, TRUE);
+  ctk_tree_view_column_add_attribute (priv->column, renderer, "text", priv->text_column);
+  ctk_tree_view_column_set_cell_data_func (priv->column, renderer, request_fill, chooser, NULL);
+
+  ctk_tree_view_append_column (CTK_TREE_VIEW (priv->tree_view), priv->column);
+  ctk_tree_view_set_fixed_height_mode (CTK_TREE_VIEW (priv->tree_view), TRUE);
+}
+
+static void
+polkit_cafe_user_chooser_finalize (GObject *object)
+{
+  PolkitCafeUserChooser *chooser;
+  PolkitCafeUserChooserPrivate *priv;
+  guint n;
+
+  chooser = POLKIT_CAFE_USER_CHOOSER (object);
+  priv = chooser->priv;
+
+  if (priv->fill_idle_id != 0)
+    g_source_remove (priv->fill_idle_id);
+  g_queue_clear (&priv->fill_queue);
+
+  if (priv->model != NULL)
+    {
+      g_signal_handlers_disconnect_by_data (priv->model, chooser);
+      g_object_unref (priv->model);
+    }
+  if (priv->filter != NULL)
+    g_object_unref (priv->filter);
+
+  if (priv->entries != NULL)
+    {
+      for (n = 0; n < priv->entries->len; n++)
+        {
+          g_free (g_array_index (priv->entries, UserEntry, n).name_key);
+          g_free (g_array_index (priv->entries, UserEntry, n).text_key);
+        }
+      g_array_unref (priv->entries);
+    }
+  g_free (priv->row_to_entry);
+  g_free (priv->by_name);
+  g_free (priv->visible);
+  if (priv->matches != NULL)
+    g_array_unref (priv->matches);
+  g_free (priv->query);
+  g_free (priv->selected_user);
+
+  if (G_OBJECT_CLASS (polkit_cafe_user_chooser_parent_class)->finalize != NULL)
+    G_OBJECT_CLASS (polkit_cafe_user_chooser_parent_class)->finalize (object);
+}
+
+static void
+polkit_cafe_user_chooser_set_property (GObject      *object,
+                                       guint         prop_id,
+                                       const GValue *value,
+                                       GParamSpec   *pspec)
+{
+  PolkitCafeUserChooser *chooser = POLKIT_CAFE_USER_CHOOSER (object);
+
+  switch (prop_id)
+    {
+    case PROP_MODEL:
+      chooser->priv->model = g_value_dup_object (value);
+      break;
+
+    case PROP_PIXBUF_COLUMN:
+      chooser->priv->pixbuf_column = g_value_get_int (value);
+      break;
+
+    case PROP_TEXT_COLUMN:
+      chooser->priv->text_column = g_value_get_int (value);
+      break;
+
+    case PROP_USER_NAME_COLUMN:
+      chooser->priv->user_name_column = g_value_get_int (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+polkit_cafe_user_chooser_get_property (GObject    *object,
+                                       guint       prop_id,
+                                       GValue     *value,
+                                       GParamSpec *pspec)
+{
+  PolkitCafeUserChooser *chooser = POLKIT_CAFE_USER_CHOOSER (object);
+
+  switch (prop_id)
+    {
+    case PROP_SELECTED_USER:
+      g_value_set_string (value, chooser->priv->selected_user);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+polkit_cafe_user_chooser_class_init (PolkitCafeUserChooserClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = polkit_cafe_user_chooser_finalize;
+  gobject_class->get_property = polkit_cafe_user_chooser_get_property;
+  gobject_class->set_property = polkit_cafe_user_chooser_set_property;
+  gobject_class->constructed  = polkit_cafe_user_chooser_constructed;
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_MODEL,
+                                   g_param_spec_object ("model",
+                                                        NULL,
+                                                        NULL,
+                                                        CTK_TYPE_TREE_MODEL,
+                                                        G_PARAM_WRITABLE |
+                                                        G_PARAM_CONSTRUCT_ONLY |
+                                                        G_PARAM_STATIC_NAME |
+                                                        G_PARAM_STATIC_NICK |
+                                                        G_PARAM_STATIC_BLURB));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_PIXBUF_COLUMN,
+                                   g_param_spec_int ("pixbuf-column",
+                                                     NULL,
+                                                     NULL,
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_WRITABLE |
+                                                     G_PARAM_CONSTRUCT_ONLY |
+                                                     G_PARAM_STATIC_NAME |
+                                                     G_PARAM_STATIC_NICK |
+                                                     G_PARAM_STATIC_BLURB));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_TEXT_COLUMN,
+                                   g_param_spec_int ("text-column",
+                                                     NULL,
+                                                     NULL,
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_WRITABLE |
+                                                     G_PARAM_CONSTRUCT_ONLY |
+                                                     G_PARAM_STATIC_NAME |
+                                                     G_PARAM_STATIC_NICK |
+                                                     G_PARAM_STATIC_BLURB));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_USER_NAME_COLUMN,
+                                   g_param_spec_int ("user-name-column",
+                                                     NULL,
+                                                     NULL,
+                                                     0, G_MAXINT, 0,
+                                                     G_PARAM_WRITABLE |
+                                                     G_PARAM_CONSTRUCT_ONLY |
+                                                     G_PARAM_STATIC_NAME |
+                                                     G_PARAM_STATIC_NICK |
+                                                     G_PARAM_STATIC_BLURB));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_SELECTED_USER,
+                                   g_param_spec_string ("selected-user",
+                                                        NULL,
+                                                        NULL,
+                                                        NULL,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_STATIC_NAME |
+                                                        G_PARAM_STATIC_NICK |
+                                                        G_PARAM_STATIC_BLURB));
+
+  /**
+   * PolkitCafeUserChooser::fill-row:
+   * @chooser: A #PolkitCafeUserChooser.
+   * @iter: A #CtkTreeIter for the model passed on construction.
+   *
+   * Emitted once for each row the first time it is about to be shown so
+   * that the real name and face of the user can be filled in lazily.
+   */
+  signals[FILL_ROW_SIGNAL] = g_signal_new ("fill-row",
+                                           POLKIT_CAFE_TYPE_USER_CHOOSER,
+                                           G_SIGNAL_RUN_LAST,
+                                           0,                      /* class offset     */
+                                           NULL,                   /* accumulator      */
+                                           NULL,                   /* accumulator data */
+                                           g_cclosure_marshal_generic,
+                                           G_TYPE_NONE,
+                                           1,
+                                           CTK_TYPE_TREE_ITER);
+}
+
+/**
+ * polkit_cafe_user_chooser_new:
+ * @model: A #CtkTreeModel with one row per user; it must not gain or lose rows.
+ * @pixbuf_column: The column of @model holding the face of the user.
+ * @text_column: The column of @model holding the text to show and search.
+ * @user_name_column: The column of @model holding the login name; rows where it is %NULL are not shown.
+ *
+ * Creates a widget for picking one of a possibly very large number of
+ * users. Typing into its search entry narrows the list down and only
+ * the rows that are on screen are ever measured or rendered.
+ *
+ * Returns: A new #PolkitCafeUserChooser.
+ **/
+CtkWidget *
+polkit_cafe_user_chooser_new (CtkTreeModel *model,
+                              gint          pixbuf_column,
+                              gint          text_column,
+                              gint          user_name_column)
+{
+  return CTK_WIDGET (g_object_new (POLKIT_CAFE_TYPE_USER_CHOOSER,
+                                   "model", model,
+                                   "pixbuf-column", pixbuf_column,
+                                   "text-column", text_column,
+                                   "user-name-column", user_name_column,
+                                   NULL));
+}
+
+/**
+ * polkit_cafe_user_chooser_get_selected_user:
+ * @chooser: A #PolkitCafeUserChooser.
+ *
+ * Gets the user that was last activated in @chooser.
+ *
+ * Returns: The selected user (free with g_free()) or %NULL if no user is selected.
+ **/
+gchar *
+polkit_cafe_user_chooser_get_selected_user (PolkitCafeUserChooser *chooser)
+{
+  return g_strdup (chooser->priv->selected_user);
+}
+
+/**
+ * polkit_cafe_user_chooser_set_selected_user:
+ * @chooser: A #PolkitCafeUserChooser.
+ * @user_name: The user to select.
+ *
+ * Selects @user_name and scrolls to it.
+ **/
+void
+polkit_cafe_user_chooser_set_selected_user (PolkitCafeUserChooser *chooser,
+                                            const gchar           *user_name)
+{
+  PolkitCafeUserChooserPrivate *priv = chooser->priv;
+  gchar *key;
+  gint index;
+
+  if (user_name != priv->selected_user)
+    {
+      g_free (priv->selected_user);
+      priv->selected_user = g_strdup (user_name);
+      g_object_notify (G_OBJECT (chooser), "selected-user");
+    }
+
+  key = g_utf8_casefold (user_name, -1);
+  index = find_prefix_match (chooser, key);
+  if (index >= 0 && strcmp (g_array_index (priv->entries, UserEntry, index).name_key, key) == 0)
+    set_cursor_to_entry (chooser, index);
+  g_free (key);
+}
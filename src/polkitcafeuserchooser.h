@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __POLKIT_CAFE_USER_CHOOSER_H
+#define __POLKIT_CAFE_USER_CHOOSER_H
+
+#include <ctk/ctk.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POLKIT_CAFE_TYPE_USER_CHOOSER            (polkit_cafe_user_chooser_get_type ())
+#define POLKIT_CAFE_USER_CHOOSER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), POLKIT_CAFE_TYPE_USER_CHOOSER, PolkitCafeUserChooser))
+#define POLKIT_CAFE_USER_CHOOSER_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), POLKIT_CAFE_TYPE_USER_CHOOSER, PolkitCafeUserChooserClass))
+#define POLKIT_CAFE_IS_USER_CHOOSER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), POLKIT_CAFE_TYPE_USER_CHOOSER))
+#define POLKIT_CAFE_IS_USER_CHOOSER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), POLKIT_CAFE_TYPE_USER_CHOOSER))
+
+typedef struct _PolkitCafeUserChooser        PolkitCafeUserChooser;
+typedef struct _PolkitCafeUserChooserClass   PolkitCafeUserChooserClass;
+typedef struct _PolkitCafeUserChooserPrivate PolkitCafeUserChooserPrivate;
+
+struct _PolkitCafeUserChooser
+{
+  CtkBox parent_instance;
+  PolkitCafeUserChooserPrivate *priv;
+};
+
+struct _PolkitCafeUserChooserClass
+{
+  CtkBoxClass parent_class;
+};
+
+GType      polkit_cafe_user_chooser_get_type           (void);
+CtkWidget *polkit_cafe_user_chooser_new                (CtkTreeModel          *model,
+                                                        gint                   pixbuf_column,
+                                                        gint                   text_column,
+                                                        gint                   user_name_column);
+gchar     *polkit_cafe_user_chooser_get_selected_user  (PolkitCafeUserChooser *chooser);
+void       polkit_cafe_user_chooser_set_selected_user  (PolkitCafeUserChooser *chooser,
+                                                        const gchar           *user_name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __POLKIT_CAFE_USER_CHOOSER_H */
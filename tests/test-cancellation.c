@@ -0,0 +1,585 @@
+/*
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "config.h"
+
+#include <unistd.h>
+
+#include <polkit/polkit.h>
+#include <polkitagent/polkitagent.h>
+
+#include "polkitcafeidentityresolver.h"
+#include "polkitcafeactioncache.h"
+#include "polkitcafedialogpool.h"
+#include "polkitcafelistener.h"
+
+/* a batch large enough that the workers are still busy when it is
+ * cancelled */
+#define NUM_IDENTITIES 2000
+
+/* the resolver splits a batch across this many worker threads at most,
+ * and each of them may finish the lookup it is in */
+#define MAX_LEFT_BEHIND 4
+
+#define TEST_ACTION_ID "org.mate.polkit-cafe.test"
+#define OTHER_ACTION_ID "org.mate.polkit-cafe.test-other"
+
+typedef struct
+{
+  gboolean done;
+  GError *error;
+} Result;
+
+typedef struct
+{
+  GCancellable *cancellable;
+  Result result;
+} Request;
+
+/* the listener under test and what happened to its dialogs */
+static PolkitAgentListener *listener = NULL;
+static guint num_dialogs = 0;
+static void (*while_first_dialog_is_built) (void) = NULL;
+static Request first;
+static Request second;
+
+static gboolean
+ignore_warnings (const gchar    *log_domain G_GNUC_UNUSED,
+                 GLogLevelFlags  log_level,
+                 const gchar    *message G_GNUC_UNUSED,
+                 gpointer        user_data G_GNUC_UNUSED)
+{
+  /* the resolver warns about every uid that has no user */
+  return (log_level & G_LOG_LEVEL_MASK) != G_LOG_LEVEL_WARNING;
+}
+
+/* runs the main loop until @result is done */
+static void
+wait_for (Result *result)
+{
+  while (!result->done)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+resolve_cb (GObject      *source_object,
+            GAsyncResult *res,
+            gpointer      user_data)
+{
+  Result *result = user_data;
+  GPtrArray *records;
+
+  records = polkit_cafe_identity_resolver_resolve_finish (POLKIT_CAFE_IDENTITY_RESOLVER (source_object),
+                                                          res,
+                                                          &result->error);
+  if (records != NULL)
+    g_ptr_array_unref (records);
+  result->done = TRUE;
+}
+
+static void
+lookup_cb (GObject      *source_object,
+           GAsyncResult *res,
+           gpointer      user_data)
+{
+  Result *result = user_data;
+  PolkitActionDescription *action_desc;
+
+  action_desc = polkit_cafe_action_cache_lookup_finish (POLKIT_CAFE_ACTION_CACHE (source_object),
+                                                        res,
+                                                        &result->error);
+  if (action_desc != NULL)
+    g_object_unref (action_desc);
+  result->done = TRUE;
+}
+
+typedef struct
+{
+  gint gone;
+  guint lookups;
+} ResolverGone;
+
+static void
+resolver_gone_cb (gpointer  user_data,
+                  GObject  *where_the_object_was)
+{
+  ResolverGone *gone = user_data;
+
+  /* the last worker may drop the last reference from its thread */
+  polkit_cafe_identity_resolver_get_stats (POLKIT_CAFE_IDENTITY_RESOLVER (where_the_object_was),
+                                           NULL,
+                                           &gone->lookups);
+  g_atomic_int_set (&gone->gone, TRUE);
+  g_main_context_wakeup (NULL);
+}
+
+static void
+test_resolver_cancel (void)
+{
+  PolkitCafeIdentityResolver *resolver;
+  GCancellable *cancellable;
+  GList *identities;
+  Result result = { FALSE, NULL };
+  ResolverGone gone = { FALSE, 0 };
+  guint lookups_at_cancel;
+  guint n;
+
+  resolver = POLKIT_CAFE_IDENTITY_RESOLVER (g_object_new (POLKIT_CAFE_TYPE_IDENTITY_RESOLVER, NULL));
+
+  /* uids nobody uses, so none of them is cached and each one goes to NSS */
+  identities = NULL;
+  for (n = 0; n < NUM_IDENTITIES; n++)
+    identities = g_list_prepend (identities, polkit_unix_user_new (G_MAXINT32 - n));
+
+  cancellable = g_cancellable_new ();
+  polkit_cafe_identity_resolver_resolve (resolver, identities, cancellable, resolve_cb, &result);
+  g_cancellable_cancel (cancellable);
+  polkit_cafe_identity_resolver_get_stats (resolver, NULL, &lookups_at_cancel);
+
+  wait_for (&result);
+  g_assert_error (result.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+
+  /* every worker holds a reference until it returns, so once the
+   * resolver is gone all of them are done */
+  g_object_weak_ref (G_OBJECT (resolver), resolver_gone_cb, &gone);
+  g_object_unref (resolver);
+  while (!g_atomic_int_get (&gone.gone))
+    g_main_context_iteration (NULL, TRUE);
+
+  /* the workers finish the lookups they are in and start no others */
+  if (g_test_verbose ())
+    g_printerr ("%u of %u lookups left behind after the cancellation\n",
+                gone.lookups - lookups_at_cancel, NUM_IDENTITIES);
+  g_assert_cmpuint (gone.lookups - lookups_at_cancel, <=, MAX_LEFT_BEHIND);
+
+  g_error_free (result.error);
+  g_object_unref (cancellable);
+  g_list_free_full (identities, g_object_unref);
+}
+
+static void
+test_resolver_cancelled_before (void)
+{
+  PolkitCafeIdentityResolver *resolver;
+  GCancellable *cancellable;
+  GList *identities;
+  Result result = { FALSE, NULL };
+  guint lookups;
+
+  resolver = POLKIT_CAFE_IDENTITY_RESOLVER (g_object_new (POLKIT_CAFE_TYPE_IDENTITY_RESOLVER, NULL));
+  identities = g_list_prepend (NULL, polkit_unix_user_new (G_MAXINT32));
+
+  /* a batch for a cancelled request never reaches NSS */
+  cancellable = g_cancellable_new ();
+  g_cancellable_cancel (cancellable);
+  polkit_cafe_identity_resolver_resolve (resolver, identities, cancellable, resolve_cb, &result);
+
+  wait_for (&result);
+  g_assert_error (result.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  polkit_cafe_identity_resolver_get_stats (resolver, NULL, &lookups);
+  g_assert_cmpuint (lookups, ==, 0);
+
+  g_error_free (result.error);
+  g_object_unref (cancellable);
+  g_list_free_full (identities, g_object_unref);
+  g_object_unref (resolver);
+}
+
+static void
+test_resolver_lookup_by_name_miss (void)
+{
+  PolkitCafeIdentityResolver *resolver;
+  PolkitCafeUserRecord *record;
+  guint lookups;
+
+  resolver = POLKIT_CAFE_IDENTITY_RESOLVER (g_object_new (POLKIT_CAFE_TYPE_IDENTITY_RESOLVER, NULL));
+
+  /* a miss is reported right away instead of asking NSS */
+  record = polkit_cafe_identity_resolver_lookup_by_name (resolver, "root");
+  g_assert_null (record);
+  polkit_cafe_identity_resolver_get_stats (resolver, NULL, &lookups);
+  g_assert_cmpuint (lookups, ==, 0);
+
+  g_object_unref (resolver);
+}
+
+static void
+test_action_cache_cancelled (void)
+{
+  PolkitCafeActionCache *cache;
+  GCancellable *cancellable;
+  Result result = { FALSE, NULL };
+
+  cache = POLKIT_CAFE_ACTION_CACHE (g_object_new (POLKIT_CAFE_TYPE_ACTION_CACHE, NULL));
+
+  /* a lookup for a cancelled request must not start an enumeration;
+   * with no authority to enumerate from that would be a critical */
+  cancellable = g_cancellable_new ();
+  g_cancellable_cancel (cancellable);
+  polkit_cafe_action_cache_lookup (cache,
+                                   NULL,
+                                   "org.freedesktop.policykit.exec",
+                                   cancellable,
+                                   lookup_cb,
+                                   &result);
+
+  wait_for (&result);
+  g_assert_error (result.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+
+  g_error_free (result.error);
+  g_object_unref (cancellable);
+  g_object_unref (cache);
+}
+
+/* the authority only needs to describe the test actions */
+static const gchar fake_authority_xml[] =
+  "<node>"
+  "  <interface name='org.freedesktop.PolicyKit1.Authority'>"
+  "    <method name='EnumerateActions'>"
+  "      <arg type='s' name='locale' direction='in'/>"
+  "      <arg type='a(ssssssuuua{ss})' name='action_descriptions' direction='out'/>"
+  "    </method>"
+  "    <signal name='Changed'/>"
+  "  </interface>"
+  "</node>";
+
+static void
+fake_authority_method_call (GDBusConnection       *connection G_GNUC_UNUSED,
+                            const gchar           *sender G_GNUC_UNUSED,
+                            const gchar           *object_path G_GNUC_UNUSED,
+                            const gchar           *interface_name G_GNUC_UNUSED,
+                            const gchar           *method_name,
+                            GVariant              *parameters G_GNUC_UNUSED,
+                            GDBusMethodInvocation *invocation,
+                            gpointer               user_data G_GNUC_UNUSED)
+{
+  static const gchar *action_ids[] = { TEST_ACTION_ID, OTHER_ACTION_ID };
+  GVariantBuilder builder;
+  guint n;
+
+  if (g_strcmp0 (method_name, "EnumerateActions") != 0)
+    {
+      g_dbus_method_invocation_return_dbus_error (invocation,
+                                                  "org.freedesktop.PolicyKit1.Error.NotSupported",
+                                                  "Not supported by the test authority");
+      return;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssssssuuua{ss})"));
+  for (n = 0; n < G_N_ELEMENTS (action_ids); n++)
+    {
+      g_variant_builder_add (&builder,
+                             "(ssssssuuu@a{ss})",
+                             action_ids[n],
+                             "Test action",
+                             "Authentication is required to run the test",
+                             "MATE",
+                             "",
+                             "",
+                             POLKIT_IMPLICIT_AUTHORIZATION_AUTHENTICATION_REQUIRED,
+                             POLKIT_IMPLICIT_AUTHORIZATION_AUTHENTICATION_REQUIRED,
+                             POLKIT_IMPLICIT_AUTHORIZATION_AUTHENTICATION_REQUIRED,
+                             g_variant_new_array (G_VARIANT_TYPE ("{ss}"), NULL, 0));
+    }
+
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(a(ssssssuuua{ss}))", &builder));
+}
+
+static const GDBusInterfaceVTable fake_authority_vtable =
+{
+  fake_authority_method_call,
+  NULL,
+  NULL
+};
+
+static void
+name_acquired_cb (GDBusConnection *connection G_GNUC_UNUSED,
+                  const gchar     *name G_GNUC_UNUSED,
+                  gpointer         user_data)
+{
+  gboolean *acquired = user_data;
+
+  *acquired = TRUE;
+}
+
+/* serves the authority on its own connection to the test bus, so the
+ * agent talks to it the way it talks to polkitd */
+static GDBusConnection *
+fake_authority_start (const gchar *address)
+{
+  GDBusConnection *connection;
+  GDBusNodeInfo *introspection;
+  gboolean acquired;
+  GError *error;
+
+  error = NULL;
+  connection = g_dbus_connection_new_for_address_sync (address,
+                                                       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                       G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                       NULL,
+                                                       NULL,
+                                                       &error);
+  g_assert_no_error (error);
+
+  introspection = g_dbus_node_info_new_for_xml (fake_authority_xml, &error);
+  g_assert_no_error (error);
+  g_dbus_connection_register_object (connection,
+                                     "/org/freedesktop/PolicyKit1/Authority",
+                                     introspection->interfaces[0],
+                                     &fake_authority_vtable,
+                                     NULL,
+                                     NULL,
+                                     &error);
+  g_assert_no_error (error);
+  g_dbus_node_info_unref (introspection);
+
+  acquired = FALSE;
+  g_bus_own_name_on_connection (connection,
+                                "org.freedesktop.PolicyKit1",
+                                G_BUS_NAME_OWNER_FLAGS_NONE,
+                                name_acquired_cb,
+                                NULL,
+                                &acquired,
+                                NULL);
+  while (!acquired)
+    g_main_context_iteration (NULL, TRUE);
+
+  return connection;
+}
+
+/* stands in for opening the display; there is none, so every request
+ * completes as soon as it would have shown its dialog */
+static gboolean
+fake_toolkit_init (void)
+{
+  num_dialogs++;
+
+  if (num_dialogs == 1 && while_first_dialog_is_built != NULL)
+    while_first_dialog_is_built ();
+
+  return FALSE;
+}
+
+static void
+initiate_cb (GObject      *source_object,
+             GAsyncResult *res,
+             gpointer      user_data)
+{
+  Result *result = user_data;
+
+  polkit_agent_listener_initiate_authentication_finish (POLKIT_AGENT_LISTENER (source_object),
+                                                        res,
+                                                        &result->error);
+  result->done = TRUE;
+}
+
+/* requests from this process for the same action coalesce */
+static void
+initiate (Request     *request,
+          const gchar *action_id,
+          const gchar *cookie)
+{
+  PolkitDetails *details;
+  GList *identities;
+  gchar *pid;
+
+  details = polkit_details_new ();
+  pid = g_strdup_printf ("%d", (gint) getpid ());
+  polkit_details_insert (details, "polkit.subject-pid", pid);
+  g_free (pid);
+
+  identities = g_list_prepend (NULL, polkit_unix_user_new (getuid ()));
+
+  request->cancellable = g_cancellable_new ();
+  polkit_agent_listener_initiate_authentication (listener,
+                                                 action_id,
+                                                 "Authentication is required to run the test",
+                                                 NULL,
+                                                 details,
+                                                 cookie,
+                                                 identities,
+                                                 request->cancellable,
+                                                 initiate_cb,
+                                                 &request->result);
+
+  g_list_free_full (identities, g_object_unref);
+  g_object_unref (details);
+}
+
+static void
+request_clear (Request *request)
+{
+  g_clear_object (&request->cancellable);
+  g_clear_error (&request->result.error);
+  request->result.done = FALSE;
+}
+
+static void
+listener_setup (void (*scenario) (void))
+{
+  listener = polkit_cafe_listener_new ();
+  polkit_cafe_listener_set_max_concurrent (POLKIT_CAFE_LISTENER (listener), 1);
+  num_dialogs = 0;
+  while_first_dialog_is_built = scenario;
+}
+
+static void
+listener_teardown (void)
+{
+  request_clear (&first);
+  request_clear (&second);
+  g_clear_object (&listener);
+  while_first_dialog_is_built = NULL;
+}
+
+/* runs the main loop until the second request waits for the first one,
+ * either in the queue or attached to it */
+static void
+wait_until_second_waits (gboolean attached)
+{
+  guint num_queued;
+  guint num_coalesced;
+
+  for (;;)
+    {
+      polkit_cafe_listener_get_stats (POLKIT_CAFE_LISTENER (listener),
+                                      NULL, &num_queued, NULL, NULL, NULL,
+                                      NULL, NULL, NULL, &num_coalesced);
+      if ((attached ? num_coalesced : num_queued) > 0)
+        break;
+
+      g_assert_false (second.result.done);
+      g_main_context_iteration (NULL, TRUE);
+    }
+}
+
+static void
+cancel_queued (void)
+{
+  initiate (&second, OTHER_ACTION_ID, "cookie-second");
+  wait_until_second_waits (FALSE);
+
+  g_cancellable_cancel (second.cancellable);
+  wait_for (&second.result);
+  g_assert_error (second.result.error, POLKIT_ERROR, POLKIT_ERROR_CANCELLED);
+}
+
+static void
+test_listener_cancel_queued (void)
+{
+  listener_setup (cancel_queued);
+
+  initiate (&first, TEST_ACTION_ID, "cookie-first");
+  wait_for (&first.result);
+  g_assert_no_error (first.result.error);
+
+  /* the queued request went away without ever getting a dialog */
+  g_assert_true (second.result.done);
+  g_assert_cmpuint (num_dialogs, ==, 1);
+
+  listener_teardown ();
+}
+
+static void
+cancel_follower (void)
+{
+  initiate (&second, TEST_ACTION_ID, "cookie-second");
+  wait_until_second_waits (TRUE);
+
+  g_cancellable_cancel (second.cancellable);
+  wait_for (&second.result);
+  g_assert_error (second.result.error, POLKIT_ERROR, POLKIT_ERROR_CANCELLED);
+}
+
+static void
+test_listener_cancel_follower (void)
+{
+  listener_setup (cancel_follower);
+
+  initiate (&first, TEST_ACTION_ID, "cookie-first");
+  wait_for (&first.result);
+  g_assert_no_error (first.result.error);
+  g_assert_cmpuint (num_dialogs, ==, 1);
+
+  listener_teardown ();
+}
+
+static void
+cancel_leader (void)
+{
+  initiate (&second, TEST_ACTION_ID, "cookie-second");
+  wait_until_second_waits (TRUE);
+
+  g_cancellable_cancel (first.cancellable);
+}
+
+static void
+test_listener_cancel_leader (void)
+{
+  listener_setup (cancel_leader);
+
+  initiate (&first, TEST_ACTION_ID, "cookie-first");
+  wait_for (&first.result);
+  g_assert_error (first.result.error, POLKIT_ERROR, POLKIT_ERROR_CANCELLED);
+
+  /* the follower is not cancelled with its leader, it gets a dialog of
+   * its own instead */
+  wait_for (&second.result);
+  g_assert_no_error (second.result.error);
+  g_assert_cmpuint (num_dialogs, ==, 2);
+
+  listener_teardown ();
+}
+
+int
+main (int argc, char **argv)
+{
+  GTestDBus *bus;
+  GDBusConnection *authority_connection;
+  gint ret;
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_log_set_fatal_handler (ignore_warnings, NULL);
+
+  /* the agent finds the fake authority on the system bus */
+  bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (bus);
+  g_setenv ("DBUS_SYSTEM_BUS_ADDRESS", g_test_dbus_get_bus_address (bus), TRUE);
+  authority_connection = fake_authority_start (g_test_dbus_get_bus_address (bus));
+
+  polkit_cafe_dialog_pool_set_init_func (polkit_cafe_dialog_pool_get_default (), fake_toolkit_init);
+
+  g_test_add_func ("/cancellation/identity-resolver", test_resolver_cancel);
+  g_test_add_func ("/cancellation/identity-resolver-cancelled-before", test_resolver_cancelled_before);
+  g_test_add_func ("/cancellation/identity-resolver-name-miss", test_resolver_lookup_by_name_miss);
+  g_test_add_func ("/cancellation/action-cache", test_action_cache_cancelled);
+  g_test_add_func ("/cancellation/listener-queued", test_listener_cancel_queued);
+  g_test_add_func ("/cancellation/listener-follower", test_listener_cancel_follower);
+  g_test_add_func ("/cancellation/listener-leader", test_listener_cancel_leader);
+
+  ret = g_test_run ();
+
+  g_object_unref (authority_connection);
+  g_test_dbus_down (bus);
+  g_object_unref (bus);
+
+  return ret;
+}